@@ -0,0 +1,1524 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file cache.c
+ * @brief Whole responses kept for as long as the onion allows
+ * @author Mike Mestnik
+ *
+ * Responses are kept as the client got them, the head without its framing
+ * and the body without chunks, so a hit from either front end goes out with
+ * a Content-Length and never reaches http_new().  They are found by a digest
+ * of onion, target and the coding the client would be sent; responses that
+ * Vary on more hang off the same key, told apart by a digest of the
+ * request's values for those fields.  What the onion compressed itself may
+ * not be in the coding of the key, so a copy only answers clients that take
+ * its Content-Encoding.
+ *
+ * The byte budget is a segmented LRU.  New entries start on probation and
+ * only a hit moves one to the protected segment, so a crawl through
+ * thousands of pages asked for once can't push out what is asked for all the
+ * time.  Everything kept is also handed to the disk tier, which answers
+ * what memory no longer holds.
+ *
+ * With peers configured, each key is owned by one gateway of the cluster
+ * and what is kept here is also handed to its owner.
+ *
+ * Bodies are kept by a digest of their bytes, taken as they come in, and
+ * shared by every response that has the same ones.  Mirrors and onions
+ * built on the same framework serve the same scripts and images under
+ * different names, each of those only costs its head.
+ *
+ * The snapshot only holds which responses were kept and in what order, a
+ * restart reads them back from the disk tier a batch at a time while the
+ * gateway already answers.
+ */
+
+#include "cache.h"
+#include "disk.h"
+#include "peer.h"
+#include "snapshot.h"
+#include "header.h"
+#include "codec.h"
+#include "hextree.h"
+#include "schedule.h"
+#include "stats.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+// No one response may take more of the budget than this share.
+#define CACHE_OBJECT_SHARE 8
+// Percent of the budget the protected segment may hold.
+#define CACHE_PROTECTED 80
+// What a client that shares a fetch may have waiting to go out.
+#define CACHE_WINDOW (64 << 10)
+// Seconds before a refresh that never came back is tried again.
+#define CACHE_REFRESH_AGAIN 30
+// Responses read back from disk after a restart each time through the loop.
+#define CACHE_RESTORE_BATCH 256
+
+typedef enum
+{
+  CACHE_PROBATION,
+  CACHE_PROTECTED_SEGMENT,
+  CACHE_SEGMENTS,
+} cache_segment_t;
+
+/* A body as kept, shared by every response with the same bytes. */
+typedef struct cache_body
+{
+  hexnode_h node; // NULL until its digest is known.
+  size_t refs;
+  sendbuf_h data;
+} cache_body_t;
+typedef struct cache_body *cache_body_h;
+
+typedef struct cache
+{
+  hexnode_h node; // NULL until stored.
+  cache_h sibling; // Another Vary of the same key.
+  cache_h prev; // Towards the most recently used.
+  cache_h next;
+  cache_segment_t segment;
+  unsigned char key[CACHE_KEY];
+  char *vary; // Lower case field names, comma separated.
+  unsigned char vary_key[CACHE_KEY];
+  time_t date; // When the onion made it, as far as can be told.
+  time_t expires;
+  time_t stale; // Goes out late until then while it is refreshed.
+  time_t stale_error; // Stands in until then for an onion that can't answer.
+  time_t refreshed; // When a refresh was last asked for.
+  sendbuf_h head; // Status line and fields, each with its line end.
+  cache_body_h body;
+  gnutls_hash_hd_t hash; // Of the body so far, NULL once it is done.
+  size_t size; // As if the body wasn't shared, for the segments.
+  flight_h flight; // Clients are still being sent it.
+  bool oversize; // Only kept for the flight.
+  char *origin; // Hostname and target, each with its NUL, until cache_end().
+  codec_type_t coding; // The one in the key.
+} cache_t;
+
+typedef struct subscriber *subscriber_h;
+
+/* A fetch others wait on.  It is found by key from the request's until the
+ * response is complete, and lives on until the leader's request is done and
+ * the last subscriber has been sent everything. */
+typedef struct flight
+{
+  hexnode_h node; // NULL once no one else may join.
+  cache_h c; // The leader's response as it comes, NULL before its head.
+  Vector subscribers; // Of subscriber_h.
+  bool leading; // The leader's request is still out.
+  bool done; // c is complete.
+} flight_t;
+
+typedef struct subscriber
+{
+  flight_h flight; // NULL for the refresh of a stale copy.
+  http_request_t request;
+  sendbuf_h head; // The request, in case it has to go upstream after all.
+  size_t sent; // Of the body.
+  bool head_only;
+  bool started;
+  bool pumping;
+} subscriber_t;
+
+/* What the snapshot holds of each response, the rest is on disk. */
+typedef struct
+{
+  unsigned char key[CACHE_KEY];
+  unsigned char vary_key[CACHE_KEY];
+  uint32_t segment;
+  uint32_t reserved;
+} cache_snapshot_t;
+
+static hexnode_h hexnode;
+static hexnode_h flights;
+static hexnode_h bodies;
+// What is really held, each shared body counted once.
+static size_t held;
+static struct
+{
+  cache_h head;
+  cache_h tail;
+  size_t size;
+} segments[CACHE_SEGMENTS];
+static cache_snapshot_t *restoring = NULL; // Least recently used first.
+static size_t restore_len, restore_next;
+static int restore_instanceid;
+
+void
+cache_init ()
+{
+  hexnode = hexnode_new (0, NULL);
+  flights = hexnode_new (0, NULL);
+  bodies = hexnode_new (0, NULL);
+}
+
+/* The value of the first field called name in the request head b, trailing
+ * whitespace dropped, NULL if it has none.  The heads here are built by the
+ * front ends, one field to a line. */
+static const char *
+cache_field (const char *b, size_t len, const char *name, size_t *vlen)
+{
+  const char *e = b + len, *p, *nl, *v;
+  size_t name_len = strlen (name);
+  for (p = memchr (b, '\n', len); NULL != p; p = nl)
+    {
+      p++;
+      nl = memchr (p, '\n', e - p);
+      if (NULL == nl || p == nl || (p + 1 == nl && '\r' == *p))
+	break;
+      if ((size_t) (nl - p) <= name_len || ':' != p[name_len]
+	  || 0 != strncasecmp (p, name, name_len))
+	continue;
+      for (v = p + name_len + 1; v < nl && (' ' == *v || '\t' == *v); v++)
+	;
+      for (; nl > v && (' ' == nl[-1] || '\t' == nl[-1] || '\r' == nl[-1]);
+	  nl--)
+	;
+      *vlen = nl - v;
+      return v;
+    }
+  return NULL;
+}
+
+/* Whether the client that sent the request head b takes a response in the
+ * Content-Encoding v, NULL for none. */
+static bool
+cache_takes (const char *b, size_t len, const char *v, size_t vlen)
+{
+  codec_type_t coding;
+  const char *a;
+  size_t alen;
+  if (NULL == v || CODEC_IDENTITY == (coding = codec_lookup (v, vlen)))
+    return true;
+  a = cache_field (b, len, "Accept-Encoding", &alen);
+  return CODEC_UNKNOWN != coding && NULL != a
+      && 0 != (codec_accept (a, alen) & 1 << coding);
+}
+
+/* The same for the head of a kept copy. */
+static bool
+cache_takes_head (const char *b, size_t len, const char *head,
+		  size_t head_len)
+{
+  const char *v;
+  size_t vlen;
+  v = cache_field (head, head_len, "Content-Encoding", &vlen);
+  return cache_takes (b, len, v, vlen);
+}
+
+/* Looks for the Cache-Control directive name in [p, e), with its value in
+ * *value when there is one. */
+static bool
+cache_directive (const char *p, const char *e, const char *name, long *value)
+{
+  size_t len = strlen (name);
+  const char *comma;
+  for (; p < e; p = comma + 1)
+    {
+      while (p < e && (' ' == *p || '\t' == *p || ',' == *p))
+	p++;
+      if (NULL == (comma = memchr (p, ',', e - p)))
+	comma = e;
+      if ((size_t) (comma - p) < len || 0 != strncasecmp (p, name, len))
+	continue;
+      p += len;
+      if (p < comma && '=' == *p)
+	{
+	  if (NULL == value)
+	    return true;
+	  if (++p < comma && '"' == *p)
+	    p++;
+	  for (*value = 0;
+	      p < comma && '0' <= *p && '9' >= *p && *value < 1L << 40; p++)
+	    *value = *value * 10 + (*p - '0');
+	  return true;
+	}
+      if (p == comma || ' ' == *p || '\t' == *p)
+	return true;
+    }
+  return false;
+}
+
+/* An IMF-fixdate, -1 for anything else. */
+static time_t
+cache_date (const char *p, size_t len)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char buf[32], month[4];
+  const char *m;
+  struct tm tm;
+  if (sizeof(buf) <= len)
+    return -1;
+  memcpy (buf, p, len);
+  buf[len] = 0;
+  memset (&tm, 0, sizeof(tm));
+  if (6
+      != sscanf (buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, month,
+		 &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec)
+      || 3 != strlen (month) || NULL == (m = strstr (months, month))
+      || 0 != (m - months) % 3)
+    return -1;
+  tm.tm_mon = (m - months) / 3;
+  tm.tm_year -= 1900;
+  return timegm (&tm);
+}
+
+/* Whether the request head b may be answered from, or fill, the cache and
+ * the coding the client would be sent. */
+static bool
+cache_request (const char *b, size_t len, bool serve, codec_type_t *coding)
+{
+  const char *v;
+  size_t vlen;
+  long age = -1;
+  if (!(4 <= len && 0 == memcmp (b, "GET ", 4))
+      && !(serve && 5 <= len && 0 == memcmp (b, "HEAD ", 5)))
+    return false;
+  // What needs a password is nobody else's business.
+  if (NULL != cache_field (b, len, "Authorization", &vlen))
+    return false;
+  // A reload asks for the onion's copy, which then replaces this one.
+  if (serve && NULL != (v = cache_field (b, len, "Cache-Control", &vlen))
+      && (cache_directive (v, v + vlen, "no-cache", NULL)
+	  || (cache_directive (v, v + vlen, "max-age", &age) && 0 == age)))
+    return false;
+  if (serve && NULL != (v = cache_field (b, len, "Pragma", &vlen))
+      && cache_directive (v, v + vlen, "no-cache", NULL))
+    return false;
+  v = cache_field (b, len, "Accept-Encoding", &vlen);
+  *coding = codec_choose (NULL == v ? 0 : codec_accept (v, vlen));
+  return true;
+}
+
+/* Where a response to target on hostname is kept for clients that get it
+ * in coding. */
+bool
+cache_key (const char *hostname, const char *target, codec_type_t coding,
+	   unsigned char key[CACHE_KEY])
+{
+  gnutls_hash_hd_t hd;
+  unsigned char c = coding;
+  if (0 > gnutls_hash_init (&hd, GNUTLS_DIG_SHA256))
+    return false; // LCOV_EXCL_LINE
+  gnutls_hash (hd, hostname, strlen (hostname) + 1);
+  gnutls_hash (hd, target, strlen (target) + 1);
+  gnutls_hash (hd, &c, 1);
+  gnutls_hash_deinit (hd, key);
+  return true;
+}
+
+/* The request's values for the fields a response Varies on.  The coding is
+ * in the key and checked by cache_takes(), so Accept-Encoding never makes it
+ * into vary. */
+static bool
+cache_vary_key (const char *vary, const char *b, size_t len,
+		unsigned char key[CACHE_KEY])
+{
+  gnutls_hash_hd_t hd;
+  char name[64];
+  const char *v, *comma;
+  size_t vlen;
+  if (0 > gnutls_hash_init (&hd, GNUTLS_DIG_SHA256))
+    return false; // LCOV_EXCL_LINE
+  for (; NULL != vary && *vary; vary = *comma ? comma + 1 : comma)
+    {
+      if (NULL == (comma = strchr (vary, ',')))
+	comma = vary + strlen (vary);
+      snprintf (name, sizeof(name), "%.*s", (int) (comma - vary), vary);
+      v = cache_field (b, len, name, &vlen);
+      gnutls_hash (hd, name, strlen (name) + 1);
+      // An absent field and an empty one are different requests.
+      if (NULL != v)
+	gnutls_hash (hd, v, vlen);
+      gnutls_hash (hd, NULL == v ? "\0" : "\1", 1);
+    }
+  gnutls_hash_deinit (hd, key);
+  return true;
+}
+
+static void
+cache_unlink (cache_h c)
+{
+  if (NULL != c->prev)
+    c->prev->next = c->next;
+  else
+    segments[c->segment].head = c->next;
+  if (NULL != c->next)
+    c->next->prev = c->prev;
+  else
+    segments[c->segment].tail = c->prev;
+  c->prev = c->next = NULL;
+  segments[c->segment].size -= c->size;
+}
+
+static void
+cache_push (cache_h c, cache_segment_t segment)
+{
+  c->segment = segment;
+  c->next = segments[segment].head;
+  if (NULL != c->next)
+    c->next->prev = c;
+  segments[segment].head = c;
+  if (NULL == segments[segment].tail)
+    segments[segment].tail = c;
+  segments[segment].size += c->size;
+}
+
+static cache_body_h
+cache_body_new ()
+{
+  cache_body_h body = NULL;
+  while (NULL == body)
+    body = malloc (sizeof(cache_body_t));
+  *body = (cache_body_t
+	)
+	  { .node = NULL, .refs = 1, .data = NULL, };
+  return body;
+}
+
+static void
+cache_body_release (cache_body_h body)
+{
+  if (0 != --body->refs)
+    return;
+  if (NULL != body->node)
+    {
+      held -= get_sendbuf_size (body->data);
+      body->node->data = NULL;
+      hexnode_delete (bodies, body->node->depth, body->node->node);
+    }
+  sendbuf_clear (&body->data);
+  free (body);
+}
+
+/* c's body is complete, with digest as its name.  It is kept once, if the
+ * same bytes already are c shares those. */
+static void
+cache_body_share (cache_h c, const unsigned char digest[CACHE_KEY])
+{
+  hexnode_h node = hexnode_lookup (bodies, CACHE_KEY, digest, true);
+  cache_body_h body = node->data;
+  if (NULL == body)
+    {
+      node->data = c->body;
+      c->body->node = node;
+      held += get_sendbuf_size (c->body->data);
+      return;
+    }
+  stats_inc (STATS_CACHE_SHARED);
+  stats_add (STATS_CACHE_SHARED_BYTES, get_sendbuf_size (body->data));
+  body->refs++;
+  cache_body_release (c->body);
+  c->body = body;
+}
+
+static void
+cache_free (cache_h c)
+{
+  free (c->vary);
+  free (c->origin);
+  sendbuf_clear (&c->head);
+  cache_body_release (c->body);
+  if (NULL != c->hash)
+    gnutls_hash_deinit (c->hash, NULL);
+  free (c);
+}
+
+static void
+cache_delete (cache_h c)
+{
+  cache_h *p;
+  cache_unlink (c);
+  held -= c->size - get_sendbuf_size (c->body->data);
+  for (p = (cache_h*) &c->node->data; *p != c; p = &(*p)->sibling)
+    ;
+  *p = c->sibling;
+  if (NULL == c->node->data)
+    hexnode_delete (hexnode, c->node->depth, c->node->node);
+  c->node = NULL;
+  // Its flight still reads it and frees it when done.
+  if (NULL == c->flight)
+    cache_free (c);
+}
+
+/* Probation goes first, protected only once probation is empty. */
+static void
+cache_evict ()
+{
+  while ((size_t) CONF.cache_size < held
+      && (NULL != segments[CACHE_PROBATION].tail
+	  || NULL != segments[CACHE_PROTECTED_SEGMENT].tail))
+    {
+      stats_inc (STATS_CACHE_EVICTIONS);
+      if (NULL != segments[CACHE_PROBATION].tail)
+	cache_delete (segments[CACHE_PROBATION].tail);
+      else
+	cache_delete (segments[CACHE_PROTECTED_SEGMENT].tail);
+    }
+}
+
+/* A hit earns protection, what that crowds out gets another chance on
+ * probation. */
+static void
+cache_touch (cache_h c)
+{
+  cache_unlink (c);
+  cache_push (c, CACHE_PROTECTED_SEGMENT);
+  while ((size_t) CONF.cache_size / 100 * CACHE_PROTECTED
+      < segments[CACHE_PROTECTED_SEGMENT].size)
+    {
+      cache_h old = segments[CACHE_PROTECTED_SEGMENT].tail;
+      cache_unlink (old);
+      cache_push (old, CACHE_PROBATION);
+    }
+}
+
+static void
+cache_insert (cache_h c)
+{
+  hexnode_h node;
+  cache_h old;
+  node = hexnode_lookup (hexnode, CACHE_KEY, c->key, true);
+  for (old = node->data; NULL != old; old = old->sibling)
+    if (0 == memcmp (old->vary_key, c->vary_key, CACHE_KEY)
+	&& (old->vary == c->vary
+	    || (NULL != old->vary && NULL != c->vary
+		&& 0 == strcmp (old->vary, c->vary))))
+      {
+	cache_delete (old);
+	// The delete may have taken the node with it.
+	node = hexnode_lookup (hexnode, CACHE_KEY, c->key, true);
+	break;
+      }
+  c->node = node;
+  c->sibling = node->data;
+  node->data = c;
+  c->size = sizeof(cache_t) + get_sendbuf_size (c->head)
+      + get_sendbuf_size (c->body->data)
+      + (NULL == c->vary ? 0 : strlen (c->vary));
+  held += c->size - get_sendbuf_size (c->body->data);
+  cache_push (c, CACHE_PROBATION);
+  cache_evict ();
+}
+
+/* The copy kept for key that answers the request head b, if any. */
+static cache_h
+cache_find (const unsigned char key[CACHE_KEY], const char *b, size_t len)
+{
+  unsigned char vary_key[CACHE_KEY];
+  hexnode_h node;
+  cache_h c;
+  node = hexnode_lookup (hexnode, CACHE_KEY, key, false);
+  for (c = NULL == node ? NULL : node->data; NULL != c; c = c->sibling)
+    if (cache_vary_key (c->vary, b, len, vary_key)
+	&& 0 == memcmp (vary_key, c->vary_key, CACHE_KEY)
+	&& cache_takes_head (b, len, get_sendbuf_buf (c->head),
+			     get_sendbuf_size (c->head)))
+      break;
+  return c;
+}
+
+/* Where an answer goes, a client's response or a peer's buffer. */
+typedef struct
+{
+  response_h output;
+  sendbuf_h *buf;
+} cache_out_t;
+
+/* A HEAD request b gets everything but the body. */
+static void
+cache_send (cache_out_t *out, const char *b, const void *head,
+	    size_t head_len, const void *body, size_t body_len, time_t date,
+	    time_t now)
+{
+  char age[32], length[48];
+  struct iovec iov[4];
+  iov[0] = (struct iovec
+	)
+	  { .iov_base = (void*) head, .iov_len = head_len, };
+  iov[1] = (struct iovec
+	)
+	  { .iov_base = age, .iov_len = snprintf (age, sizeof(age),
+						  "Age: %lld\r\n",
+						  (long long) (now - date)), };
+  iov[2] = (struct iovec
+	)
+	  { .iov_base = length, .iov_len = snprintf (length, sizeof(length),
+						     "Content-Length: %zu\r\n\r\n",
+						     body_len), };
+  iov[3] = (struct iovec
+	)
+	  { .iov_base = (void*) body, .iov_len = 'H' == b[0] ? 0 : body_len, };
+  if (NULL == out->output)
+    {
+      sendbuf_appendv (out->buf, iov, 4);
+      return;
+    }
+  response_sendv (out->output, iov, 4);
+  out->output->eof = true;
+  response_send (out->output, NULL, 0);
+}
+
+typedef struct
+{
+  const char *b;
+  size_t len;
+} cache_request_t;
+
+static bool
+cache_disk_match (const char *vary, const unsigned char vary_key[CACHE_KEY],
+		  void *c)
+{
+  cache_request_t *r = c;
+  unsigned char key[CACHE_KEY];
+  return cache_vary_key (vary, r->b, r->len, key)
+      && 0 == memcmp (key, vary_key, CACHE_KEY);
+}
+
+static cache_h
+cache_keep (const unsigned char key[CACHE_KEY], const char *vary,
+	    const unsigned char vary_key[CACHE_KEY], time_t date,
+	    time_t expires, const void *head, size_t head_len,
+	    const void *body, size_t body_len)
+{
+  unsigned char digest[CACHE_KEY];
+  cache_h c = NULL;
+  if (0 >= CONF.cache_size
+      || (size_t) CONF.cache_size / CACHE_OBJECT_SHARE < body_len
+      || 0 > gnutls_hash_fast (GNUTLS_DIG_SHA256, body, body_len, digest))
+    return NULL;
+  while (NULL == c)
+    c = malloc (sizeof(cache_t));
+  *c = (cache_t
+	)
+	  { .node = NULL, .sibling = NULL, .prev = NULL, .next = NULL, .vary =
+	  NULL, .date = date, .expires = expires, .stale = expires,
+	      .stale_error = expires, .refreshed = 0, .head = NULL, .body =
+	      cache_body_new (), .hash = NULL, .flight = NULL, .oversize =
+	      false, .origin = NULL, .coding = CODEC_IDENTITY, };
+  memcpy (c->key, key, CACHE_KEY);
+  memcpy (c->vary_key, vary_key, CACHE_KEY);
+  if (NULL != vary)
+    while (NULL == c->vary)
+      c->vary = strdup (vary);
+  sendbuf_append (&c->head, head, head_len);
+  sendbuf_append (&c->body->data, body, body_len);
+  cache_body_share (c, digest);
+  cache_insert (c);
+  return c;
+}
+
+/* Keeps a response that was complete elsewhere, on disk or at a peer. */
+void
+cache_adopt (const unsigned char key[CACHE_KEY], const char *vary,
+	     const unsigned char vary_key[CACHE_KEY], time_t date,
+	     time_t expires, const void *head, size_t head_len,
+	     const void *body, size_t body_len)
+{
+  cache_keep (key, vary, vary_key, date, expires, head, head_len, body,
+	      body_len);
+}
+
+/* What was found on disk goes out straight from the mapping, and back in
+ * memory since it was asked for again. */
+static bool
+cache_serve_disk (cache_out_t *out, const unsigned char key[CACHE_KEY],
+		  const char *b, size_t len, time_t now)
+{
+  cache_request_t r =
+    { .b = b, .len = len, };
+  unsigned char vary_key[CACHE_KEY];
+  disk_record_t record;
+  if (!disk_find (key, &cache_disk_match, &r, &record)
+      || !cache_takes_head (b, len, record.head, record.head_len))
+    return false;
+  stats_inc (STATS_CACHE_HITS);
+  stats_inc (STATS_DISK_HITS);
+  cache_send (out, b, record.head, record.head_len, record.body,
+	      record.body_len, record.date, now);
+  // disk_find() only returns a record whose vary_key this one matches.
+  cache_vary_key (record.vary, b, len, vary_key);
+  cache_adopt (key, record.vary, vary_key, record.date, record.expires,
+	       record.head, record.head_len, record.body, record.body_len);
+  return true;
+}
+
+static void
+cache_refresh (cache_h, const char*, const char*, const char*, size_t,
+	       time_t);
+
+/* The key the request head b is kept under, false when it may not be
+ * answered from the cache. */
+bool
+cache_request_key (const char *hostname, const char *target, const char *b,
+		   size_t len, unsigned char key[CACHE_KEY])
+{
+  codec_type_t coding;
+  return 0 < CONF.cache_size && NULL != target
+      && cache_request (b, len, true, &coding)
+      && cache_key (hostname, target, coding, key);
+}
+
+static bool
+cache_lookup (cache_out_t *out, const char *hostname, const char *target,
+	      const char *b, size_t len)
+{
+  unsigned char key[CACHE_KEY];
+  cache_h c;
+  time_t now;
+  if (!cache_request_key (hostname, target, b, len, key))
+    return false;
+  stats_inc (STATS_CACHE_LOOKUPS);
+  now = time (NULL);
+  c = cache_find (key, b, len);
+  if (NULL != c && now >= c->stale && now >= c->stale_error)
+    {
+      cache_delete (c);
+      c = NULL;
+    }
+  if (NULL == c)
+    return cache_serve_disk (out, key, b, len, now);
+  // Kept only in case the onion can't be reached.
+  if (now >= c->stale)
+    return false;
+  // A late answer now beats a fresh one after a trip through Tor.
+  if (now >= c->expires)
+    {
+      stats_inc (STATS_CACHE_STALE);
+      cache_refresh (c, hostname, target, b, len, now);
+    }
+  stats_inc (STATS_CACHE_HITS);
+  cache_touch (c);
+  cache_send (out, b, get_sendbuf_buf (c->head), get_sendbuf_size (c->head),
+	      get_sendbuf_buf (c->body->data),
+	      get_sendbuf_size (c->body->data), c->date, now);
+  return true;
+}
+
+/* Answers the request head b from the cache, true when it did. */
+bool
+cache_serve (response_h output, const char *hostname, const char *target,
+	     const char *b, size_t len)
+{
+  cache_out_t out =
+    { .output = output, .buf = NULL, };
+  return cache_lookup (&out, hostname, target, b, len);
+}
+
+/* The same for a peer that owns none of it, the answer is appended to buf. */
+bool
+cache_serve_peer (sendbuf_h *buf, const char *hostname, const char *target,
+		  const char *b, size_t len)
+{
+  cache_out_t out =
+    { .output = NULL, .buf = buf, };
+  return cache_lookup (&out, hostname, target, b, len);
+}
+
+/* Answers b with what is kept for it even past its expiry, for when the
+ * onion can't be asked.  True when it did. */
+bool
+cache_serve_stale (response_h output, const char *hostname,
+		   const char *target, const char *b, size_t len)
+{
+  cache_out_t out =
+    { .output = output, .buf = NULL, };
+  unsigned char key[CACHE_KEY];
+  cache_h c;
+  time_t now = time (NULL);
+  if (!cache_request_key (hostname, target, b, len, key)
+      || NULL == (c = cache_find (key, b, len)) || now >= c->stale_error)
+    return false;
+  stats_inc (STATS_CACHE_STALE_IF_ERROR);
+  cache_send (&out, b, get_sendbuf_buf (c->head),
+	      get_sendbuf_size (c->head), get_sendbuf_buf (c->body->data),
+	      get_sendbuf_size (c->body->data), c->date, now);
+  return true;
+}
+
+typedef struct
+{
+  long lifetime; // -1 when the response doesn't say.
+  long age;
+  long stale; // Seconds past expiry it may go out while it is refreshed.
+  long stale_error; // And for an onion that can't be reached.
+  const char *vary;
+  const char *vary_end;
+} cache_freshness_t;
+
+/* Reads what the head d indexed by fields says about keeping it, false when
+ * it must not be. */
+static bool
+cache_freshness (const char *d, Vector *fields, time_t now,
+		 cache_freshness_t *fresh)
+{
+  time_t date = -1, expires = -1;
+  long max_age = -1, s_maxage = -1;
+  bool revalidate = false;
+  *fresh = (cache_freshness_t
+	)
+	  { .lifetime = -1, .age = 0, .stale = -1, .stale_error = -1, .vary =
+	  NULL, .vary_end = NULL, };
+  VECTOR_FOR_EACH(fields, i)
+    {
+      const header_field_t *field;
+      const char *p, *e;
+      field = (const header_field_t*) iterator_get (&i);
+      p = d + field->value;
+      e = p + field->value_len;
+      switch (field->id)
+	{
+	case HEADER_SET_COOKIE:
+	  return false;
+	case HEADER_CACHE_CONTROL:
+	  if (cache_directive (p, e, "no-store", NULL)
+	      || cache_directive (p, e, "no-cache", NULL)
+	      || cache_directive (p, e, "private", NULL))
+	    return false;
+	  cache_directive (p, e, "max-age", &max_age);
+	  cache_directive (p, e, "s-maxage", &s_maxage);
+	  cache_directive (p, e, "stale-while-revalidate", &fresh->stale);
+	  cache_directive (p, e, "stale-if-error", &fresh->stale_error);
+	  if (cache_directive (p, e, "must-revalidate", NULL)
+	      || cache_directive (p, e, "proxy-revalidate", NULL))
+	    revalidate = true;
+	  break;
+	case HEADER_PRAGMA:
+	  if (cache_directive (p, e, "no-cache", NULL))
+	    return false;
+	  break;
+	case HEADER_EXPIRES:
+	  // One that can't be read has already passed.
+	  if (-1 == (expires = cache_date (p, e - p)))
+	    return false;
+	  break;
+	case HEADER_DATE:
+	  date = cache_date (p, e - p);
+	  break;
+	case HEADER_AGE:
+	  for (; p < e && '0' <= *p && '9' >= *p && fresh->age < 1L << 40; p++)
+	    fresh->age = fresh->age * 10 + (*p - '0');
+	  break;
+	case HEADER_VARY:
+	  if (cache_directive (p, e, "*", NULL))
+	    return false;
+	  fresh->vary = p;
+	  fresh->vary_end = e;
+	  break;
+	default:
+	  break;
+	}
+    }
+  // This is a shared cache, s-maxage is meant for it.
+  if (0 <= s_maxage)
+    fresh->lifetime = s_maxage;
+  else if (0 <= max_age)
+    fresh->lifetime = max_age;
+  else if (-1 != expires)
+    fresh->lifetime = expires - (-1 == date ? now : date);
+  if (revalidate)
+    fresh->stale = fresh->stale_error = 0;
+  if (0 > fresh->stale)
+    fresh->stale = 0;
+  // Unless told otherwise, a stale copy beats no answer at all.
+  if (0 > fresh->stale_error)
+    fresh->stale_error = CONF.cache_stale;
+  return true;
+}
+
+static void
+cache_set_freshness (cache_h c, const cache_freshness_t *fresh, time_t now)
+{
+  c->date = now - fresh->age;
+  c->expires = c->date + fresh->lifetime;
+  c->stale = c->expires + fresh->stale;
+  c->stale_error = c->expires + fresh->stale_error;
+  c->refreshed = 0;
+}
+
+/* Starts keeping the response whose head d is indexed by fields, or NULL
+ * when it can't be kept.  b is the request as it went upstream. */
+static cache_h
+cache_new (const char *hostname, const char *target, const char *b,
+	   size_t len, const char *d, size_t status_len, Vector *fields)
+{
+  codec_type_t coding;
+  time_t now = time (NULL);
+  cache_freshness_t fresh;
+  const char *vary;
+  char *names = NULL, *n;
+  cache_h c = NULL;
+  int status;
+  if (0 >= CONF.cache_size || NULL == target || 12 > status_len
+      || !cache_request (b, len, false, &coding))
+    return NULL;
+  // What is kept by default once the onion says for how long.
+  status = atoi (d + 9);
+  if (200 != status && 203 != status && 204 != status && 300 != status
+      && 301 != status && 308 != status && 404 != status && 405 != status
+      && 410 != status && 414 != status && 501 != status)
+    return NULL;
+  if (!cache_freshness (d, fields, now, &fresh) || fresh.lifetime <= fresh.age)
+    return NULL;
+  if (NULL != (vary = fresh.vary))
+    {
+      while (NULL == names)
+	names = malloc (fresh.vary_end - vary + 1);
+      for (n = names; vary < fresh.vary_end; vary++)
+	if (' ' != *vary && '\t' != *vary)
+	  *n++ = tolower ((unsigned char) *vary);
+      *n = 0;
+      // Told apart by the coding, see cache_takes().
+      while (NULL != (n = strstr (names, "accept-encoding")))
+	{
+	  const char *rest = n + 15 + (',' == n[15]);
+	  memmove (n, rest, strlen (rest) + 1);
+	}
+      n = names + strlen (names);
+      if (n > names && ',' == n[-1])
+	n[-1] = 0;
+      if (0 == *names)
+	{
+	  free (names);
+	  names = NULL;
+	}
+    }
+  while (NULL == c)
+    c = malloc (sizeof(cache_t));
+  *c = (cache_t
+	)
+	  { .node = NULL, .sibling = NULL, .prev = NULL, .next = NULL, .vary =
+	  names, .head = NULL, .body = cache_body_new (), .hash = NULL,
+	      .flight = NULL, .oversize = false, .origin = NULL, .coding =
+	      coding, };
+  cache_set_freshness (c, &fresh, now);
+  // The owner of the key recomputes it from these, see peer_store().
+  while (NULL == c->origin)
+    c->origin = malloc (strlen (hostname) + strlen (target) + 2);
+  strcpy (stpcpy (c->origin, hostname) + 1, target);
+  if (0 > gnutls_hash_init (&c->hash, GNUTLS_DIG_SHA256))
+    c->hash = NULL; // LCOV_EXCL_LINE
+  if (NULL == c->hash || !cache_key (hostname, target, coding, c->key)
+      || !cache_vary_key (c->vary, b, len, c->vary_key))
+    {
+      cache_abort (c); // LCOV_EXCL_LINE
+      return NULL; // LCOV_EXCL_LINE
+    }
+  return c;
+}
+
+/* A 304 for a copy kept here makes it fresh again, as long as it is the copy
+ * the onion still has.  The disk copy keeps the expiry it was written with. */
+static void
+cache_freshen (const char *hostname, const char *target, const char *b,
+	       size_t len, const char *d, Vector *fields)
+{
+  unsigned char key[CACHE_KEY];
+  codec_type_t coding;
+  cache_freshness_t fresh;
+  const header_field_t *etag;
+  const char *v;
+  size_t vlen;
+  cache_h c;
+  time_t now = time (NULL);
+  if (0 >= CONF.cache_size || NULL == target
+      || !cache_request (b, len, false, &coding)
+      || !cache_key (hostname, target, coding, key)
+      || NULL == (c = cache_find (key, b, len))
+      || !cache_freshness (d, fields, now, &fresh))
+    return;
+  etag = header_find (fields, HEADER_ETAG);
+  v = cache_field (get_sendbuf_buf (c->head), get_sendbuf_size (c->head),
+		   "ETag", &vlen);
+  // Without an ETag on either side, the date it was asked with has to do.
+  if ((NULL != etag || NULL != v)
+      && (NULL == etag || NULL == v || etag->value_len != vlen
+	  || 0 != memcmp (d + etag->value, v, vlen)))
+    return;
+  // A 304 that doesn't say for how long leaves it as it was.
+  if (0 > fresh.lifetime)
+    fresh = (cache_freshness_t
+	  )
+	    { .lifetime = c->expires - c->date, .age = 0, .stale = c->stale
+		- c->expires, .stale_error = c->stale_error - c->expires, };
+  stats_inc (STATS_CACHE_REFRESHED);
+  cache_set_freshness (c, &fresh, now);
+}
+
+static void
+flight_unindex (flight_h f)
+{
+  if (NULL == f->node)
+    return;
+  f->node->data = NULL;
+  hexnode_delete (flights, f->node->depth, f->node->node);
+  f->node = NULL;
+}
+
+static void
+flight_gc (flight_h f)
+{
+  if (f->leading || !vector_is_empty (&f->subscribers))
+    return;
+  flight_unindex (f);
+  if (NULL != f->c)
+    {
+      f->c->flight = NULL;
+      // Evicted, or never kept, while the flight was still reading it.
+      if (NULL == f->c->node)
+	cache_free (f->c);
+    }
+  vector_destroy (&f->subscribers);
+  free (f);
+}
+
+static void
+subscriber_remove (subscriber_h s)
+{
+  Vector *v = &s->flight->subscribers;
+  size_t i;
+  for (i = 0; i < v->size; i++)
+    if (s == VECTOR_GET_AS(subscriber_h, v, i))
+      {
+	vector_erase (v, i);
+	break;
+      }
+  s->request.output->drain = NULL;
+  s->request.output->closure = NULL;
+}
+
+static void
+subscriber_free (subscriber_h s)
+{
+  free (s->request.hostname);
+  free (s->request.target);
+  sendbuf_clear (&s->head);
+  free (s);
+}
+
+/* Everything was sent, or cut is set and the rest never will be. */
+static void
+subscriber_finish (subscriber_h s, bool cut)
+{
+  response_h output = s->request.output;
+  subscriber_remove (s);
+  if (cut && NULL == output->stream && NULL != output->tls)
+    gnutls_close_on_fin (output->tls);
+  else if (!cut && s->request.http_subversion && NULL == output->stream
+      && !s->head_only)
+    response_send (output, "0\r\n\r\n", 5);
+  output->eof = true;
+  response_send (output, NULL, 0);
+  subscriber_free (s);
+}
+
+static void
+reissue_event (void *c)
+{
+  subscriber_h s = c;
+  http_h http;
+  s->request.alone = true;
+  http = http_new (s->request, get_sendbuf_buf (s->head),
+		   get_sendbuf_size (s->head));
+  http_detach (http, true, 0);
+  // http_new() took the names.
+  s->request.hostname = s->request.target = NULL;
+  subscriber_free (s);
+}
+
+/* The flight can't answer s, it goes upstream by itself.  Not from here,
+ * the caller may be in the middle of a response on the connection http_new()
+ * would pick. */
+static void
+subscriber_reissue (subscriber_h s)
+{
+  subscriber_remove (s);
+  schedule_timer (&reissue_event, s, NULL, 0);
+}
+
+/* Asks the onion, behind the back of the client that was just sent c late,
+ * whether c is still what it has.  The conditions and ranges of b, the
+ * client's request, make way for c's own validators. */
+static void
+cache_refresh (cache_h c, const char *hostname, const char *target,
+	       const char *b, size_t len, time_t now)
+{
+  static const char *const drop[] =
+    { "If-None-Match:", "If-Modified-Since:", "If-Match:",
+	"If-Unmodified-Since:", "If-Range:", "Range:", };
+  const char *head = get_sendbuf_buf (c->head), *e = b + len, *p, *nl, *v;
+  size_t head_len = get_sendbuf_size (c->head), vlen, i;
+  subscriber_h s = NULL;
+  if (now < c->refreshed + CACHE_REFRESH_AGAIN
+      || NULL == (nl = memchr (b, '\n', len)))
+    return;
+  c->refreshed = now;
+  while (NULL == s)
+    s = malloc (sizeof(subscriber_t));
+  *s = (subscriber_t
+	)
+	  { .flight = NULL, .request =
+	    { .handle = 0, .output = response_detached (), .http_subversion =
+		true, .hostname = NULL, .target = NULL, .accept_encoding = 0,
+		.flight = NULL, .alone = true, .peered = true, .retrybuf =
+		NULL, }, .head = NULL, .sent = 0, .head_only = false, .started =
+	  false, .pumping = false, };
+  while (NULL == s->request.hostname)
+    s->request.hostname = strdup (hostname);
+  while (NULL == s->request.target)
+    s->request.target = strdup (target);
+  if (NULL != (v = cache_field (b, len, "Accept-Encoding", &vlen)))
+    s->request.accept_encoding = codec_accept (v, vlen);
+  // What fills the cache is a GET, even when a HEAD found it stale.
+  p = b;
+  if ('H' == *b)
+    {
+      sendbuf_append (&s->head, "GET", 3);
+      p += 4;
+    }
+  sendbuf_append (&s->head, p, nl + 1 - p);
+  for (p = nl + 1; p < e; p = nl + 1)
+    {
+      if (NULL == (nl = memchr (p, '\n', e - p)) || p == nl
+	  || (p + 1 == nl && '\r' == *p))
+	break;
+      for (i = 0; i < sizeof(drop) / sizeof(*drop); i++)
+	if (0 == strncasecmp (p, drop[i], strlen (drop[i])))
+	  break;
+      if (sizeof(drop) / sizeof(*drop) == i)
+	sendbuf_append (&s->head, p, nl + 1 - p);
+    }
+  if (NULL != (v = cache_field (head, head_len, "ETag", &vlen)))
+    sendbuf_appendv (&s->head, (struct iovec[])
+		       {
+			 { .iov_base = "If-None-Match: ", .iov_len = 15, },
+			 { .iov_base = (void*) v, .iov_len = vlen, },
+			 { .iov_base = "\r\n", .iov_len = 2, }, },
+		     3);
+  if (NULL != (v = cache_field (head, head_len, "Last-Modified", &vlen)))
+    sendbuf_appendv (&s->head, (struct iovec[])
+		       {
+			 { .iov_base = "If-Modified-Since: ", .iov_len = 19, },
+			 { .iov_base = (void*) v, .iov_len = vlen, },
+			 { .iov_base = "\r\n", .iov_len = 2, }, },
+		     3);
+  sendbuf_append (&s->head, "\r\n", 2);
+  stats_inc (STATS_CACHE_REFRESHES);
+  schedule_timer (&reissue_event, s, NULL, 0);
+}
+
+/* Sends s what it doesn't have yet, as long as it keeps up. */
+static void
+flight_pump (subscriber_h s)
+{
+  flight_h f = s->flight;
+  response_h output = s->request.output;
+  cache_h c = f->c;
+  size_t body;
+  if (s->pumping || NULL == c)
+    return;
+  s->pumping = true;
+  if (!s->started)
+    {
+      struct iovec iov[2] =
+	{
+	  { .iov_base = (void*) get_sendbuf_buf (c->head), .iov_len =
+	      get_sendbuf_size (c->head), },
+	  { .iov_base = "\r\n", .iov_len = 2, }, };
+      // It is still coming, so its length isn't known.
+      if (NULL != output->stream)
+	;
+      else if (s->request.http_subversion)
+	iov[1] = (struct iovec
+	      )
+		{ .iov_base = "Transfer-Encoding: chunked\r\n\r\n", .iov_len =
+		    30, };
+      else
+	{
+	  iov[1] = (struct iovec
+		)
+		  { .iov_base = "Connection: close\r\n\r\n", .iov_len = 21, };
+	  if (NULL != output->tls)
+	    gnutls_close_on_fin (output->tls);
+	}
+      s->started = true;
+      response_sendv (output, iov, 2);
+    }
+  body = get_sendbuf_size (c->body->data);
+  while (!s->head_only && s->sent < body
+      && CACHE_WINDOW > response_pending (output))
+    {
+      const char *p = (const char*) get_sendbuf_buf (c->body->data)
+	  + s->sent;
+      size_t n = body - s->sent;
+      char size[20];
+      struct iovec iov[3];
+      if (CACHE_WINDOW < n)
+	n = CACHE_WINDOW;
+      s->sent += n;
+      if (NULL == output->stream && s->request.http_subversion)
+	{
+	  iov[0] = (struct iovec
+		)
+		  { .iov_base = size, .iov_len = snprintf (size, sizeof(size),
+							   "%zx\r\n", n), };
+	  iov[1] = (struct iovec
+		)
+		  { .iov_base = (void*) p, .iov_len = n, };
+	  iov[2] = (struct iovec
+		)
+		  { .iov_base = "\r\n", .iov_len = 2, };
+	  response_sendv (output, iov, 3);
+	}
+      else
+	response_send (output, p, n);
+    }
+  s->pumping = false;
+  if (f->done && (s->head_only || s->sent == body))
+    {
+      subscriber_finish (s, false);
+      flight_gc (f);
+    }
+}
+
+static void
+flight_drain (response_h r)
+{
+  flight_pump (r->closure);
+}
+
+/* Subscribers may finish, and leave the vector, while it is walked. */
+static void
+flight_pump_all (flight_h f)
+{
+  size_t i;
+  for (i = f->subscribers.size; i-- > 0;)
+    if (i < f->subscribers.size)
+      flight_pump (VECTOR_GET_AS(subscriber_h, &f->subscribers, i));
+}
+
+/* The leader's response won't be shared, everyone who didn't get any of it
+ * yet asks for their own and everyone else is cut off. */
+static void
+flight_fail (flight_h f)
+{
+  flight_unindex (f);
+  while (!vector_is_empty (&f->subscribers))
+    {
+      subscriber_h s = VECTOR_GET_AS(subscriber_h, &f->subscribers, 0);
+      if (s->started)
+	subscriber_finish (s, true);
+      else
+	subscriber_reissue (s);
+    }
+}
+
+/* Joins request, for the head b, to a fetch of the same already on its way
+ * and returns true.  Otherwise a GET leads a new one that others can join. */
+bool
+cache_join (http_request_t *request, const char *b, size_t len)
+{
+  unsigned char key[CACHE_KEY], vary_key[CACHE_KEY];
+  codec_type_t coding;
+  hexnode_h node;
+  subscriber_h s = NULL;
+  flight_h f = NULL;
+  request->flight = NULL;
+  if (request->alone || 0 >= CONF.cache_size || NULL == request->target
+      || !cache_request (b, len, true, &coding)
+      || !cache_key (request->hostname, request->target, coding, key))
+    return false;
+  node = hexnode_lookup (flights, CACHE_KEY, key, false);
+  if (NULL == node || NULL == node->data)
+    {
+      // Only a GET is kept, a HEAD can only follow one.
+      if ('G' != b[0])
+	return false;
+      while (NULL == f)
+	f = malloc (sizeof(flight_t));
+      *f = (flight_t
+	    )
+	      { .node = hexnode_lookup (flights, CACHE_KEY, key, true), .c =
+	      NULL, .subscribers = VECTOR_INITIALIZER, .leading = true, .done =
+		  false, };
+      while (VECTOR_SUCCESS
+	  != vector_setup (&f->subscribers, 4, sizeof(subscriber_h)))
+	;
+      f->node->data = f;
+      request->flight = f;
+      return false;
+    }
+  f = node->data;
+  // Once the head is known, only those it answers can join.
+  if (NULL != f->c
+      && (!cache_vary_key (f->c->vary, b, len, vary_key)
+	  || 0 != memcmp (vary_key, f->c->vary_key, CACHE_KEY)
+	  || !cache_takes_head (b, len, get_sendbuf_buf (f->c->head),
+				get_sendbuf_size (f->c->head))))
+    return false;
+  while (NULL == s)
+    s = malloc (sizeof(subscriber_t));
+  *s = (subscriber_t
+	)
+	  { .flight = f, .request = *request, .head = NULL, .sent = 0,
+	      .head_only = 'H' == b[0], .started = false, .pumping = false, };
+  sendbuf_append (&s->head, b, len);
+  vector_push_back (&f->subscribers, &s);
+  request->output->drain = &flight_drain;
+  request->output->closure = s;
+  stats_inc (STATS_COALESCED);
+  flight_pump (s);
+  return true;
+}
+
+/* The leader's request is done, if no response came for the others they go
+ * ask for themselves. */
+void
+cache_leave (flight_h f)
+{
+  if (NULL == f)
+    return;
+  f->leading = false;
+  if (NULL == f->c)
+    flight_fail (f);
+  flight_gc (f);
+}
+
+void
+cache_abort (cache_h c)
+{
+  flight_h f;
+  if (NULL == c)
+    return;
+  if (NULL != (f = c->flight))
+    {
+      f->c = NULL;
+      flight_fail (f);
+    }
+  cache_free (c);
+}
+
+/* cache_new() for the leader of flight f, which then shares c. */
+cache_h
+cache_begin (flight_h f, const char *hostname, const char *target,
+	     const char *b, size_t len, const char *d, size_t status_len,
+	     Vector *fields)
+{
+  const header_field_t *coding;
+  cache_h c;
+  size_t i;
+  if (12 <= status_len && 0 == memcmp (d + 9, "304", 3))
+    cache_freshen (hostname, target, b, len, d, fields);
+  c = cache_new (hostname, target, b, len, d, status_len, fields);
+  if (NULL == f)
+    return c;
+  if (NULL == c)
+    {
+      flight_fail (f);
+      return NULL;
+    }
+  f->c = c;
+  c->flight = f;
+  // What the gateway compresses is in the coding of the key, what the onion
+  // compressed may not be.
+  coding = header_find (fields, HEADER_CONTENT_ENCODING);
+  // Those that Vary from the leader are left to themselves.
+  for (i = f->subscribers.size; i-- > 0;)
+    {
+      unsigned char vary_key[CACHE_KEY];
+      subscriber_h s = VECTOR_GET_AS(subscriber_h, &f->subscribers, i);
+      const char *r = get_sendbuf_buf (s->head);
+      size_t r_len = get_sendbuf_size (s->head);
+      if (!cache_vary_key (c->vary, r, r_len, vary_key)
+	  || 0 != memcmp (vary_key, c->vary_key, CACHE_KEY)
+	  || !cache_takes (r, r_len, NULL == coding ? NULL : d + coding->value,
+			   NULL == coding ? 0 : coding->value_len))
+	subscriber_reissue (s);
+    }
+  return c;
+}
+
+void
+cache_head (cache_h c, const struct iovec *iov, size_t n)
+{
+  sendbuf_appendv (&c->head, iov, n);
+}
+
+/* False when the body got too big and c is gone.  While others share it, it
+ * is held up to the whole budget but no longer kept. */
+bool
+cache_body (cache_h c, const struct iovec *iov, size_t n)
+{
+  size_t i, len = get_sendbuf_size (c->body->data);
+  for (i = 0; i < n; i++)
+    len += iov[i].iov_len;
+  if ((size_t) CONF.cache_size / CACHE_OBJECT_SHARE < len)
+    {
+      if ((size_t) CONF.cache_size < len || NULL == c->flight
+	  || vector_is_empty (&c->flight->subscribers))
+	{
+	  cache_abort (c);
+	  return false;
+	}
+      c->oversize = true;
+    }
+  sendbuf_reserve (&c->body->data, len - get_sendbuf_size (c->body->data));
+  sendbuf_appendv (&c->body->data, iov, n);
+  // Hashed as it comes, the digest is ready as soon as the body is.
+  for (i = 0; i < n && !c->oversize; i++)
+    gnutls_hash (c->hash, iov[i].iov_base, iov[i].iov_len);
+  if (NULL != c->flight)
+    flight_pump_all (c->flight);
+  return true;
+}
+
+/* The response is complete, c replaces any copy kept for the same request
+ * and goes to disk behind it. */
+void
+cache_end (cache_h c)
+{
+  unsigned char digest[CACHE_KEY];
+  flight_h f = c->flight;
+  if (!c->oversize)
+    {
+      stats_inc (STATS_CACHE_STORES);
+      disk_store (c->key, c->vary, c->vary_key, c->date, c->expires,
+		  get_sendbuf_buf (c->head), get_sendbuf_size (c->head),
+		  get_sendbuf_buf (c->body->data),
+		  get_sendbuf_size (c->body->data));
+      peer_store (c->origin, c->origin + strlen (c->origin) + 1, c->coding,
+		  c->vary, c->vary_key, c->date, c->expires,
+		  get_sendbuf_buf (c->head), get_sendbuf_size (c->head),
+		  get_sendbuf_buf (c->body->data),
+		  get_sendbuf_size (c->body->data));
+      free (c->origin);
+      c->origin = NULL;
+      sendbuf_trim (&c->body->data);
+      gnutls_hash_deinit (c->hash, digest);
+      c->hash = NULL;
+      cache_body_share (c, digest);
+      cache_insert (c);
+    }
+  if (NULL != f)
+    {
+      f->done = true;
+      // From here on the cache answers.
+      flight_unindex (f);
+      flight_pump_all (f);
+    }
+}
+
+/* Which responses are kept and how they rank, least recently used first.
+ * Their bytes are on disk already. */
+void
+cache_snapshot (sendbuf_h *buf)
+{
+  cache_snapshot_t *snap = NULL;
+  cache_segment_t segment;
+  size_t n = 0;
+  cache_h c;
+  for (segment = CACHE_PROBATION; segment < CACHE_SEGMENTS; segment++)
+    for (c = segments[segment].tail; NULL != c; c = c->prev)
+      n++;
+  if (0 == n)
+    return;
+  while (NULL == snap)
+    snap = malloc (n * sizeof(cache_snapshot_t));
+  n = 0;
+  for (segment = CACHE_PROBATION; segment < CACHE_SEGMENTS; segment++)
+    for (c = segments[segment].tail; NULL != c; c = c->prev)
+      {
+	snap[n] = (cache_snapshot_t
+	      )
+		{ .segment = segment, .reserved = 0, };
+	memcpy (snap[n].key, c->key, CACHE_KEY);
+	memcpy (snap[n++].vary_key, c->vary_key, CACHE_KEY);
+      }
+  sendbuf_append (buf, snap, n * sizeof(cache_snapshot_t));
+  free (snap);
+}
+
+static bool
+cache_restore_match (const char *vary, const unsigned char vary_key[CACHE_KEY],
+		     void *c)
+{
+  return 0 == memcmp (vary_key, c, CACHE_KEY);
+}
+
+static void
+restore_event (void *c)
+{
+  size_t end = restore_next + CACHE_RESTORE_BATCH;
+  unsigned long long restored = 0;
+  for (; restore_next < restore_len && restore_next < end; restore_next++)
+    {
+      cache_snapshot_t *snap = &restoring[restore_next];
+      disk_record_t record;
+      cache_h kept;
+      if (!disk_find (snap->key, &cache_restore_match, snap->vary_key,
+		      &record)
+	  || NULL
+	      == (kept = cache_keep (snap->key, record.vary, snap->vary_key,
+				     record.date, record.expires, record.head,
+				     record.head_len, record.body,
+				     record.body_len)))
+	continue;
+      // Pushed in the order they were used, they rank as they did.
+      if (CACHE_PROTECTED_SEGMENT == snap->segment)
+	cache_touch (kept);
+      restored++;
+    }
+  stats_add (STATS_SNAPSHOT_RESTORED, restored);
+  if (restore_next < restore_len)
+    {
+      schedule_timer (&restore_event, NULL, &restore_instanceid, 0);
+      return;
+    }
+  free (restoring);
+  restoring = NULL;
+}
+
+/* Reads back from disk what was kept before the restart, without holding up
+ * the clients that come meanwhile. */
+void
+cache_restore ()
+{
+  const void *snap;
+  size_t len;
+  if (0 >= CONF.cache_size
+      || NULL == (snap = snapshot_section (SNAPSHOT_CACHE, &len))
+      || 0 == len || 0 != len % sizeof(cache_snapshot_t))
+    return;
+  while (NULL == restoring)
+    restoring = malloc (len);
+  memcpy (restoring, snap, len);
+  restore_len = len / sizeof(cache_snapshot_t);
+  restore_next = 0;
+  schedule_timer (&restore_event, NULL, &restore_instanceid, 0);
+}
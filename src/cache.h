@@ -0,0 +1,79 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_CACHE_H
+#define __TOR2WEB_CACHE_H
+
+/**
+ * @file cache.h
+ * @brief Whole responses kept for as long as the onion allows
+ * @author Mike Mestnik
+ */
+
+#include "gnutls.h"
+#include "http.h"
+#include "codec.h"
+#include "disk.h"
+#include "sendbuf.h"
+#include "vector.h"
+
+#include <sys/uio.h>
+
+#define CACHE_KEY DISK_KEY
+
+typedef struct cache *cache_h;
+typedef struct flight *flight_h;
+
+void
+cache_init ();
+void
+cache_restore ();
+void
+cache_snapshot (sendbuf_h*);
+bool
+cache_serve (response_h, const char*, const char*, const char*, size_t);
+bool
+cache_serve_stale (response_h, const char*, const char*, const char*,
+		   size_t);
+bool
+cache_serve_peer (sendbuf_h*, const char*, const char*, const char*, size_t);
+bool
+cache_key (const char*, const char*, codec_type_t, unsigned char[CACHE_KEY]);
+bool
+cache_request_key (const char*, const char*, const char*, size_t,
+		   unsigned char[CACHE_KEY]);
+void
+cache_adopt (const unsigned char[CACHE_KEY], const char*,
+	     const unsigned char[CACHE_KEY], time_t, time_t, const void*,
+	     size_t, const void*, size_t);
+bool
+cache_join (http_request_t*, const char*, size_t);
+void
+cache_leave (flight_h);
+cache_h
+cache_begin (flight_h, const char*, const char*, const char*, size_t,
+	     const char*, size_t, Vector*);
+void
+cache_head (cache_h, const struct iovec*, size_t);
+bool
+cache_body (cache_h, const struct iovec*, size_t);
+void
+cache_end (cache_h);
+void
+cache_abort (cache_h);
+
+#endif
@@ -0,0 +1,317 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file certstore.c
+ * @brief Pick a certificate by SNI
+ * @author Mike Mestnik
+ *
+ * Every "<name>.pem" in ssl_certdir with a matching "<name>.key" is loaded
+ * and indexed under the DNS names it is valid for.  Each name gets one
+ * credential holding all of its certificates, ECDSA ones first.  GnuTLS
+ * takes the first certificate the client can verify, so ECDSA is used
+ * whenever the client supports it and RSA only as a fallback.
+ *
+ * The index is an open addressed hash table that never changes after
+ * startup, so handshakes on worker threads can read it without locks.
+ */
+
+#include "certstore.h"
+#include "conf.h"
+#include "ocsp.h"
+#include "vector.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <gnutls/x509.h>
+
+typedef struct
+{
+  char *certfile;
+  char *keyfile;
+  bool ecdsa;
+} certstore_pair_t;
+
+typedef struct
+{
+  char *name; // Lower case, without any "*." prefix.
+  size_t len;
+  Vector exact; // of size_t, index into pairs.
+  Vector wildcard;
+  gnutls_certificate_credentials_t exact_cred;
+  gnutls_certificate_credentials_t wildcard_cred;
+} certstore_slot_t;
+
+static Vector pairs;
+static certstore_slot_t *slots = NULL;
+static size_t slots_mask = 0;
+static size_t slots_used = 0;
+
+static inline uint64_t
+certstore_hash (const char *name, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (len--)
+    h = (h ^ (unsigned char) *name++) * 0x100000001b3ULL;
+  return h;
+}
+
+static certstore_slot_t *
+certstore_find (const char *name, size_t len)
+{
+  size_t i;
+  if (NULL == slots)
+    return NULL;
+  for (i = certstore_hash (name, len) & slots_mask; NULL != slots[i].name;
+      i = (i + 1) & slots_mask)
+    if (len == slots[i].len && 0 == memcmp (name, slots[i].name, len))
+      return &slots[i];
+  return NULL;
+}
+
+static void
+certstore_grow ()
+{
+  certstore_slot_t *old = slots;
+  size_t i, old_size = slots_mask + 1;
+  slots_mask = NULL == old ? 15 : (slots_mask << 1) | 1;
+  slots = NULL;
+  while (NULL == slots)
+    slots = calloc (slots_mask + 1, sizeof(certstore_slot_t));
+  if (NULL == old)
+    return;
+  for (i = 0; i < old_size; i++)
+    if (NULL != old[i].name)
+      {
+	size_t j = certstore_hash (old[i].name, old[i].len) & slots_mask;
+	while (NULL != slots[j].name)
+	  j = (j + 1) & slots_mask;
+	slots[j] = old[i];
+      }
+  free (old);
+}
+
+static void
+certstore_add_name (const char *n, size_t pair)
+{
+  certstore_slot_t *slot;
+  bool wildcard = 0 == strncmp (n, "*.", 2);
+  char *name = NULL;
+  size_t i, len;
+  if (wildcard)
+    n += 2;
+  while (NULL == name)
+    name = strdup (n);
+  len = strlen (name);
+  for (i = 0; i < len; i++)
+    name[i] = tolower ((unsigned char) name[i]);
+  if (NULL == (slot = certstore_find (name, len)))
+    {
+      // Keep the table at most half full so probes stay short.
+      if (slots_used * 2 >= slots_mask)
+	certstore_grow ();
+      i = certstore_hash (name, len) & slots_mask;
+      while (NULL != slots[i].name)
+	i = (i + 1) & slots_mask;
+      slot = &slots[i];
+      *slot = (certstore_slot_t
+	    )
+	      { .name = name, .len = len, .exact_cred = NULL, .wildcard_cred =
+	      NULL, };
+      vector_setup (&slot->exact, 2, sizeof(size_t));
+      vector_setup (&slot->wildcard, 2, sizeof(size_t));
+      slots_used++;
+    }
+  else
+    free (name);
+  vector_push_back (wildcard ? &slot->wildcard : &slot->exact, &pair);
+}
+
+static void
+certstore_add_pair (const char *certfile, const char *keyfile)
+{
+  gnutls_datum_t pem =
+    { NULL, 0 };
+  gnutls_x509_crt_t crt;
+  certstore_pair_t pair;
+  size_t index = pairs.size;
+  unsigned seq;
+  bool named = false;
+  char name[256];
+  if (0 != gnutls_load_file (certfile, &pem))
+    {
+      fprintf (stderr, "Can't read certificate %s\n", certfile);
+      return;
+    }
+  if (0 != gnutls_x509_crt_init (&crt))
+    return; // LCOV_EXCL_LINE
+  if (0 > gnutls_x509_crt_import (crt, &pem, GNUTLS_X509_FMT_PEM))
+    {
+      fprintf (stderr, "Can't parse certificate %s\n", certfile);
+      goto SKIP;
+    }
+  pair = (certstore_pair_t
+	)
+	  { .certfile = strdup (certfile), .keyfile = strdup (keyfile), .ecdsa =
+	  GNUTLS_PK_ECDSA == gnutls_x509_crt_get_pk_algorithm (crt, NULL), };
+  vector_push_back (&pairs, &pair);
+  for (seq = 0;; seq++)
+    {
+      size_t size = sizeof(name) - 1;
+      int ret = gnutls_x509_crt_get_subject_alt_name (crt, seq, name, &size,
+						      NULL);
+      if (GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE == ret)
+	break;
+      if (GNUTLS_SAN_DNSNAME != ret)
+	continue;
+      name[size] = 0;
+      certstore_add_name (name, index);
+      named = true;
+    }
+  if (!named)
+    {
+      size_t size = sizeof(name);
+      if (0 == gnutls_x509_crt_get_dn_by_oid (crt, GNUTLS_OID_X520_COMMON_NAME,
+					      0, 0, name, &size))
+	certstore_add_name (name, index);
+    }
+  SKIP: gnutls_x509_crt_deinit (crt);
+  gnutls_free (pem.data);
+}
+
+/* Builds the credential for a list of pairs, ECDSA first. */
+static gnutls_certificate_credentials_t
+certstore_cred (Vector *list)
+{
+  gnutls_certificate_credentials_t cred;
+  int pass;
+  if (vector_is_empty (list))
+    return NULL;
+  if (0 != gnutls_certificate_allocate_credentials (&cred))
+    return NULL; // LCOV_EXCL_LINE
+  gnutls_certificate_set_flags (cred, GNUTLS_CERTIFICATE_API_V2);
+  if (NULL != CONF.ssl_intermediate)
+    gnutls_certificate_set_x509_trust_file (cred, CONF.ssl_intermediate,
+					    GNUTLS_X509_FMT_PEM);
+  for (pass = 0; pass < 2; pass++)
+    VECTOR_FOR_EACH(list, i)
+      {
+	certstore_pair_t *pair;
+	int idx;
+	pair = (certstore_pair_t*) vector_get (&pairs,
+					       ITERATOR_GET_AS(size_t, &i));
+	if (pair->ecdsa != (0 == pass))
+	  continue;
+	idx = gnutls_certificate_set_x509_key_file (cred, pair->certfile,
+						    pair->keyfile,
+						    GNUTLS_X509_FMT_PEM);
+	if (0 > idx)
+	  fprintf (stderr, "Can't load %s: %s\n", pair->certfile,
+		   gnutls_strerror (idx));
+	else
+	  ocsp_attach (cred, idx, pair->certfile);
+      }
+  return cred;
+}
+
+void
+certstore_init ()
+{
+  DIR *dir;
+  struct dirent *ent;
+  size_t i;
+  while (VECTOR_SUCCESS != vector_setup (&pairs, 8, sizeof(certstore_pair_t)))
+    ;
+  if (NULL == CONF.ssl_certdir)
+    return;
+  if (NULL == (dir = opendir (CONF.ssl_certdir)))
+    {
+      perror ("certstore opendir");
+      return;
+    }
+  while (NULL != (ent = readdir (dir)))
+    {
+      size_t len = strlen (ent->d_name);
+      char *certfile = NULL, *keyfile = NULL;
+      if (4 >= len || 0 != strcmp (&ent->d_name[len - 4], ".pem"))
+	continue;
+      while (NULL == certfile)
+	certfile = malloc (strlen (CONF.ssl_certdir) + len + 2);
+      while (NULL == keyfile)
+	keyfile = malloc (strlen (CONF.ssl_certdir) + len + 2);
+      sprintf (certfile, "%s/%s", CONF.ssl_certdir, ent->d_name);
+      sprintf (keyfile, "%s/%.*s.key", CONF.ssl_certdir, (int) len - 4,
+	       ent->d_name);
+      if (0 == access (keyfile, R_OK))
+	certstore_add_pair (certfile, keyfile);
+      free (certfile);
+      free (keyfile);
+    }
+  closedir (dir);
+  for (i = 0; NULL != slots && i <= slots_mask; i++)
+    if (NULL != slots[i].name)
+      {
+	slots[i].exact_cred = certstore_cred (&slots[i].exact);
+	slots[i].wildcard_cred = certstore_cred (&slots[i].wildcard);
+      }
+  fprintf (stderr, "certstore: %zu certificates for %zu names\n", pairs.size,
+	   slots_used);
+}
+
+static int
+certstore_select (gnutls_session_t session)
+{
+  char name[256];
+  size_t len = sizeof(name), i;
+  unsigned type;
+  const char *p;
+  certstore_slot_t *slot;
+  if (0 != gnutls_server_name_get (session, name, &len, &type, 0)
+      || GNUTLS_NAME_DNS != type)
+    return 0;
+  len = strnlen (name, sizeof(name));
+  for (i = 0; i < len; i++)
+    name[i] = tolower ((unsigned char) name[i]);
+  if (NULL != (slot = certstore_find (name, len)) && NULL != slot->exact_cred)
+    {
+      gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE,
+			      slot->exact_cred);
+      return 0;
+    }
+  // A wildcard only stands for the first label, deeper names get the default.
+  p = memchr (name, '.', len);
+  if (NULL != p && p > name
+      && NULL != (slot = certstore_find (p + 1, name + len - p - 1))
+      && NULL != slot->wildcard_cred)
+    gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE,
+			    slot->wildcard_cred);
+  return 0;
+}
+
+void
+certstore_session (gnutls_session_t session)
+{
+  if (0 != slots_used)
+    gnutls_handshake_set_post_client_hello_function (session,
+						     &certstore_select);
+}
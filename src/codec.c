@@ -0,0 +1,384 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file codec.c
+ * @brief Streaming content codings
+ * @author Mike Mestnik
+ *
+ * gzip and deflate through zlib, br through brotli, either way.  Everything
+ * a stream allocates is counted against CODEC_MAX_MEMORY, a window bigger
+ * than that is an error rather than a surprise.  Compression uses
+ * CONF.compress_level and a window of 1 << CONF.compress_window bytes.
+ */
+
+#include "codec.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+
+#define CODEC_CHUNK 16384
+
+typedef struct codec
+{
+  codec_type_t type;
+  bool compress;
+  bool done; // The decoder saw the end of the stream.
+  size_t memory;
+  union
+  {
+    z_stream z;
+    BrotliDecoderState *bd;
+    BrotliEncoderState *be;
+  };
+} codec_t;
+
+codec_type_t
+codec_lookup (const char *p, size_t len)
+{
+  if (0 == len || (8 == len && 0 == strncasecmp (p, "identity", 8)))
+    return CODEC_IDENTITY;
+  if ((4 == len && 0 == strncasecmp (p, "gzip", 4))
+      || (6 == len && 0 == strncasecmp (p, "x-gzip", 6)))
+    return CODEC_GZIP;
+  if (7 == len && 0 == strncasecmp (p, "deflate", 7))
+    return CODEC_DEFLATE;
+  if (2 == len && 0 == strncasecmp (p, "br", 2))
+    return CODEC_BROTLI;
+  return CODEC_UNKNOWN;
+}
+
+/* The codings an Accept-Encoding value allows, as 1 << codec_type_t. */
+unsigned
+codec_accept (const char *p, size_t len)
+{
+  const char *e = p + len, *t, *te, *q;
+  unsigned ret = 0;
+  codec_type_t type;
+  for (t = p; t < e; t = te + 1)
+    {
+      if (NULL == (te = memchr (t, ',', e - t)))
+	te = e;
+      while (t < te && (' ' == *t || '\t' == *t))
+	t++;
+      for (q = t; q < te && ';' != *q && ' ' != *q && '\t' != *q; q++)
+	;
+      if (CODEC_UNKNOWN == (type = codec_lookup (t, q - t)))
+	continue;
+      // Only an explicit zero weight refuses, "q=0", "q=0.0" and so on.
+      while (q < te && ';' != *q)
+	q++;
+      for (q++; q < te && (' ' == *q || '\t' == *q); q++)
+	;
+      if (te - q >= 3 && 'q' == (*q | 0x20) && '=' == q[1] && '0' == q[2])
+	{
+	  for (q += 3; q < te && ('.' == *q || '0' == *q); q++)
+	    ;
+	  if (q == te || ' ' == *q || '\t' == *q)
+	    continue;
+	}
+      ret |= 1 << type;
+    }
+  return ret;
+}
+
+/* brotli does better on text, gzip is what everyone has. */
+codec_type_t
+codec_choose (unsigned accept)
+{
+  if (accept & 1 << CODEC_BROTLI)
+    return CODEC_BROTLI;
+  if (accept & 1 << CODEC_GZIP)
+    return CODEC_GZIP;
+  return CODEC_IDENTITY;
+}
+
+const char *
+codec_name (codec_type_t type)
+{
+  static const char *names[] =
+    { "identity", "gzip", "deflate", "br", };
+  return CODEC_UNKNOWN > type ? names[type] : NULL;
+}
+
+/* Text compresses, the usual image and media types already are. */
+bool
+codec_compressible (const char *p, size_t len)
+{
+  static const char *types[] =
+    { "application/javascript", "application/x-javascript",
+	"application/json", "application/xml", "application/xhtml+xml",
+	"application/rss+xml", "application/atom+xml", "image/svg+xml",
+	"image/x-icon", "application/wasm", NULL, };
+  size_t i;
+  for (i = 0; i < len && ';' != p[i] && ' ' != p[i]; i++)
+    ;
+  len = i;
+  if (5 <= len && 0 == strncasecmp (p, "text/", 5))
+    return true;
+  for (i = 0; NULL != types[i]; i++)
+    if (strlen (types[i]) == len && 0 == strncasecmp (p, types[i], len))
+      return true;
+  return false;
+}
+
+/* Each block remembers its size, zlib doesn't pass it back. */
+static void *
+codec_alloc (void *c, size_t size)
+{
+  codec_h h = c;
+  size_t *p;
+  if (CODEC_MAX_MEMORY - h->memory < size + sizeof(size_t))
+    return NULL;
+  if (NULL == (p = malloc (sizeof(size_t) + size)))
+    return NULL; // LCOV_EXCL_LINE
+  h->memory += *p = size + sizeof(size_t);
+  return p + 1;
+}
+
+static void
+codec_free_ (void *c, void *a)
+{
+  codec_h h = c;
+  size_t *p = a;
+  if (NULL == a)
+    return;
+  h->memory -= *--p;
+  free (p);
+}
+
+static void *
+z_alloc (void *c, unsigned items, unsigned size)
+{
+  if (SIZE_MAX / size < items)
+    return NULL; // LCOV_EXCL_LINE
+  return codec_alloc (c, (size_t) items * size);
+}
+
+static void
+z_free (void *c, void *a)
+{
+  codec_free_ (c, a);
+}
+
+codec_h
+codec_new (codec_type_t type, bool compress)
+{
+  codec_h h = NULL;
+  int window = CONF.compress_window, level = CONF.compress_level, ret = Z_OK;
+  while (NULL == h)
+    h = calloc (1, sizeof(codec_t));
+  h->type = type;
+  h->compress = compress;
+  if (CODEC_GZIP == type || CODEC_DEFLATE == type)
+    {
+      h->z.zalloc = &z_alloc;
+      h->z.zfree = &z_free;
+      h->z.opaque = h;
+      if (window < 9 || window > 15)
+	window = 15;
+      if (compress)
+	// The hash table scales with the window, as zlib's defaults do.
+	ret = deflateInit2 (&h->z, level, Z_DEFLATED,
+			    CODEC_GZIP == type ? window + 16 : window,
+			    window > 14 ? 8 : window - 6, Z_DEFAULT_STRATEGY);
+      else
+	// Either wrapper, servers mix up "deflate" and gzip.
+	ret = inflateInit2 (&h->z, 15 + 32);
+    }
+  else if (CODEC_BROTLI == type && compress)
+    {
+      h->be = BrotliEncoderCreateInstance (&codec_alloc, &codec_free_, h);
+      if (NULL != h->be)
+	{
+	  if (window < BROTLI_MIN_WINDOW_BITS
+	      || window > BROTLI_MAX_WINDOW_BITS)
+	    window = BROTLI_DEFAULT_WINDOW;
+	  BrotliEncoderSetParameter (h->be, BROTLI_PARAM_LGWIN, window);
+	  BrotliEncoderSetParameter (h->be, BROTLI_PARAM_QUALITY,
+				     level < 0 ? 5 : level);
+	  BrotliEncoderSetParameter (h->be, BROTLI_PARAM_MODE,
+				     BROTLI_MODE_TEXT);
+	}
+      else
+	ret = Z_MEM_ERROR;
+    }
+  else if (CODEC_BROTLI == type)
+    {
+      h->bd = BrotliDecoderCreateInstance (&codec_alloc, &codec_free_, h);
+      if (NULL == h->bd)
+	ret = Z_MEM_ERROR;
+    }
+  else
+    ret = Z_STREAM_ERROR;
+  if (Z_OK != ret)
+    {
+      fprintf (stderr, "Can't set up content coding %d\n", type);
+      free (h);
+      return NULL;
+    }
+  return h;
+}
+
+/* Run the zlib stream over what's in z, flushing as asked. */
+static bool
+codec_z (codec_h h, int flush, codec_out_f out, void *c)
+{
+  unsigned char buf[CODEC_CHUNK];
+  int ret;
+  do
+    {
+      h->z.next_out = buf;
+      h->z.avail_out = sizeof(buf);
+      if (h->compress)
+	ret = deflate (&h->z, flush);
+      else
+	ret = inflate (&h->z, flush);
+      if (sizeof(buf) != h->z.avail_out)
+	out (c, buf, sizeof(buf) - h->z.avail_out);
+      if (Z_STREAM_END == ret)
+	{
+	  h->done = true;
+	  return true;
+	}
+      // No progress possible, zlib wants more input or is flushed.
+      if (Z_BUF_ERROR == ret)
+	return true;
+      if (Z_OK != ret)
+	{
+	  fprintf (stderr, "zlib: %s\n", NULL == h->z.msg ? "error" : h->z.msg);
+	  return false;
+	}
+    }
+  while (0 == h->z.avail_out || 0 != h->z.avail_in);
+  return true;
+}
+
+static bool
+codec_br (codec_h h, const uint8_t *next_in, size_t avail_in,
+	  BrotliEncoderOperation op, codec_out_f out, void *c)
+{
+  uint8_t buf[CODEC_CHUNK], *next_out;
+  size_t avail_out;
+  if (h->compress)
+    do
+      {
+	next_out = buf;
+	avail_out = sizeof(buf);
+	if (!BrotliEncoderCompressStream (h->be, op, &avail_in, &next_in,
+					  &avail_out, &next_out, NULL))
+	  {
+	    fprintf (stderr, "brotli: encoder error\n");
+	    return false;
+	  }
+	if (sizeof(buf) != avail_out)
+	  out (c, buf, sizeof(buf) - avail_out);
+      }
+    while (0 != avail_in || BrotliEncoderHasMoreOutput (h->be));
+  else
+    for (;;)
+      {
+	BrotliDecoderResult ret;
+	next_out = buf;
+	avail_out = sizeof(buf);
+	ret = BrotliDecoderDecompressStream (h->bd, &avail_in, &next_in,
+					     &avail_out, &next_out, NULL);
+	if (sizeof(buf) != avail_out)
+	  out (c, buf, sizeof(buf) - avail_out);
+	switch (ret)
+	  {
+	  case BROTLI_DECODER_RESULT_SUCCESS:
+	    h->done = true;
+	    return true;
+	  case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+	    return true;
+	  case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+	    break;
+	  default:
+	    fprintf (
+		stderr, "brotli: %s\n",
+		BrotliDecoderErrorString (BrotliDecoderGetErrorCode (h->bd)));
+	    return false;
+	  }
+      }
+  return true;
+}
+
+/* Feed d through, returns false once the stream is broken. */
+bool
+codec_write (codec_h h, const void *d, size_t s, codec_out_f out, void *c)
+{
+  if (0 == s)
+    return true;
+  // Trailing garbage after a complete stream is dropped.
+  if (h->done)
+    return true;
+  if (CODEC_BROTLI == h->type)
+    return codec_br (h, d, s, BROTLI_OPERATION_PROCESS, out, c);
+  h->z.next_in = (unsigned char*) d;
+  h->z.avail_in = s;
+  return codec_z (h, Z_NO_FLUSH, out, c);
+}
+
+/* Push out everything so far, finishing the stream if asked.  When decoding
+ * finish checks the stream was complete. */
+bool
+codec_flush (codec_h h, bool finish, codec_out_f out, void *c)
+{
+  if (!h->compress)
+    {
+      if (finish && !h->done)
+	{
+	  fprintf (stderr, "Content coding %d truncated\n", h->type);
+	  return false;
+	}
+      return true;
+    }
+  if (CODEC_BROTLI == h->type)
+    return codec_br (h, NULL, 0,
+		     finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH,
+		     out, c);
+  h->z.next_in = NULL;
+  h->z.avail_in = 0;
+  return codec_z (h, finish ? Z_FINISH : Z_SYNC_FLUSH, out, c);
+}
+
+void
+codec_free (codec_h h)
+{
+  if (NULL == h)
+    return;
+  if (CODEC_BROTLI == h->type)
+    {
+      if (h->compress)
+	BrotliEncoderDestroyInstance (h->be);
+      else
+	BrotliDecoderDestroyInstance (h->bd);
+    }
+  else if (h->compress)
+    deflateEnd (&h->z);
+  else
+    inflateEnd (&h->z);
+  free (h);
+}
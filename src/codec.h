@@ -0,0 +1,69 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_CODEC_H
+#define __TOR2WEB_CODEC_H
+
+/**
+ * @file codec.h
+ * @brief Streaming content codings
+ * @author Mike Mestnik
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// What one stream may allocate, windows included, before it fails.
+#define CODEC_MAX_MEMORY (8 << 20)
+// Bodies known to be shorter aren't worth compressing.
+#define CODEC_MIN_LENGTH 256
+
+typedef enum
+{
+  CODEC_IDENTITY,
+  CODEC_GZIP,
+  CODEC_DEFLATE,
+  CODEC_BROTLI,
+  CODEC_UNKNOWN,
+} codec_type_t;
+
+/* Output is handed over as it is produced, and is only good for the call. */
+typedef void
+(*codec_out_f) (void*, const void*, size_t);
+
+typedef struct codec *codec_h;
+
+codec_type_t
+codec_lookup (const char*, size_t);
+unsigned
+codec_accept (const char*, size_t);
+codec_type_t
+codec_choose (unsigned);
+const char *
+codec_name (codec_type_t);
+bool
+codec_compressible (const char*, size_t);
+codec_h
+codec_new (codec_type_t, bool);
+bool
+codec_write (codec_h, const void*, size_t, codec_out_f, void*);
+bool
+codec_flush (codec_h, bool, codec_out_f, void*);
+void
+codec_free (codec_h);
+
+#endif
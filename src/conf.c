@@ -64,7 +64,9 @@ CONF_T CONF =
       "tor2web-abuse@lists.tor2web.org",
 	{ }, "TLS", 600, "", 600, "MERGE",
       false, "",
-      NULL, 4096, };
+      NULL, 4096, NULL, 43200, NULL, 60, 0, NULL, 3600, NULL, 0, 300, false, 6, 13, 16 << 20, 64 << 20, NULL,
+      1024, 86400, NULL, NULL, NULL, 300, NULL, 32, 0, 32, NULL, NULL,
+      NULL, };
 
 typedef int
 (*handle_f) (void*, const char*);
@@ -181,8 +183,51 @@ struct
 //  { "listen_port_http", false, NULL, NULL, NULL, &depreciated, "listen_port_http" },
 	    { "listen_port_https", false, NULL, NULL, NULL, &set_port,
 		&CONF.listen_ipv4 },
+	{ "basehost", false, &CONF.basehost, NULL, NULL, NULL, NULL },
+	{ "avoid_rewriting_visible_content", false, NULL,
+	    &CONF.avoid_rewriting_visible_content, NULL, NULL, NULL },
 	    { "sockshost", false, NULL, NULL, NULL, &set_addr, &CONF.sockshost },
 	    { "socksport", false, NULL, NULL, NULL, &set_port, &CONF.sockshost },
+	{ "ssl_ticket_key", false, &CONF.ssl_ticket_key, NULL, NULL, NULL, NULL },
+	{ "ssl_ticket_rotate", false, NULL, NULL, &CONF.ssl_ticket_rotate, NULL,
+	NULL },
+	{ "statsfile", false, &CONF.statsfile, NULL, NULL, NULL, NULL },
+	{ "stats_interval", false, NULL, NULL, &CONF.stats_interval, NULL, NULL },
+	{ "ssl_handshake_threads", false, NULL, NULL,
+	    &CONF.ssl_handshake_threads, NULL, NULL },
+	{ "ssl_ocsp", false, &CONF.ssl_ocsp, NULL, NULL, NULL, NULL },
+	{ "ssl_ocsp_refresh", false, NULL, NULL, &CONF.ssl_ocsp_refresh, NULL,
+	NULL },
+	{ "ssl_certdir", false, &CONF.ssl_certdir, NULL, NULL, NULL, NULL },
+	{ "ssl_early_data", false, NULL, NULL, &CONF.ssl_early_data, NULL, NULL },
+	{ "ssl_early_data_window", false, NULL, NULL, &CONF.ssl_early_data_window,
+	NULL, NULL },
+	{ "http2", false, NULL, &CONF.http2, NULL, NULL, NULL },
+	{ "compress_level", false, NULL, NULL, &CONF.compress_level, NULL, NULL },
+	{ "compress_window", false, NULL, NULL, &CONF.compress_window, NULL,
+	NULL },
+	{ "compress_cache_size", false, NULL, NULL, &CONF.compress_cache_size,
+	NULL, NULL },
+	{ "cache_size", false, NULL, NULL, &CONF.cache_size, NULL, NULL },
+	{ "cache_dir", false, &CONF.cache_dir, NULL, NULL, NULL, NULL },
+	{ "cache_disk_size", false, NULL, NULL, &CONF.cache_disk_size, NULL,
+	NULL },
+	{ "cache_stale", false, NULL, NULL, &CONF.cache_stale, NULL, NULL },
+	{ "cache_peers", false, &CONF.cache_peers, NULL, NULL, NULL, NULL },
+	{ "cache_peer_listen", false, &CONF.cache_peer_listen, NULL, NULL, NULL,
+	NULL },
+	{ "snapshot", false, &CONF.snapshot, NULL, NULL, NULL, NULL },
+	{ "snapshot_interval", false, NULL, NULL, &CONF.snapshot_interval, NULL,
+	NULL },
+	{ "hittersfile", false, &CONF.hittersfile, NULL, NULL, NULL, NULL },
+	{ "hitters_top", false, NULL, NULL, &CONF.hitters_top, NULL, NULL },
+	{ "prewarm", false, NULL, NULL, &CONF.prewarm, NULL, NULL },
+	{ "prewarm_max", false, NULL, NULL, &CONF.prewarm_max, NULL, NULL },
+	{ "tor_control", false, &CONF.tor_control, NULL, NULL, NULL, NULL },
+	{ "tor_control_password", false, &CONF.tor_control_password, NULL, NULL,
+	NULL, NULL },
+	{ "tor_control_cookie", false, &CONF.tor_control_cookie, NULL, NULL,
+	NULL, NULL },
 
 //  { "cipher_list", false, NULL, NULL, NULL, &depreciated, "cipher_list" },
       };
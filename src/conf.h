@@ -86,6 +86,35 @@ typedef struct
   char *mirror;
   char *dummyproxy;
   size_t bufsize;
+  char *ssl_ticket_key;
+  int ssl_ticket_rotate;
+  char *statsfile;
+  int stats_interval;
+  int ssl_handshake_threads;
+  char *ssl_ocsp;
+  int ssl_ocsp_refresh;
+  char *ssl_certdir;
+  int ssl_early_data;
+  int ssl_early_data_window;
+  bool http2;
+  int compress_level;
+  int compress_window;
+  int compress_cache_size;
+  int cache_size;
+  char *cache_dir;
+  int cache_disk_size;
+  int cache_stale;
+  char *cache_peers;
+  char *cache_peer_listen;
+  char *snapshot;
+  int snapshot_interval;
+  char *hittersfile;
+  int hitters_top;
+  int prewarm;
+  int prewarm_max;
+  char *tor_control;
+  char *tor_control_password;
+  char *tor_control_cookie;
 } CONF_T;
 extern CONF_T CONF;
 
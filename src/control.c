@@ -0,0 +1,556 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file control.c
+ * @brief Onion descriptors fetched ahead through Tor's control port
+ * @author Mike Mestnik
+ *
+ * Most of the wait for the first request to an onion is Tor fetching its
+ * descriptor and building the circuits to it.  With CONF.tor_control set,
+ * "host:port" or the path of a unix socket, one connection is kept to Tor's
+ * control port and the descriptors of the onions likely to be asked for are
+ * fetched before they are.  It speaks the control protocol's text lines
+ * only, so anything that does can stand in for Tor.
+ *
+ * It authenticates with CONF.tor_control_password, the cookie file in
+ * CONF.tor_control_cookie or nothing, and asks for HS_DESC events.  Onions
+ * are wanted when they are among hitters_top() or when control_want() is
+ * passed one, rewrite_body() does for the links in the pages it passes.
+ * Every second up to CONTROL_BURST of the wanted get an HSFETCH.
+ *
+ * What the HS_DESC events tell, about these fetches and the ones Tor does on
+ * its own, is kept in CONTROL_SLOTS slots.  An onion takes over the slot it
+ * hashes to, so links in a page can't make the table grow.  control_state()
+ * is what the rest of the gateway sees, states age back to CONTROL_UNKNOWN.
+ */
+
+#include "control.h"
+#include "hitters.h"
+#include "onion.h"
+#include "sockets.h"
+#include "schedule.h"
+#include "sendbuf.h"
+#include "vector.h"
+#include "globals.h"
+#include "stats.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+// Onions whose descriptors are tracked, one slot each.
+#define CONTROL_SLOTS 1024
+// HSFETCHes sent a second at most.
+#define CONTROL_BURST 8
+// Seconds Tor isn't tried again after the connection failed.
+#define CONTROL_RETRY 30
+// Seconds a descriptor that came counts as warm, after that it is fetched
+// again if still wanted.
+#define CONTROL_FRESH 900
+// Seconds a fetch may take before it is taken for lost.
+#define CONTROL_FETCH_TIMEOUT 120
+// Seconds an onion whose descriptor failed is left alone.
+#define CONTROL_FAILED_HOLD 60
+// Longer lines are taken for garbage and the connection is dropped.
+#define CONTROL_LINE_MAX 65536
+// The length of a cookie file.
+#define CONTROL_COOKIE 32
+
+typedef struct
+{
+  uint64_t hash; // 0 for a slot no onion has had.
+  char label[ONION_V3_LEN + 1];
+  control_state_t state;
+  time_t since;
+} control_slot_t;
+
+typedef enum
+{
+  CONTROL_CMD_AUTHENTICATE,
+  CONTROL_CMD_SETEVENTS,
+  CONTROL_CMD_HSFETCH,
+} control_cmd_type_t;
+
+/* A command sent, replies come in the same order. */
+typedef struct
+{
+  control_cmd_type_t type;
+  uint64_t hash; // Of the onion an HSFETCH was for.
+} control_cmd_t;
+
+static control_slot_t *slots = NULL;
+static struct sockaddr_storage addr;
+static socklen_t addr_len;
+static fd_closure_h fd = NULL;
+static bool connected;
+static bool ready; // Authenticated, and the events come.
+static bool in_data; // Within a "+" reply, up to its "." line.
+static sendbuf_h in = NULL;
+static sendbuf_h out = NULL;
+static Vector sent;
+static time_t down_until = 0;
+static size_t cursor; // Where the next scan for wanted onions starts.
+static int control_instanceid;
+
+static void
+control_closed (fd_closure_h c, bool write)
+{
+  // The select() that reported this fd ran before it was closed.
+}
+
+/* Lower cases the label into slot form, false for what is no label. */
+static bool
+control_label (const char *label, size_t len, char b[ONION_V3_LEN + 1])
+{
+  size_t i;
+  if (ONION_V2_LEN != len && ONION_V3_LEN != len)
+    return false;
+  for (i = 0; i < len; i++)
+    {
+      char c = label[i] | 0x20;
+      if (!('a' <= c && 'z' >= c) && !('2' <= label[i] && '7' >= label[i]))
+	return false;
+      b[i] = '2' <= label[i] && '7' >= label[i] ? label[i] : c;
+    }
+  b[len] = '\0';
+  return true;
+}
+
+static uint64_t
+control_hash (const char *label)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; '\0' != *label; label++)
+    h = (h ^ (unsigned char) *label) * 0x100000001b3ULL;
+  // Zero marks a slot no onion has had.
+  return h | 1;
+}
+
+/* The slot of label, taken over from whichever onion had it when take. */
+static control_slot_t *
+control_slot (const char *label, bool take)
+{
+  uint64_t h = control_hash (label);
+  control_slot_t *s = &slots[h % CONTROL_SLOTS];
+  if (h == s->hash)
+    return s;
+  if (!take)
+    return NULL;
+  *s = (control_slot_t
+	)
+	  { .hash = h, .label = "", .state = CONTROL_UNKNOWN, .since = 0, };
+  strcpy (s->label, label);
+  return s;
+}
+
+/* The state as of now, what is too old to tell anything is unknown. */
+static control_state_t
+control_age (const control_slot_t *s, time_t now)
+{
+  switch (s->state)
+    {
+    case CONTROL_FETCHING:
+      return
+	  now - s->since < CONTROL_FETCH_TIMEOUT ? s->state : CONTROL_UNKNOWN;
+    case CONTROL_WARM:
+      return now - s->since < CONTROL_FRESH ? s->state : CONTROL_UNKNOWN;
+    case CONTROL_FAILED:
+      return now - s->since < CONTROL_FAILED_HOLD ? s->state : CONTROL_UNKNOWN;
+    default:
+      return s->state;
+    }
+}
+
+static void
+control_set (control_slot_t *s, control_state_t state)
+{
+  s->state = state;
+  s->since = time (NULL);
+}
+
+/* Fetch the descriptor of label, "<label>" without ".onion", soon unless
+ * it is known already. */
+void
+control_want (const char *label, size_t len)
+{
+  char b[ONION_V3_LEN + 1];
+  control_slot_t *s;
+  if (NULL == slots || !control_label (label, len, b))
+    return;
+  s = control_slot (b, true);
+  if (CONTROL_UNKNOWN == control_age (s, time (NULL)))
+    control_set (s, CONTROL_WANTED);
+}
+
+/* What is known of the descriptor of hostname, "<label>.onion". */
+control_state_t
+control_state (const char *hostname)
+{
+  char b[ONION_V3_LEN + 1];
+  control_slot_t *s;
+  size_t len = strlen (hostname);
+  if (NULL == slots || sizeof(".onion") > len
+      || !control_label (hostname, len - sizeof(".onion") + 1, b)
+      || NULL == (s = control_slot (b, false)))
+    return CONTROL_UNKNOWN;
+  return control_age (s, time (NULL));
+}
+
+static size_t
+control_send_f (void *closure, const void *b, size_t len)
+{
+  ssize_t ret = send (fd->fd, b, len, MSG_NOSIGNAL);
+  return 0 > ret ? 0 : ret;
+}
+
+/* A failed send shows up as the connection closing on the next read. */
+static void
+control_flush ()
+{
+  if (connected && NULL != out)
+    sendbuf_send (NULL, &out, &control_send_f);
+  if (connected && NULL == out)
+    FD_CLR(fd->fd, &WRITE_FDSET);
+  else
+    FD_SET(fd->fd, &WRITE_FDSET);
+}
+
+static void
+control_command (control_cmd_type_t type, uint64_t hash, const char *line,
+		 size_t len)
+{
+  control_cmd_t cmd =
+    { .type = type, .hash = hash, };
+  sendbuf_append (&out, line, len);
+  vector_push_back (&sent, &cmd);
+}
+
+/* Tor is left alone for CONTROL_RETRY, fetches it didn't answer are
+ * wanted again. */
+static void
+control_down ()
+{
+  if (NULL != fd)
+    {
+      sockets_close (fd);
+      fd->can = &control_closed;
+      fd = NULL;
+    }
+  VECTOR_FOR_EACH(&sent, i)
+    {
+      control_cmd_t *cmd = (control_cmd_t*) iterator_get (&i);
+      control_slot_t *s = &slots[cmd->hash % CONTROL_SLOTS];
+      if (CONTROL_CMD_HSFETCH == cmd->type && cmd->hash == s->hash
+	  && CONTROL_FETCHING == s->state)
+	s->state = CONTROL_WANTED;
+    }
+  vector_clear (&sent);
+  sendbuf_clear (&out);
+  sendbuf_clear (&in);
+  connected = ready = in_data = false;
+  down_until = time (NULL) + CONTROL_RETRY;
+}
+
+/* AUTHENTICATE with what the configuration has, as the first command. */
+static bool
+control_authenticate ()
+{
+  char line[2 * CONTROL_COOKIE + 2 * 256 + 32];
+  size_t len = sizeof("AUTHENTICATE") - 1;
+  memcpy (line, "AUTHENTICATE", len);
+  if (NULL != CONF.tor_control_password)
+    {
+      const char *p;
+      line[len++] = ' ';
+      line[len++] = '"';
+      for (p = CONF.tor_control_password; '\0' != *p && 256 > p
+	  - CONF.tor_control_password; p++)
+	{
+	  if ('"' == *p || '\\' == *p)
+	    line[len++] = '\\';
+	  line[len++] = *p;
+	}
+      line[len++] = '"';
+    }
+  else if (NULL != CONF.tor_control_cookie)
+    {
+      unsigned char cookie[CONTROL_COOKIE];
+      ssize_t ret;
+      size_t i;
+      int f;
+      // Tor writes a new one each time it starts, it is read each time.
+      if (0 > (f = open (CONF.tor_control_cookie, O_RDONLY)))
+	{
+	  perror ("tor control: cookie");
+	  return false;
+	}
+      ret = read (f, cookie, sizeof(cookie));
+      close (f);
+      if (sizeof(cookie) != ret)
+	{
+	  fprintf (stderr, "tor control: short cookie %s\n",
+		   CONF.tor_control_cookie);
+	  return false;
+	}
+      line[len++] = ' ';
+      for (i = 0; i < sizeof(cookie); i++)
+	len += sprintf (line + len, "%02x", cookie[i]);
+    }
+  line[len++] = '\r';
+  line[len++] = '\n';
+  control_command (CONTROL_CMD_AUTHENTICATE, 0, line, len);
+  return true;
+}
+
+static void
+control_can (fd_closure_h, bool);
+/* Connects and queues what is sent first, false when Tor can't be
+ * reached. */
+static bool
+control_up ()
+{
+  int f;
+  if (0 > (f = socket (addr.ss_family, SOCK_STREAM, 0)))
+    {
+      // LCOV_EXCL_START
+      perror ("tor control: socket");
+      down_until = time (NULL) + CONTROL_RETRY;
+      return false;
+      // LCOV_EXCL_STOP
+    }
+  fd = sockets_watch (f, &control_can, NULL);
+  connected = false;
+  if (0 == connect (f, (struct sockaddr*) &addr, addr_len))
+    connected = true;
+  else if (EINPROGRESS != errno)
+    {
+      fprintf (stderr, "tor control: %s\n", strerror (errno));
+      control_down ();
+      return false;
+    }
+  if (!control_authenticate ())
+    {
+      control_down ();
+      return false;
+    }
+  control_command (CONTROL_CMD_SETEVENTS, 0, "SETEVENTS HS_DESC\r\n",
+		   sizeof("SETEVENTS HS_DESC\r\n") - 1);
+  // Told when the connect is done, what was queued meanwhile goes then.
+  FD_SET(f, &WRITE_FDSET);
+  return true;
+}
+
+/* "650 HS_DESC <action> <address> ...", for fetches of any origin. */
+static void
+control_hs_desc (const char *text, size_t len)
+{
+  char line[256], action[16], address[ONION_V3_LEN + 8], b[ONION_V3_LEN + 1];
+  control_slot_t *s;
+  if (sizeof(line) <= len)
+    return;
+  memcpy (line, text, len);
+  line[len] = '\0';
+  if (2 != sscanf (line, "HS_DESC %15s %63s", action, address)
+      || !control_label (address, strlen (address), b))
+    return;
+  if (0 == strcmp (action, "RECEIVED"))
+    {
+      stats_inc (STATS_CONTROL_RECEIVED);
+      control_set (control_slot (b, true), CONTROL_WARM);
+    }
+  else if (0 == strcmp (action, "REQUESTED"))
+    {
+      s = control_slot (b, true);
+      if (CONTROL_WARM != control_age (s, time (NULL)))
+	control_set (s, CONTROL_FETCHING);
+    }
+  // One for each HSDir that didn't have it, another may still.
+  else if (0 == strcmp (action, "FAILED"))
+    {
+      stats_inc (STATS_CONTROL_FAILED);
+      s = control_slot (b, true);
+      if (CONTROL_WARM != control_age (s, time (NULL)))
+	control_set (s, CONTROL_FAILED);
+    }
+}
+
+/* The last line of a reply, to the oldest command sent. */
+static bool
+control_reply (int code, const char *text, size_t len)
+{
+  control_cmd_t cmd;
+  control_slot_t *s;
+  if (vector_is_empty (&sent))
+    return false;
+  cmd = *(control_cmd_t*) vector_front (&sent);
+  vector_pop_front (&sent);
+  if (250 == code)
+    {
+      if (CONTROL_CMD_SETEVENTS == cmd.type)
+	ready = true;
+      return true;
+    }
+  fprintf (stderr, "tor control: %d %.*s\n", code, (int) len, text);
+  if (CONTROL_CMD_HSFETCH != cmd.type)
+    return false;
+  // Not an onion Tor takes, or no HSFETCH in this Tor.
+  s = &slots[cmd.hash % CONTROL_SLOTS];
+  if (cmd.hash == s->hash)
+    control_set (s, CONTROL_FAILED);
+  return true;
+}
+
+/* One line without its end, false when the connection is to be dropped. */
+static bool
+control_line (const char *l, size_t len)
+{
+  int code;
+  if (in_data)
+    {
+      in_data = !(1 == len && '.' == l[0]);
+      return true;
+    }
+  if (4 > len || !('0' <= l[0] && '9' >= l[0]) || !('0' <= l[1] && '9' >= l[1])
+      || !('0' <= l[2] && '9' >= l[2]))
+    return false;
+  code = (l[0] - '0') * 100 + (l[1] - '0') * 10 + (l[2] - '0');
+  if ('+' == l[3])
+    in_data = true;
+  if (650 == code)
+    {
+      if (len - 4 > sizeof("HS_DESC ") - 1
+	  && 0 == memcmp (l + 4, "HS_DESC ", sizeof("HS_DESC ") - 1))
+	control_hs_desc (l + 4, len - 4);
+      return true;
+    }
+  if (' ' != l[3])
+    return true;
+  return control_reply (code, l + 4, len - 4);
+}
+
+static void
+control_can (fd_closure_h c, bool write)
+{
+  char b[16 << 10];
+  const char *p, *nl, *e;
+  ssize_t ret;
+  bool open;
+  if (write)
+    {
+      if (!connected)
+	{
+	  int err = 0;
+	  socklen_t len = sizeof(err);
+	  getsockopt (c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	  if (0 != err)
+	    {
+	      fprintf (stderr, "tor control: %s\n", strerror (err));
+	      control_down ();
+	      return;
+	    }
+	  connected = true;
+	}
+      control_flush ();
+      return;
+    }
+  while (0 < (ret = recv (c->fd, b, sizeof(b), 0)))
+    sendbuf_append (&in, b, ret);
+  open = 0 > ret && (EAGAIN == errno || EWOULDBLOCK == errno);
+  if (!open)
+    fprintf (stderr, "tor control: %s\n",
+	     0 == ret ? "closed" : strerror (errno));
+  p = get_sendbuf_buf (in);
+  e = p + get_sendbuf_size (in);
+  for (; NULL != in && NULL != (nl = memchr (p, '\n', e - p)); p = nl + 1)
+    if (!control_line (p, nl - p - (nl > p && '\r' == nl[-1])))
+      {
+	open = false;
+	break;
+      }
+  if (!open || CONTROL_LINE_MAX < e - p)
+    {
+      if (open)
+	fprintf (stderr, "tor control: line too long\n");
+      control_down ();
+      return;
+    }
+  // What is left is the part of a line still coming.
+  if (NULL != in)
+    sendbuf_skip (&in, p - (const char*) get_sendbuf_buf (in));
+}
+
+/* Every second, the busiest onions are wanted, up to CONTROL_BURST of the
+ * wanted are fetched, and Tor is tried again if it is time. */
+static void
+control_event (void *closure)
+{
+  const hitters_entry_t *top;
+  time_t now = time (NULL);
+  size_t n, i, burst = 0;
+  n = hitters_top (HITTERS_ONIONS, &top);
+  for (i = 0; i < n; i++)
+    {
+      size_t len = strlen (top[i].key);
+      if (sizeof(".onion") <= len)
+	control_want (top[i].key, len - sizeof(".onion") + 1);
+    }
+  if (NULL == fd && now >= down_until)
+    control_up ();
+  for (i = 0; ready && i < CONTROL_SLOTS && CONTROL_BURST > burst; i++)
+    {
+      control_slot_t *s = &slots[cursor];
+      cursor = (cursor + 1) % CONTROL_SLOTS;
+      if (CONTROL_WANTED == s->state)
+	{
+	  char line[sizeof("HSFETCH \r\n") + ONION_V3_LEN];
+	  control_command (CONTROL_CMD_HSFETCH, s->hash, line,
+			   sprintf (line, "HSFETCH %s\r\n", s->label));
+	  control_set (s, CONTROL_FETCHING);
+	  stats_inc (STATS_CONTROL_FETCHES);
+	  burst++;
+	}
+    }
+  if (NULL != fd)
+    control_flush ();
+  schedule_timer (&control_event, NULL, &control_instanceid, 1);
+}
+
+void
+control_init ()
+{
+  if (NULL == CONF.tor_control)
+    return;
+  if (!sockets_addr (CONF.tor_control, &addr, &addr_len))
+    {
+      fprintf (stderr, "control_init: bad tor_control %s\n",
+	       CONF.tor_control);
+      return;
+    }
+  while (NULL == slots)
+    slots = calloc (CONTROL_SLOTS, sizeof(control_slot_t));
+  while (VECTOR_SUCCESS != vector_setup (&sent, 16, sizeof(control_cmd_t)))
+    ;
+  control_event (NULL);
+}
@@ -0,0 +1,45 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_CONTROL_H
+#define __TOR2WEB_CONTROL_H
+
+/**
+ * @file control.h
+ * @brief Onion descriptors fetched ahead through Tor's control port
+ * @author Mike Mestnik
+ */
+
+#include <stddef.h>
+
+typedef enum
+{
+  CONTROL_UNKNOWN, // Nothing recent was heard of its descriptor.
+  CONTROL_WANTED, // An HSFETCH is yet to be sent.
+  CONTROL_FETCHING,
+  CONTROL_WARM, // Tor has the descriptor.
+  CONTROL_FAILED, // No HSDir had it, the onion is likely down.
+} control_state_t;
+
+void
+control_init ();
+void
+control_want (const char*, size_t);
+control_state_t
+control_state (const char*);
+
+#endif
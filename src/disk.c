@@ -0,0 +1,640 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file disk.c
+ * @brief Second cache tier, an append only log of responses on disk
+ * @author Mike Mestnik
+ *
+ * Every response the memory cache keeps is also appended to the current
+ * segment under CONF.cache_dir, so it outlives both eviction and restarts.
+ * Segments are only ever appended to and dropped whole, oldest first, once
+ * CONF.cache_disk_size is used.  The index in memory holds where each record
+ * starts, everything else is read from the record itself through a mapping
+ * of its segment, and on a hit the mapping is what gets copied into the TLS
+ * send buffer.
+ *
+ * The writes happen on a worker thread, the event loop only copies the
+ * record and reserves its place.  When the writer falls behind the record is
+ * dropped instead of waited for.  A record only goes in the index once it is
+ * on disk, and at startup the index is rebuilt by walking the segments.  A
+ * record torn by a crash fails its checksum and the segment is cut there.
+ *
+ * Walking every record again makes startup as slow as the disk is large, so
+ * the index also goes into the snapshot.  A segment the snapshot knows is
+ * only walked past where it was written up to then, the records before are
+ * indexed straight from the snapshot and checked against their header the
+ * first time they are found.
+ */
+
+#include "disk.h"
+#include "hextree.h"
+#include "vector.h"
+#include "workqueue.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define DISK_MAGIC 0x43573254 // "T2WC" on little endian.
+#define DISK_SEGMENT (64 << 20)
+#define DISK_ALIGN 8
+// Bytes copied for the writer and not yet written, beyond this new records
+// are dropped.
+#define DISK_QUEUE_BYTES (32 << 20)
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t crc; // Of the rest of the record, padding included.
+  uint32_t vary_len; // With its NUL, 0 for none.
+  uint32_t head_len;
+  uint32_t body_len;
+  uint32_t reserved;
+  int64_t date;
+  int64_t expires;
+  unsigned char key[DISK_KEY];
+  unsigned char vary_key[DISK_KEY];
+} disk_header_t;
+
+typedef struct disk_entry *disk_entry_h;
+typedef struct segment *segment_h;
+
+typedef struct segment
+{
+  uint32_t id;
+  int fd;
+  unsigned char *map; // All of DISK_SEGMENT, only size bytes are backed.
+  size_t size; // Where the next record goes.
+  size_t written; // Everything before is on disk and indexed.
+  unsigned pending; // Writes not done yet, it can't be dropped.
+  disk_entry_h entries;
+} segment_t;
+
+/* Kept small, there is one for every response on disk. */
+typedef struct disk_entry
+{
+  hexnode_h node;
+  disk_entry_h sibling; // Another Vary of the same key.
+  disk_entry_h prev; // In the same segment.
+  disk_entry_h next;
+  segment_h segment;
+  uint32_t offset;
+  uint32_t crc; // Of the record, to tell it is still the one indexed.
+  time_t expires;
+} disk_entry_t;
+
+/* How a segment was when the snapshot was taken. */
+typedef struct
+{
+  uint32_t id;
+  uint32_t written;
+  uint32_t entries; // Its share of the entries after all the segments.
+  uint32_t reserved;
+} disk_snapshot_segment_t;
+
+typedef struct
+{
+  unsigned char key[DISK_KEY];
+  int64_t expires;
+  uint32_t offset;
+  uint32_t crc;
+} disk_snapshot_entry_t;
+
+/* Where the segments opened at startup are in the snapshot, both are in the
+ * order of their ids. */
+typedef struct
+{
+  const disk_snapshot_segment_t *segment;
+  const disk_snapshot_segment_t *end;
+  const disk_snapshot_entry_t *entry;
+} disk_restore_t;
+
+typedef struct
+{
+  segment_h segment;
+  uint32_t offset;
+  size_t len;
+  bool ok;
+  unsigned char *buf;
+} disk_write_t;
+
+static hexnode_h hexnode;
+static Vector segments; // Of segment_h, oldest first.
+static workqueue_h writer = NULL;
+static size_t max_segments;
+static size_t queued;
+
+static size_t
+disk_record_len (const disk_header_t *hdr)
+{
+  size_t len = sizeof(disk_header_t) + (size_t) hdr->vary_len
+      + hdr->head_len + hdr->body_len;
+  return (len + DISK_ALIGN - 1) & ~(size_t) (DISK_ALIGN - 1);
+}
+
+static const disk_header_t *
+disk_header (disk_entry_h e)
+{
+  return (const disk_header_t*) (e->segment->map + e->offset);
+}
+
+static char *
+segment_path (uint32_t id)
+{
+  char *path = NULL;
+  while (NULL == path)
+    path = malloc (strlen (CONF.cache_dir) + 16);
+  sprintf (path, "%s/%08x.seg", CONF.cache_dir, id);
+  return path;
+}
+
+static segment_h
+segment_open (uint32_t id)
+{
+  segment_h s = NULL;
+  struct stat st;
+  char *path = segment_path (id);
+  int fd;
+  fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  free (path);
+  if (-1 == fd)
+    {
+      perror ("segment_open: open");
+      return NULL;
+    }
+  while (NULL == s)
+    s = malloc (sizeof(segment_t));
+  *s = (segment_t
+	)
+	  { .id = id, .fd = fd, .map = MAP_FAILED, .size = 0, .written = 0,
+	      .pending = 0, .entries = NULL, };
+  if (-1 == fstat (fd, &st)
+      || MAP_FAILED
+	  == (s->map = mmap (NULL, DISK_SEGMENT, PROT_READ, MAP_SHARED, fd, 0)))
+    {
+      perror ("segment_open");
+      close (fd);
+      free (s);
+      return NULL;
+    }
+  // Nothing past the mapping can be read, or was written by us.
+  s->size = DISK_SEGMENT < st.st_size ? DISK_SEGMENT : st.st_size;
+  vector_push_back (&segments, &s);
+  return s;
+}
+
+static void
+entry_delete (disk_entry_h e)
+{
+  disk_entry_h *p;
+  if (NULL != e->prev)
+    e->prev->next = e->next;
+  else
+    e->segment->entries = e->next;
+  if (NULL != e->next)
+    e->next->prev = e->prev;
+  for (p = (disk_entry_h*) &e->node->data; *p != e; p = &(*p)->sibling)
+    ;
+  *p = e->sibling;
+  if (NULL == e->node->data)
+    hexnode_delete (hexnode, e->node->depth, e->node->node);
+  free (e);
+}
+
+static void
+entry_insert (segment_h s, hexnode_h node, uint32_t offset, uint32_t crc,
+	      time_t expires)
+{
+  disk_entry_h e = NULL;
+  while (NULL == e)
+    e = malloc (sizeof(disk_entry_t));
+  *e = (disk_entry_t
+	)
+	  { .node = node, .sibling = node->data, .prev = NULL, .next =
+	      s->entries, .segment = s, .offset = offset, .crc = crc,
+	      .expires = expires, };
+  node->data = e;
+  if (NULL != s->entries)
+    s->entries->prev = e;
+  s->entries = e;
+}
+
+/* The record at offset is on disk, it replaces any older one for the same
+ * request. */
+static void
+disk_index (segment_h s, uint32_t offset)
+{
+  const disk_header_t *hdr = (const disk_header_t*) (s->map + offset);
+  disk_entry_h old;
+  hexnode_h node;
+  node = hexnode_lookup (hexnode, DISK_KEY, hdr->key, true);
+  for (old = node->data; NULL != old; old = old->sibling)
+    if (0 == memcmp (disk_header (old)->vary_key, hdr->vary_key, DISK_KEY))
+      {
+	entry_delete (old);
+	// The delete may have taken the node with it.
+	node = hexnode_lookup (hexnode, DISK_KEY, hdr->key, true);
+	break;
+      }
+  entry_insert (s, node, offset, hdr->crc, hdr->expires);
+}
+
+static void
+unlink_job (void *c)
+{
+  if (0 != unlink (c))
+    perror ("segment unlink"); // LCOV_EXCL_LINE
+}
+
+static void
+unlink_done (void *c)
+{
+  free (c);
+}
+
+static void
+segment_drop ()
+{
+  segment_h s = *(segment_h*) vector_front (&segments);
+  char *path;
+  while (NULL != s->entries)
+    entry_delete (s->entries);
+  munmap (s->map, DISK_SEGMENT);
+  close (s->fd);
+  path = segment_path (s->id);
+  if (!workqueue_submit (writer, &unlink_job, &unlink_done, path))
+    {
+      unlink_job (path);
+      unlink_done (path);
+    }
+  vector_pop_front (&segments);
+  free (s);
+}
+
+/* Indexes the records of a segment found at startup from offset on, the
+ * first one that doesn't check out and everything after it is cut off. */
+static void
+segment_scan (segment_h s, size_t offset, time_t now)
+{
+  size_t len;
+  while (offset + sizeof(disk_header_t) <= s->size)
+    {
+      const disk_header_t *hdr = (const disk_header_t*) (s->map + offset);
+      if (DISK_MAGIC != hdr->magic
+	  || s->size - offset < (len = disk_record_len (hdr))
+	  || hdr->crc
+	      != crc32 (crc32 (0L, Z_NULL, 0), s->map + offset + 8, len - 8)
+	  || (0 != hdr->vary_len
+	      && 0 != s->map[offset + sizeof(disk_header_t) + hdr->vary_len - 1]))
+	break;
+      if (now < hdr->expires)
+	disk_index (s, offset);
+      offset += len;
+    }
+  if (offset != s->size)
+    {
+      fprintf (stderr, "Cutting segment %08x at %zu of %zu\n", s->id, offset,
+	       s->size);
+      if (0 != ftruncate (s->fd, offset))
+	perror ("segment_scan: ftruncate"); // LCOV_EXCL_LINE
+      s->size = offset;
+    }
+  s->written = offset;
+}
+
+/* Indexes what the snapshot says s held without reading any of it, and
+ * returns where what was written since starts.  0 when the snapshot doesn't
+ * know s, or s was cut since. */
+static size_t
+segment_restore (segment_h s, disk_restore_t *r, time_t now)
+{
+  const disk_snapshot_segment_t *snap;
+  const disk_snapshot_entry_t *e;
+  unsigned long long restored = 0;
+  while (r->segment < r->end && r->segment->id < s->id)
+    r->entry += r->segment++->entries;
+  if (r->segment == r->end || r->segment->id != s->id)
+    return 0;
+  snap = r->segment++;
+  e = r->entry;
+  r->entry += snap->entries;
+  if (s->size < snap->written)
+    return 0;
+  for (; e < r->entry; e++)
+    if (now < e->expires && snap->written >= sizeof(disk_header_t)
+	&& e->offset <= snap->written - sizeof(disk_header_t))
+      {
+	entry_insert (s, hexnode_lookup (hexnode, DISK_KEY, e->key, true),
+		      e->offset, e->crc, e->expires);
+	restored++;
+      }
+  stats_add (STATS_SNAPSHOT_RESTORED, restored);
+  return snap->written;
+}
+
+/* The disk section of the snapshot, false when there is none that makes
+ * sense. */
+static bool
+disk_restore_init (disk_restore_t *r)
+{
+  const disk_snapshot_segment_t *s;
+  const uint32_t *n;
+  size_t len, entries = 0;
+  if (NULL == (n = snapshot_section (SNAPSHOT_DISK, &len))
+      || 2 * sizeof(uint32_t) > len
+      || (len - 2 * sizeof(uint32_t)) / sizeof(disk_snapshot_segment_t) < n[0])
+    return false;
+  r->segment = (const disk_snapshot_segment_t*) (n + 2);
+  r->end = r->segment + n[0];
+  for (s = r->segment; s < r->end; s++)
+    entries += s->entries;
+  r->entry = (const disk_snapshot_entry_t*) r->end;
+  return (const char*) n + len - (const char*) r->entry
+      == (ptrdiff_t) (entries * sizeof(disk_snapshot_entry_t));
+}
+
+static int
+segment_filter (const struct dirent *d)
+{
+  unsigned id;
+  char c;
+  return 2 == sscanf (d->d_name, "%8x.se%c", &id, &c) && 'g' == c
+      && 12 == strlen (d->d_name);
+}
+
+void
+disk_init ()
+{
+  struct dirent **names;
+  time_t now = time (NULL);
+  disk_restore_t r =
+    { .segment = NULL, .end = NULL, .entry = NULL, };
+  int n, i;
+  hexnode = hexnode_new (0, NULL);
+  while (VECTOR_SUCCESS != vector_setup (&segments, 16, sizeof(segment_h)))
+    ;
+  if (NULL == CONF.cache_dir || 0 >= CONF.cache_disk_size)
+    return;
+  if (0 != mkdir (CONF.cache_dir, 0700) && EEXIST != errno)
+    {
+      perror ("disk_init: mkdir");
+      return;
+    }
+  // Zero padded hex, so sorted by name is oldest first.
+  if (0 > (n = scandir (CONF.cache_dir, &names, &segment_filter, &alphasort)))
+    {
+      perror ("disk_init: scandir");
+      return;
+    }
+  if (!disk_restore_init (&r))
+    r.segment = r.end = NULL;
+  for (i = 0; i < n; i++)
+    {
+      segment_h s;
+      unsigned id;
+      sscanf (names[i]->d_name, "%8x", &id);
+      if (NULL != (s = segment_open (id)))
+	segment_scan (s, segment_restore (s, &r, now), now);
+      free (names[i]);
+    }
+  free (names);
+  if (vector_is_empty (&segments) && NULL == segment_open (0))
+    return;
+  max_segments = ((size_t) CONF.cache_disk_size << 20) / DISK_SEGMENT;
+  if (2 > max_segments)
+    max_segments = 2;
+  writer = workqueue_new (1, 64);
+}
+
+/* Only the expired are taken out, what the onion replaced is replaced by
+ * disk_index() as it is written. */
+bool
+disk_find (const unsigned char key[DISK_KEY], disk_match_f match,
+	   void *closure, disk_record_t *record)
+{
+  hexnode_h node;
+  disk_entry_h e, next;
+  time_t now = time (NULL);
+  if (NULL == writer
+      || NULL == (node = hexnode_lookup (hexnode, DISK_KEY, key, false)))
+    return false;
+  for (e = node->data; NULL != e; e = next)
+    {
+      const disk_header_t *hdr;
+      const unsigned char *p;
+      next = e->sibling;
+      if (now >= e->expires)
+	{
+	  entry_delete (e);
+	  continue;
+	}
+      hdr = disk_header (e);
+      // One from the snapshot may no longer be the record it was.
+      if (DISK_MAGIC != hdr->magic || e->crc != hdr->crc
+	  || e->segment->size - e->offset < disk_record_len (hdr))
+	{
+	  entry_delete (e);
+	  continue;
+	}
+      p = (const unsigned char*) (hdr + 1);
+      if (!match (hdr->vary_len ? (const char*) p : NULL, hdr->vary_key,
+		  closure))
+	continue;
+      p += hdr->vary_len;
+      *record = (disk_record_t
+	    )
+	      { .vary = hdr->vary_len ? (const char*) (hdr + 1) : NULL, .head =
+		  p, .head_len = hdr->head_len, .body = p + hdr->head_len,
+		  .body_len = hdr->body_len, .date = hdr->date, .expires =
+		  hdr->expires, };
+      return true;
+    }
+  return false;
+}
+
+static void
+write_job (void *c)
+{
+  disk_write_t *w = c;
+  disk_header_t *hdr = (disk_header_t*) w->buf;
+  size_t done = 0;
+  ssize_t ret;
+  hdr->crc = crc32 (crc32 (0L, Z_NULL, 0), w->buf + 8, w->len - 8);
+  while (done < w->len)
+    {
+      ret = pwrite (w->segment->fd, w->buf + done, w->len - done,
+		    w->offset + done);
+      if (-1 == ret && EINTR == errno)
+	continue;
+      if (0 >= ret)
+	{
+	  perror ("disk write_job: pwrite");
+	  w->ok = false;
+	  return;
+	}
+      done += ret;
+    }
+  w->ok = true;
+}
+
+static void
+write_done (void *c)
+{
+  disk_write_t *w = c;
+  w->segment->pending--;
+  queued -= w->len;
+  if (w->ok)
+    {
+      stats_inc (STATS_DISK_WRITES);
+      disk_index (w->segment, w->offset);
+      // There is one writer, a record written after a hole doesn't move it.
+      if (w->segment->written == w->offset)
+	w->segment->written += w->len;
+    }
+  else
+    {
+      // What follows a hole won't be found after a restart, start afresh.
+      stats_inc (STATS_DISK_DROPS);
+      w->segment->size = DISK_SEGMENT;
+    }
+  free (w->buf);
+  free (w);
+}
+
+/* The record is copied, nothing passed in needs to outlive the call. */
+void
+disk_store (const unsigned char key[DISK_KEY], const char *vary,
+	    const unsigned char vary_key[DISK_KEY], time_t date,
+	    time_t expires, const void *head, size_t head_len,
+	    const void *body, size_t body_len)
+{
+  disk_header_t hdr =
+    { .magic = DISK_MAGIC, .crc = 0, .vary_len =
+    NULL == vary ? 0 : strlen (vary) + 1, .head_len = head_len, .body_len =
+	body_len, .reserved = 0, .date = date, .expires = expires, };
+  disk_write_t *w = NULL;
+  segment_h s;
+  size_t len;
+  if (NULL == writer)
+    return;
+  len = disk_record_len (&hdr);
+  if (DISK_SEGMENT < len || DISK_QUEUE_BYTES < queued + len)
+    {
+      stats_inc (STATS_DISK_DROPS);
+      return;
+    }
+  s = *(segment_h*) vector_back (&segments);
+  if (DISK_SEGMENT - s->size < len)
+    {
+      if (NULL == (s = segment_open (s->id + 1)))
+	{
+	  stats_inc (STATS_DISK_DROPS); // LCOV_EXCL_LINE
+	  return; // LCOV_EXCL_LINE
+	}
+      while (max_segments < segments.size
+	  && 0 == (*(segment_h*) vector_front (&segments))->pending)
+	segment_drop ();
+    }
+  memcpy (hdr.key, key, DISK_KEY);
+  memcpy (hdr.vary_key, vary_key, DISK_KEY);
+  while (NULL == w)
+    w = malloc (sizeof(disk_write_t));
+  *w = (disk_write_t
+	)
+	  { .segment = s, .offset = s->size, .len = len, .ok = false, .buf =
+	  NULL, };
+  // Zeroed, the padding is checksummed too.
+  while (NULL == w->buf)
+    w->buf = calloc (1, len);
+  memcpy (w->buf, &hdr, sizeof(hdr));
+  len = sizeof(hdr);
+  if (NULL != vary)
+    memcpy (w->buf + len, vary, hdr.vary_len);
+  len += hdr.vary_len;
+  memcpy (w->buf + len, head, head_len);
+  memcpy (w->buf + len + head_len, body, body_len);
+  if (!workqueue_submit (writer, &write_job, &write_done, w))
+    {
+      stats_inc (STATS_DISK_DROPS);
+      free (w->buf);
+      free (w);
+      return;
+    }
+  s->size += w->len;
+  s->pending++;
+  queued += w->len;
+}
+
+/* The index as it stands, for the next start to trust instead of reading
+ * every record again. */
+void
+disk_snapshot (sendbuf_h *buf)
+{
+  disk_snapshot_segment_t *snap = NULL;
+  disk_snapshot_entry_t *entries = NULL;
+  uint32_t n[2] =
+    { 0, 0 };
+  size_t count = 0, i = 0, j = 0;
+  disk_entry_h e;
+  if (NULL == writer)
+    return;
+  VECTOR_FOR_EACH(&segments, it)
+    {
+      segment_h s = ITERATOR_GET_AS(segment_h, &it);
+      for (e = s->entries; NULL != e; e = e->next)
+	count++;
+    }
+  n[0] = segments.size;
+  while (NULL == snap)
+    snap = malloc (n[0] * sizeof(disk_snapshot_segment_t));
+  while (NULL == entries && 0 != count)
+    entries = malloc (count * sizeof(disk_snapshot_entry_t));
+  VECTOR_FOR_EACH(&segments, it)
+    {
+      segment_h s = ITERATOR_GET_AS(segment_h, &it);
+      snap[i] = (disk_snapshot_segment_t
+	    )
+	      { .id = s->id, .written = s->written, .entries = 0, .reserved =
+		  0, };
+      for (e = s->entries; NULL != e; e = e->next)
+	{
+	  entries[j] = (disk_snapshot_entry_t
+		)
+		  { .expires = e->expires, .offset = e->offset, .crc = e->crc, };
+	  memcpy (entries[j++].key, e->node->node, DISK_KEY);
+	  snap[i].entries++;
+	}
+      i++;
+    }
+  sendbuf_append (buf, n, sizeof(n));
+  sendbuf_append (buf, snap, n[0] * sizeof(disk_snapshot_segment_t));
+  sendbuf_append (buf, entries, count * sizeof(disk_snapshot_entry_t));
+  free (snap);
+  free (entries);
+}
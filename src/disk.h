@@ -0,0 +1,64 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_DISK_H
+#define __TOR2WEB_DISK_H
+
+/**
+ * @file disk.h
+ * @brief Second cache tier, an append only log of responses on disk
+ * @author Mike Mestnik
+ */
+
+#include "sendbuf.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define DISK_KEY 32
+
+/* A response as found on disk, the pointers are into a mapping and only
+ * good until control goes back to the event loop. */
+typedef struct
+{
+  const char *vary; // NULL when the response doesn't Vary.
+  const void *head;
+  size_t head_len;
+  const void *body;
+  size_t body_len;
+  time_t date;
+  time_t expires;
+} disk_record_t;
+
+/* Whether a response that Varies on vary, with vary_key for the request it
+ * answered, also answers the one in closure. */
+typedef bool
+(*disk_match_f) (const char*, const unsigned char[DISK_KEY], void*);
+
+void
+disk_init ();
+bool
+disk_find (const unsigned char[DISK_KEY], disk_match_f, void*, disk_record_t*);
+void
+disk_store (const unsigned char[DISK_KEY], const char*,
+	    const unsigned char[DISK_KEY], time_t, time_t, const void*, size_t,
+	    const void*, size_t);
+void
+disk_snapshot (sendbuf_h*);
+
+#endif
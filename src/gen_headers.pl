@@ -0,0 +1,164 @@
+#!/usr/bin/perl
+#  tor2web
+#  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU Affero General Public License as
+#  published by the Free Software Foundation, either version 3 of the
+#  License, or (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Affero General Public License for more details.
+#
+#  You should have received a copy of the GNU Affero General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Writes headers_hash.h to stdout from the names in headers.txt.
+#
+# Each name is folded to a 32 bit key from its length and its first, second,
+# middle and last bytes (| 0x20, so case doesn't matter).  The key times an
+# odd multiplier, top bits, indexes a table of enum values.  The multiplier
+# is searched for until no two names share a slot, so a lookup is one
+# multiply, one load and one strncasecmp.
+
+use strict;
+use warnings;
+
+my (@names, %seen);
+while (<>)
+  {
+    chomp;
+    s/#.*//;
+    s/^\s+|\s+$//g;
+    next if '' eq $_;
+    die "Duplicate header $_\n" if $seen{lc $_}++;
+    push @names, $_;
+  }
+die "No headers\n" unless @names;
+
+sub key
+{
+  my @c = map { ord ($_) | 0x20 } split //, shift;
+  my $len = @c;
+  return ($len << 24 ^ $c[0] << 16 ^ $c[1 % $len] << 8 ^ $c[$len >> 1]
+	  ^ $c[-1] << 4) & 0xffffffff;
+}
+
+sub mul32
+{
+  my ($x, $m) = @_;
+  return ($x * ($m & 0xffff) + ((($x * ($m >> 16)) & 0xffff) << 16))
+    & 0xffffffff;
+}
+
+my %keys;
+for my $name (@names)
+  {
+    my $k = key ($name);
+    die "Headers $keys{$k} and $name fold to the same key, use more bytes\n"
+      if exists $keys{$k};
+    $keys{$k} = $name;
+  }
+
+my $bits = 1;
+$bits++ while (1 << $bits) < 2 * @names;
+my ($seed, @table);
+srand (1);
+SEARCH: for (;;)
+  {
+    for (1 .. 100000)
+      {
+	$seed = int (rand (0xffffffff)) | 1;
+	@table = (0) x (1 << $bits);
+	my $ok = 1;
+	for my $i (0 .. $#names)
+	  {
+	    my $slot = mul32 (key ($names[$i]), $seed) >> (32 - $bits);
+	    if ($table[$slot])
+	      {
+		$ok = 0;
+		last;
+	      }
+	    $table[$slot] = $i + 1;
+	  }
+	last SEARCH if $ok;
+      }
+    $bits++;
+  }
+
+sub ident
+{
+  my $n = uc shift;
+  $n =~ s/[^A-Z0-9]/_/g;
+  return "HEADER_$n";
+}
+
+my ($min, $max) = (255, 0);
+for (@names)
+  {
+    $min = length ($_) if length ($_) < $min;
+    $max = length ($_) if length ($_) > $max;
+  }
+
+print <<"EOT";
+/* Generated by gen_headers.pl from headers.txt, do not edit. */
+
+#ifndef __TOR2WEB_HEADERS_HASH_H
+#define __TOR2WEB_HEADERS_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+typedef enum
+{
+  HEADER_UNKNOWN,
+EOT
+print "  ", ident ($_), ",\n" for @names;
+print <<"EOT";
+  HEADER_MAX
+} header_t;
+
+static const struct
+{
+  const char *name;
+  size_t len;
+} header_names[HEADER_MAX] =
+  {
+    { "", 0 },
+EOT
+printf "    { \"%s\", %d },\n", $_, length ($_) for @names;
+print "  };\n\n";
+printf "static const unsigned char header_table[%d] =\n  {", 1 << $bits;
+for my $i (0 .. $#table)
+  {
+    print "\n   " if 0 == $i % 12;
+    printf " %2d,", $table[$i];
+  }
+print "\n  };\n";
+printf <<"EOT", $min, $max, $seed, 32 - $bits;
+
+/* The header_t for the name at p, HEADER_UNKNOWN for anything not listed in
+ * headers.txt. */
+static inline header_t
+header_lookup (const char *p, size_t len)
+{
+  const unsigned char *c = (const unsigned char*) p;
+  uint32_t x;
+  header_t id;
+  if (%d > len || %d < len)
+    return HEADER_UNKNOWN;
+  x = (uint32_t) len << 24 ^ (uint32_t) (c[0] | 0x20) << 16
+      ^ (c[1 %% len] | 0x20) << 8 ^ (c[len >> 1] | 0x20)
+      ^ (c[len - 1] | 0x20) << 4;
+  id = header_table[(uint32_t) (x * %uu) >> %d];
+  if (header_names[id].len == len
+      && 0 == strncasecmp (p, header_names[id].name, len))
+    return id;
+  return HEADER_UNKNOWN;
+}
+
+#endif
+EOT
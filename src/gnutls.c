@@ -22,13 +22,22 @@
  */
 
 #include "gnutls.h"
+#include "certstore.h"
 #include "conf.h"
 #include "globals.h"
+#include "h2.h"
 #include "httpsd.h"
+#include "ocsp.h"
+#include "replay.h"
 #include "schedule.h"
+#include "stats.h"
+#include "ticket.h"
+#include "workqueue.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <gnutls/gnutls.h>
 
@@ -42,11 +51,19 @@ typedef struct tlssession
   httpsd_h output;
   response_h head_of_line;
   bool close_on_fin;
+  int handshake_ret;
+  bool selected;
+  h2_h h2;
 } tlssession_t;
 
 static gnutls_certificate_credentials_t x509_cred;
 static gnutls_dh_params_t dh_params;
 static gnutls_priority_t priority_cache;
+static workqueue_h handshake_pool = NULL;
+static const gnutls_datum_t alpn_protocols[] =
+  {
+    { (unsigned char*) "h2", 2 },
+    { (unsigned char*) "http/1.1", 8 }, };
 
 // LCOV_EXCL_START
 static void
@@ -81,56 +98,75 @@ _gnutls_init ()
     {
       // TODO: Bail
     }
+  else
+    ocsp_attach (x509_cred, 0, CONF.ssl_cert);
   ret = gnutls_dh_params_init (&dh_params);
   // TODO: Other stuff for dh_params CONF.ssl_dh
-  gnutls_certificate_set_dh_params (x509_cred, dh_params);
+  // Empty params crash newer GnuTLS, which negotiates RFC7919 groups anyway.
+  if (NULL != CONF.ssl_dh)
+    gnutls_certificate_set_dh_params (x509_cred, dh_params);
   ret = gnutls_priority_init (&priority_cache, CONF.cipher_directs, NULL);
+  certstore_init ();
+  ticket_init ();
+  replay_init ();
+  if (0 < CONF.ssl_handshake_threads)
+    handshake_pool = workqueue_new (CONF.ssl_handshake_threads, 1024);
 }
 
 static void
 can_send (tlssession_h);
+/* Pushes out the pending buffer.  After GNUTLS_E_AGAIN GnuTLS wants the
+ * same data again, which is still at the front of the buffer. */
 static void
-record_send (tlssession_h h, const void *d, size_t s)
+record_flush (tlssession_h h)
 {
-  ssize_t ret;
-  ret = gnutls_record_send (h->session, d, s);
-  assert(ret != GNUTLS_E_INTERRUPTED); // Ctrl-C or other signal, unlikely.
-  if (ret == GNUTLS_E_AGAIN)
-    {
-      if (gnutls_record_get_direction (h->session) == 1)
-	FD_SET(h->fd_c->fd, &WRITE_FDSET);
-      if (NULL != d)
-	sendbuf_append (&h->sendbuf, d, s);
-      h->can = &can_send;
-      return;
-    }
-  else if (ret < 0)
+  while (NULL != h->sendbuf)
     {
-      assert(!ret); // TODO: Close connection.
-
-    }
-  else if (ret < s)
-    {
-      if (NULL != h->sendbuf)
-	{
-	  sendbuf_skip (&h->sendbuf, ret);
-	}
-      else if (NULL != d)
-	h->sendbuf = sendbuf_new (d + ret, s - ret);
-      if (NULL != h->sendbuf)
+      ssize_t ret;
+      size_t s = get_sendbuf_size (h->sendbuf);
+      ret = gnutls_record_send (h->session, get_sendbuf_buf (h->sendbuf),
+				s);
+      assert(ret != GNUTLS_E_INTERRUPTED); // Ctrl-C or other signal, unlikely.
+      if (ret == GNUTLS_E_AGAIN)
 	{
+	  if (gnutls_record_get_direction (h->session) == 1)
+	    FD_SET(h->fd_c->fd, &WRITE_FDSET);
 	  h->can = &can_send;
 	  return;
 	}
+      else if (ret < 0)
+	{
+	  // can_read() notices and closes it.
+	  sendbuf_clear (&h->sendbuf);
+	  shutdown (h->fd_c->fd, SHUT_RDWR);
+	  break;
+	}
+      sendbuf_skip (&h->sendbuf, ret);
     }
   h->can = NULL;
   // TODO: schedule_timer (schedule_event, h->fd_c, &h->fd_c->instanceid, 5);
+  if (h->close_on_fin && NULL == h->head_of_line)
+    shutdown (h->fd_c->fd, SHUT_RDWR);
+  // Whoever held back for the client can go on.
+  else if (NULL != h->h2)
+    h2_drain (h->h2);
+  else if (NULL != h->head_of_line && NULL != h->head_of_line->drain)
+    h->head_of_line->drain (h->head_of_line);
 }
 
 static void
 can_send (tlssession_h h)
 {
-  record_send (h, NULL, 0);
+  record_flush (h);
+}
+
+void
+tlssession_send (tlssession_h h, const void *d, size_t s)
+{
+  sendbuf_append (&h->sendbuf, d, s);
+  // Otherwise a handshake or an earlier send owns the session.
+  if (NULL == h->can)
+    record_flush (h);
 }
 
 void
@@ -151,42 +187,112 @@ response_attach (response_h h)
     }
 }
 
-static inline bool
-a (response_h h)
+/* A response no client reads, what is sent to it is dropped. */
+response_h
+response_detached ()
 {
-  const void *d = get_sendbuf_buf (h->sendbuf);
-  size_t s = get_sendbuf_size (h->sendbuf);
-  if (NULL == h->tls->can)
-    {
-      record_send (h->tls, d, s);
-    }
-  else
-    sendbuf_append (&h->tls->sendbuf, d, s);
-  sendbuf_clear (&h->sendbuf);
-  return true;
+  response_h h = NULL;
+  while (NULL == h)
+    h = malloc (sizeof(response_t));
+  *h = (response_t
+	)
+	  { .next = NULL, .tls = NULL, .eof = false, .sendbuf = NULL, .stream =
+	  NULL, .drain = NULL, .closure = NULL, .hits = HITTERS_NONE, };
+  return h;
 }
 
 void
 response_send (response_h h, const void *d, size_t s)
 {
   tlssession_h tls = h->tls;
+  h->hits.bytes += s;
+  if (h->eof)
+    hitters_done (&h->hits);
+  if (NULL != h->stream)
+    {
+      h2_response (h, d, s);
+      return;
+    }
   if (NULL == tls)
-    return;
+    {
+      // The client went away, the upstream still owns this.
+      if (h->eof)
+	{
+	  sendbuf_clear (&h->sendbuf);
+	  free (h);
+	}
+      return;
+    }
   sendbuf_append (&h->sendbuf, d, s);
   if (tls->head_of_line == h)
     {
-      while (NULL != h && (a (h) || h->eof))
+      while (NULL != h)
 	{
+	  sendbuf_append (&tls->sendbuf, get_sendbuf_buf (h->sendbuf),
+			  get_sendbuf_size (h->sendbuf));
+	  sendbuf_clear (&h->sendbuf);
+	  if (!h->eof)
+	    break;
 	  tls->head_of_line = h->next;
 	  free (h);
 	  h = tls->head_of_line;
 	}
+      if (NULL == tls->can)
+	record_flush (tls);
     }
 }
 
+/* Gather write, the slices need only live for the call. */
+void
+response_sendv (response_h h, const struct iovec *iov, size_t n)
+{
+  if (NULL != h->stream)
+    {
+      sendbuf_h b = NULL;
+      sendbuf_appendv (&b, iov, n);
+      h->hits.bytes += get_sendbuf_size (b);
+      h2_response (h, get_sendbuf_buf (b), get_sendbuf_size (b));
+      sendbuf_clear (&b);
+      return;
+    }
+  if (NULL != h->tls)
+    sendbuf_appendv (&h->sendbuf, iov, n);
+  for (; 0 < n; n--, iov++)
+    h->hits.bytes += iov->iov_len;
+  response_send (h, NULL, 0);
+}
+
+/* Bytes given for the response that the client hasn't taken yet. */
+size_t
+response_pending (response_h h)
+{
+  if (NULL == h->tls)
+    return 0;
+  if (NULL != h->stream)
+    return h2_pending (h->stream) + get_sendbuf_size (h->tls->sendbuf);
+  return get_sendbuf_size (h->sendbuf)
+      + (h->tls->head_of_line == h ? get_sendbuf_size (h->tls->sendbuf) : 0);
+}
+
 void
 gnutls_close (tlssession_h h)
 {
+  response_h r;
+  // Responses still being filled by the upstream free themselves.
+  while (NULL != (r = h->head_of_line))
+    {
+      h->head_of_line = r->next;
+      if (r->eof)
+	{
+	  sendbuf_clear (&r->sendbuf);
+	  free (r);
+	}
+      else
+	r->tls = NULL;
+    }
+  if (NULL != h->h2)
+    h2_close (h->h2);
+  h->h2 = NULL;
   if (NULL != h->session)
     gnutls_deinit (h->session);
   h->session = NULL;
@@ -217,7 +323,7 @@ can_read (tlssession_h h)
 	  if (gnutls_record_get_direction (h->session) == 1)
 	    FD_SET(h->fd_c->fd, &WRITE_FDSET);
 	  h->can = &can_read;
-	  return;
+	  break;
 	}
       else if (ret == 0)
 	{
@@ -230,14 +336,21 @@ can_read (tlssession_h h)
 	}
       else if (ret < 0)
 	{
-	  // TODO: Close connection!
+	  gnutls_close (h);
 	  return;
 	}
+      else if (ret > 0 && NULL != h->h2)
+	h2_in (h->h2, in, ret);
       else if (ret > 0)
 	httpsd_in (h->output, in, ret);
     }
   while (0 < (ret = gnutls_record_check_pending (h->session)));
-  h->can = NULL;
+  if (GNUTLS_E_AGAIN != ret)
+    h->can = NULL;
+  // An answer given from in here, like a cache hit, may not have fit and
+  // would otherwise wait for the client to send again.
+  if (NULL != h->sendbuf)
+    record_flush (h);
 }
 
 static void
@@ -261,31 +374,122 @@ tlssession_can (fd_closure_h c, bool write)
 }
 
 static void
-can_handshake (tlssession_h h)
+can_handshake (tlssession_h);
+static void
+can_wait (tlssession_h h)
+{
+  // The fd is paused while a worker owns the session, nothing to do.
+}
+
+/* ALPN is settled once the ClientHello has been processed, which is sure
+ * once early data came or the handshake is done.  Until then the choice
+ * isn't made, the ClientHello may not even have arrived. */
+static void
+frontend_select (tlssession_h h)
 {
+  gnutls_datum_t alpn;
+  if (h->selected)
+    return;
+  h->selected = true;
+  if (0 == gnutls_alpn_get_selected_protocol (h->session, &alpn)
+      && 2 == alpn.size && 0 == memcmp (alpn.data, "h2", 2))
+    {
+      h->h2 = h2_new (h);
+      httpsd_close (h->output);
+      h->output = NULL;
+    }
+}
+
+/* Early data is buffered by GnuTLS while the handshake waits on the
+ * client's Finished, httpsd only lets idempotent requests through. */
+static void
+recv_early (tlssession_h h)
+{
+  char in[4096];
+  ssize_t ret;
+  while (0
+      < (ret = gnutls_record_recv_early_data (h->session, in, sizeof(in))))
+    {
+      frontend_select (h);
+      if (NULL != h->h2)
+	h2_in_early (h->h2, in, ret);
+      else
+	httpsd_in_early (h->output, in, ret);
+    }
+}
+
+static void
+handshake_finish (tlssession_h h)
+{
+  int ret = h->handshake_ret;
+  // The handshake owns the session, what h2_new() sends waits for it.
+  h->can = &can_handshake;
+  if (0 < CONF.ssl_early_data && (0 <= ret || GNUTLS_E_AGAIN == ret))
+    recv_early (h);
+  if (GNUTLS_E_AGAIN == ret)
+    {
+      if (gnutls_record_get_direction (h->session) == 1)
+	FD_SET(h->fd_c->fd, &WRITE_FDSET);
+      return;
+    }
+  if (ret < 0)
+    {
+      fprintf (stderr, "FATAL: handshake on %d\n", h->fd_c->fd);
+      gnutls_close (h);
+    }
+  else
+    {
+      stats_inc (STATS_TLS_HANDSHAKES);
+      if (gnutls_session_is_resumed (h->session))
+	stats_inc (STATS_TLS_RESUMED);
+      if (GNUTLS_SFLAGS_EARLY_DATA & gnutls_session_get_flags (h->session))
+	stats_inc (STATS_TLS_EARLY_DATA);
+      frontend_select (h);
+      // Responses to early data were held until now.
+      record_flush (h);
+      if (NULL != h->h2)
+	h2_established (h->h2);
+      else
+	httpsd_established (h->output);
+    }
+}
+
+/* May run on a worker thread, it must only touch the session. */
+static void
+handshake_job (void *c)
+{
+  tlssession_h h = c;
   int ret;
   do
     {
       ret = gnutls_handshake (h->session);
       assert(ret != GNUTLS_E_INTERRUPTED); // Ctrl-C or other signal, unlikely.
-      if (GNUTLS_E_AGAIN == ret)
-	{
-	  if (gnutls_record_get_direction (h->session) == 1)
-	    FD_SET(h->fd_c->fd, &WRITE_FDSET);
-	  h->can = &can_handshake;
-	  return;
-	}
     }
-  while (ret < 0 && gnutls_error_is_fatal (ret) == 0);
-  if (ret < 0)
+  while (GNUTLS_E_AGAIN != ret && ret < 0 && gnutls_error_is_fatal (ret) == 0);
+  h->handshake_ret = ret;
+}
+
+static void
+handshake_done (void *c)
+{
+  tlssession_h h = c;
+  sockets_resume (h->fd_c);
+  handshake_finish (h);
+}
+
+static void
+can_handshake (tlssession_h h)
+{
+  // Private key operations would stall every other connection.
+  if (NULL != handshake_pool
+      && workqueue_submit (handshake_pool, &handshake_job, &handshake_done, h))
     {
-      fprintf (stderr, "FATAL: handshake on %d\n", h->fd_c->fd);
-      sockets_close (h->fd_c);
-      gnutls_deinit (h->session);
-      free (h);
+      sockets_pause (h->fd_c);
+      h->can = &can_wait;
+      return;
     }
-  else
-    h->can = NULL;
+  handshake_job (h);
+  handshake_finish (h);
 }
 
 void
@@ -298,10 +502,13 @@ tlssession_start (fd_closure_h fd_c, struct sockaddr *addr, socklen_t alen)
   *h = (tlssession_t
 	)
 	  { .session = NULL, .fd_c = fd_c, .sendbuf = NULL, .can = NULL,
-	      .close_on_fin = false, };
+	      .head_of_line = NULL, .close_on_fin = false, .selected = false,
+	      .h2 = NULL, };
   h->output = httpsd_new (h, addr, alen);
   int ret;
-  ret = gnutls_init (&h->session, GNUTLS_SERVER);
+  ret = gnutls_init (
+      &h->session,
+      GNUTLS_SERVER | (0 < CONF.ssl_early_data ? GNUTLS_ENABLE_EARLY_DATA : 0));
   if (0 > ret)
     {
       // Bail
@@ -313,17 +520,23 @@ tlssession_start (fd_closure_h fd_c, struct sockaddr *addr, socklen_t alen)
   ret = gnutls_set_default_priority (h->session);
   const char *errpos = NULL;
   ret = gnutls_priority_set_direct (h->session, CONF.cipher_directs, &errpos);
+  ticket_session (h->session);
+  certstore_session (h->session);
+  replay_enable (h->session);
+  if (CONF.http2)
+    gnutls_alpn_set_protocols (h->session, alpn_protocols, 2,
+			       GNUTLS_ALPN_SERVER_PRECEDENCE);
   gnutls_transport_set_ptr (h->session, (gnutls_transport_ptr_t) ptr);
-  can_handshake (h);
   fd_c->can = &tlssession_can;
   fd_c->closure = h;
-  return;
+  can_handshake (h);
 }
 
 void
 gnutls_close_on_fin (tlssession_h h)
 {
   h->close_on_fin = true;
+  // Callers still hold h, let the next read close it.
   if (NULL == h->head_of_line && NULL == h->sendbuf)
-    gnutls_close (h);
+    shutdown (h->fd_c->fd, SHUT_RDWR);
 }
@@ -27,6 +27,7 @@
 #include <stdbool.h>
 
 #include "sendbuf.h"
+#include "hitters.h"
 
 typedef struct tlssession *tlssession_h;
 typedef struct response *response_h;
@@ -37,6 +38,11 @@ typedef struct response
   tlssession_h tls;
   bool eof;
   sendbuf_h sendbuf;
+  struct h2_stream *stream; // HTTP/2 responses bypass the queue.
+  void
+  (*drain) (response_h); // Called when what was sent has gone out.
+  void *closure;
+  hitters_ticket_t hits;
 } response_t;
 
 #include "sockets.h"
@@ -52,8 +58,16 @@ gnutls_close (tlssession_h);
 void
 gnutls_close_on_fin (tlssession_h);
 void
+tlssession_send (tlssession_h, const void*, size_t);
+void
 response_attach (response_h);
+response_h
+response_detached ();
 void
 response_send (response_h, const void*, size_t);
+void
+response_sendv (response_h, const struct iovec*, size_t);
+size_t
+response_pending (response_h);
 
 #endif
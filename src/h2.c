@@ -0,0 +1,957 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file h2.c
+ * @brief HTTP/2 server side
+ * @author Mike Mestnik
+ *
+ * Each stream is turned back into an HTTP/1.1 request and handed to
+ * http_new(), so streams to the same onion share its upstream connections.
+ * The HTTP/1.1 response is turned into HEADERS and DATA frames as it
+ * arrives.  Streams don't wait on each other, each one has its own
+ * response_t instead of a place in the session's head of line queue.
+ *
+ * Request bodies are collected until END_STREAM so they can be sent with
+ * a Content-Length.  The receive window is reopened as soon as DATA
+ * arrives, the send window is honoured per stream and per connection.
+ */
+
+#include "h2.h"
+#include "hpack.h"
+#include "http.h"
+#include "headers_hash.h"
+#include "onion.h"
+#include "codec.h"
+#include "cache.h"
+#include "hitters.h"
+#include "stats.h"
+#include "vector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME 16384 // Both ways, we never ask for or use more.
+#define H2_WINDOW 65535
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_STREAMS 100
+#define H2_TABLE 4096
+#define H2_BODY (1 << 20)
+
+enum
+{
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+};
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+enum
+{
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT,
+  H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+};
+
+typedef struct h2_stream *h2_stream_h;
+typedef struct h2_stream
+{
+  unsigned id;
+  h2_h h2;
+  response_h output;
+  char *method;
+  char *path;
+  char *authority;
+  unsigned accept_encoding;
+  sendbuf_h headers; // Request headers, already HTTP/1.1 lines.
+  sendbuf_h cookie;
+  sendbuf_h body;
+  sendbuf_h head; // Response head until it is complete.
+  sendbuf_h data; // Response body waiting for window.
+  long window;
+  bool have_headers;
+  bool bad;
+  bool started;
+  bool end_in;
+  bool have_head;
+  bool end_out;
+  bool sent_end;
+} h2_stream_t;
+
+typedef struct h2
+{
+  tlssession_h tls;
+  hpack_h hpack;
+  sendbuf_h in;
+  sendbuf_h hblock;
+  unsigned hblock_id; // Header block being continued, 0 if none.
+  unsigned char hblock_flags;
+  Vector streams; // of h2_stream_h
+  unsigned last_id;
+  long window;
+  long initial_window;
+  bool have_preface;
+  bool early;
+  bool goaway; // We gave up, input is ignored.
+  bool draining; // The client is done, close once idle.
+} h2_t;
+
+static void
+h2_frame (h2_h h, unsigned char type, unsigned char flags, unsigned id,
+	  const void *d, size_t s)
+{
+  unsigned char f[9 + H2_FRAME];
+  f[0] = s >> 16;
+  f[1] = s >> 8;
+  f[2] = s;
+  f[3] = type;
+  f[4] = flags;
+  f[5] = (id >> 24) & 0x7f;
+  f[6] = id >> 16;
+  f[7] = id >> 8;
+  f[8] = id;
+  if (0 != s)
+    memcpy (&f[9], d, s);
+  tlssession_send (h->tls, f, 9 + s);
+}
+
+static inline void
+h2_put32 (unsigned char *p, unsigned long v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline unsigned long
+h2_get32 (const unsigned char *p)
+{
+  return (unsigned long) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void
+h2_goaway (h2_h h, unsigned code)
+{
+  unsigned char p[8];
+  if (h->goaway)
+    return;
+  h2_put32 (p, h->last_id);
+  h2_put32 (&p[4], code);
+  h2_frame (h, H2_GOAWAY, 0, 0, p, 8);
+  h->goaway = true;
+  gnutls_close_on_fin (h->tls);
+}
+
+static void
+h2_rst (h2_h h, unsigned id, unsigned code)
+{
+  unsigned char p[4];
+  h2_put32 (p, code);
+  h2_frame (h, H2_RST_STREAM, 0, id, p, 4);
+}
+
+static void
+h2_window_update (h2_h h, unsigned id, unsigned long inc)
+{
+  unsigned char p[4];
+  h2_put32 (p, inc);
+  h2_frame (h, H2_WINDOW_UPDATE, 0, id, p, 4);
+}
+
+h2_h
+h2_new (tlssession_h tls)
+{
+  static const unsigned char settings[] =
+    { 0, 3, 0, 0, 0, H2_STREAMS, // SETTINGS_MAX_CONCURRENT_STREAMS
+	0, 2, 0, 0, 0, 0, }; // SETTINGS_ENABLE_PUSH
+  h2_h h = NULL;
+  while (NULL == h)
+    h = malloc (sizeof(h2_t));
+  *h = (h2_t
+	)
+	  { .tls = tls, .hpack = hpack_new (H2_TABLE), .in = NULL, .hblock =
+	  NULL, .hblock_id = 0, .last_id = 0, .window = H2_WINDOW,
+	      .initial_window = H2_WINDOW, .have_preface = false, .early =
+		  false, .goaway = false, .draining = false, };
+  while (VECTOR_SUCCESS
+      != vector_setup (&h->streams, 8, sizeof(h2_stream_h)))
+    ;
+  // The server's preface may go out before the client's arrives.
+  h2_frame (h, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  stats_inc (STATS_H2_SESSIONS);
+  return h;
+}
+
+static h2_stream_h
+h2_find (h2_h h, unsigned id, size_t *index)
+{
+  size_t i;
+  for (i = 0; i < h->streams.size; i++)
+    {
+      h2_stream_h st = VECTOR_GET_AS(h2_stream_h, &h->streams, i);
+      if (id == st->id)
+	{
+	  if (NULL != index)
+	    *index = i;
+	  return st;
+	}
+    }
+  return NULL;
+}
+
+static void
+h2_stream_free (h2_h h, size_t i)
+{
+  h2_stream_h st = VECTOR_GET_AS(h2_stream_h, &h->streams, i);
+  if (NULL != st->output)
+    {
+      // The upstream frees it when it's done.
+      st->output->stream = NULL;
+      st->output->tls = NULL;
+    }
+  free (st->method);
+  free (st->path);
+  free (st->authority);
+  sendbuf_clear (&st->headers);
+  sendbuf_clear (&st->cookie);
+  sendbuf_clear (&st->body);
+  sendbuf_clear (&st->head);
+  sendbuf_clear (&st->data);
+  free (st);
+  vector_erase (&h->streams, i);
+  if (h->draining && vector_is_empty (&h->streams))
+    gnutls_close_on_fin (h->tls);
+}
+
+void
+h2_close (h2_h h)
+{
+  while (!vector_is_empty (&h->streams))
+    h2_stream_free (h, h->streams.size - 1);
+  vector_destroy (&h->streams);
+  hpack_free (h->hpack);
+  sendbuf_clear (&h->in);
+  sendbuf_clear (&h->hblock);
+  free (h);
+}
+
+/* Sends what the windows allow, returns true if the stream is gone. */
+static bool
+h2_stream_pump (h2_h h, size_t i)
+{
+  h2_stream_h st = VECTOR_GET_AS(h2_stream_h, &h->streams, i);
+  size_t left;
+  if (!st->have_head || st->sent_end)
+    goto DONE;
+  while (0 < (left = get_sendbuf_size (st->data)) && 0 < st->window
+      && 0 < h->window)
+    {
+      size_t n = left;
+      bool end;
+      if (n > H2_FRAME)
+	n = H2_FRAME;
+      if (n > st->window)
+	n = st->window;
+      if (n > h->window)
+	n = h->window;
+      end = st->end_out && n == left;
+      h2_frame (h, H2_DATA, end ? H2_END_STREAM : 0, st->id,
+		get_sendbuf_buf (st->data), n);
+      sendbuf_skip (&st->data, n);
+      st->window -= n;
+      h->window -= n;
+      st->sent_end = end;
+    }
+  if (st->end_out && !st->sent_end && NULL == st->data)
+    {
+      h2_frame (h, H2_DATA, H2_END_STREAM, st->id, NULL, 0);
+      st->sent_end = true;
+    }
+  DONE: if (!st->sent_end || !st->end_in)
+    return false;
+  h2_stream_free (h, i);
+  return true;
+}
+
+static void
+h2_pump (h2_h h)
+{
+  size_t i = 0;
+  while (i < h->streams.size)
+    if (!h2_stream_pump (h, i))
+      i++;
+}
+
+static void
+h2_send_headers (h2_h h, unsigned id, sendbuf_h block, bool end)
+{
+  const char *b = get_sendbuf_buf (block);
+  size_t s = get_sendbuf_size (block), n;
+  unsigned char type = H2_HEADERS, flags = end ? H2_END_STREAM : 0;
+  do
+    {
+      n = s > H2_FRAME ? H2_FRAME : s;
+      h2_frame (h, type, flags | (n == s ? H2_END_HEADERS : 0), id, b, n);
+      type = H2_CONTINUATION;
+      flags = 0;
+      b += n;
+      s -= n;
+    }
+  while (0 != s);
+}
+
+/* Answers without asking the upstream. */
+static void
+h2_reply_status (h2_stream_h st, int status)
+{
+  sendbuf_h block = NULL;
+  hpack_encode_status (&block, status);
+  hpack_encode (&block, "content-length", 14, "0", 1);
+  h2_send_headers (st->h2, st->id, block, true);
+  sendbuf_clear (&block);
+  st->have_head = true;
+  st->end_out = true;
+  st->sent_end = true;
+}
+
+static void
+h2_field (void *c, const char *n, size_t nlen, const char *v, size_t vlen)
+{
+  h2_stream_h st = c;
+  size_t i;
+  // Don't let anything split the HTTP/1.1 request we build.
+  if (vlen != strcspn (v, "\r\n") || 0 == nlen)
+    {
+      st->bad = true;
+      return;
+    }
+  if (':' == n[0])
+    {
+      char **p = NULL;
+      if (NULL != st->headers || NULL != st->cookie)
+	st->bad = true;
+      else if (7 == nlen && 0 == memcmp (n, ":method", 7))
+	p = &st->method;
+      else if (5 == nlen && 0 == memcmp (n, ":path", 5))
+	p = &st->path;
+      else if (10 == nlen && 0 == memcmp (n, ":authority", 10))
+	p = &st->authority;
+      else if (7 != nlen || 0 != memcmp (n, ":scheme", 7))
+	st->bad = true;
+      if (NULL != p && NULL == *p)
+	while (NULL == *p)
+	  *p = strndup (v, vlen);
+      else if (NULL != p)
+	st->bad = true;
+      return;
+    }
+  for (i = 0; i < nlen; i++)
+    if (isupper ((unsigned char) n[i]) || ':' == n[i] || ' ' == n[i])
+      {
+	st->bad = true;
+	return;
+      }
+  switch (header_lookup (n, nlen))
+    {
+    case HEADER_TE:
+      if (8 != vlen || 0 != memcmp (v, "trailers", 8))
+	st->bad = true;
+      return;
+    case HEADER_HOST:
+      if (NULL == st->authority)
+	while (NULL == st->authority)
+	  st->authority = strndup (v, vlen);
+      return;
+    case HEADER_COOKIE:
+      if (NULL != st->cookie)
+	sendbuf_append (&st->cookie, "; ", 2);
+      else
+	sendbuf_append (&st->cookie, "Cookie: ", 8);
+      sendbuf_append (&st->cookie, v, vlen);
+      return;
+    case HEADER_CONTENT_LENGTH:
+      // Recomputed from the body.
+      return;
+    case HEADER_ACCEPT_ENCODING:
+      st->accept_encoding |= codec_accept (v, vlen);
+      break;
+    case HEADER_UPGRADE:
+    case HEADER_CONNECTION:
+    case HEADER_KEEP_ALIVE:
+    case HEADER_PROXY_CONNECTION:
+    case HEADER_TRANSFER_ENCODING:
+      st->bad = true;
+      break;
+    default:
+      break;
+    }
+  if (st->bad)
+    return;
+  sendbuf_append (&st->headers, n, nlen);
+  sendbuf_append (&st->headers, ": ", 2);
+  sendbuf_append (&st->headers, v, vlen);
+  sendbuf_append (&st->headers, "\r\n", 2);
+}
+
+static void
+h2_ignore (void *c, const char *n, size_t nlen, const char *v, size_t vlen)
+{
+  // The block still has to go through HPACK to keep the table in step.
+}
+
+/* Passes the request upstream, returns true if it was refused and the
+ * stream is gone. */
+static bool
+h2_start (h2_h h, size_t i)
+{
+  h2_stream_h st = VECTOR_GET_AS(h2_stream_h, &h->streams, i);
+  response_h output = NULL;
+  http_request_t request;
+  onion_t onion;
+  sendbuf_h req = NULL;
+  char buf[64];
+  http_h http;
+  if (!st->have_headers || !st->end_in || st->started)
+    return false;
+  // Early data can be replayed, anything else waits for the handshake.
+  if (h->early && NULL != st->method && 0 != strcmp (st->method, "GET")
+      && 0 != strcmp (st->method, "HEAD"))
+    return false;
+  st->started = true;
+  stats_inc (STATS_H2_STREAMS);
+  if (st->bad || NULL == st->method || NULL == st->path
+      || NULL == st->authority
+      || !onion_find (st->authority, strlen (st->authority), &onion))
+    {
+      h2_reply_status (st, 400);
+      // Both ways are done, nothing is left to pump.
+      h2_stream_free (h, i);
+      return true;
+    }
+  sendbuf_append (&req, st->method, strlen (st->method));
+  sendbuf_append (&req, " ", 1);
+  sendbuf_append (&req, st->path, strlen (st->path));
+  request = (http_request_t
+	)
+	  { .handle = random () ^ random () ^ random (), .output = NULL,
+	      .http_subversion = true, .hostname = onion_hostname (
+		  st->authority, &onion), .target = strdup (st->path),
+	      .accept_encoding = st->accept_encoding, .flight = NULL, .alone =
+		  false, .peered = false, .retrybuf = NULL, };
+  sendbuf_append (&req, " HTTP/1.1\r\nHost: ", 17);
+  sendbuf_append (&req, request.hostname, strlen (request.hostname));
+  sendbuf_append (&req, "\r\n", 2);
+  sendbuf_append (&req, get_sendbuf_buf (st->headers),
+		  get_sendbuf_size (st->headers));
+  if (NULL != st->cookie)
+    {
+      sendbuf_append (&req, get_sendbuf_buf (st->cookie),
+		      get_sendbuf_size (st->cookie));
+      sendbuf_append (&req, "\r\n", 2);
+    }
+  if (NULL != st->body || 0 == strcmp (st->method, "POST")
+      || 0 == strcmp (st->method, "PUT"))
+    sendbuf_append (
+	&req, buf,
+	snprintf (buf, sizeof(buf), "Content-Length: %zu\r\n",
+		  get_sendbuf_size (st->body)));
+  sendbuf_append (&req, "\r\n", 2);
+  sendbuf_append (&req, get_sendbuf_buf (st->body),
+		  get_sendbuf_size (st->body));
+  while (NULL == output)
+    output = malloc (sizeof(response_t));
+  *output = (response_t
+	)
+	  { .next = NULL, .tls = h->tls, .eof = false, .sendbuf = NULL,
+	      .stream = st, .drain = NULL, .closure = NULL, .hits =
+		  HITTERS_NONE, };
+  st->output = output;
+  request.output = output;
+  hitters_request (&output->hits, request.hostname, request.target);
+  sendbuf_clear (&st->headers);
+  sendbuf_clear (&st->cookie);
+  sendbuf_clear (&st->body);
+  // A hit ends the stream, st may be gone after.
+  if (cache_serve (output, request.hostname, request.target,
+		   get_sendbuf_buf (req), get_sendbuf_size (req)))
+    {
+      free (request.hostname);
+      free (request.target);
+    }
+  else
+    {
+      http = http_new (request, get_sendbuf_buf (req), get_sendbuf_size (req));
+      // NULL when it joined a fetch already on its way or a peer was asked.
+      if (NULL != http)
+	http_detach (http, true, 0);
+    }
+  sendbuf_clear (&req);
+  return false;
+}
+
+static void
+h2_headers_done (h2_h h)
+{
+  size_t i;
+  h2_stream_h st = h2_find (h, h->hblock_id, &i);
+  bool ok, refused = false;
+  if (NULL == st && h->hblock_id > h->last_id)
+    {
+      h->last_id = h->hblock_id;
+      if (h->draining || H2_STREAMS <= h->streams.size)
+	refused = true;
+      else
+	{
+	  while (NULL == st)
+	    st = malloc (sizeof(h2_stream_t));
+	  *st = (h2_stream_t
+		)
+		  { .id = h->hblock_id, .h2 = h, .output = NULL, .method = NULL,
+		      .path = NULL, .authority = NULL, .headers = NULL,
+		      .cookie = NULL, .body = NULL, .head = NULL, .data = NULL,
+		      .window = h->initial_window, .have_headers = false, .bad =
+			  false, .started = false, .end_in = false, .have_head =
+			  false, .end_out = false, .sent_end = false, };
+	  vector_push_back (&h->streams, &st);
+	  i = h->streams.size - 1;
+	}
+    }
+  ok = hpack_decode (h->hpack, get_sendbuf_buf (h->hblock),
+		     get_sendbuf_size (h->hblock),
+		     NULL != st && !st->have_headers ? &h2_field : &h2_ignore,
+		     st);
+  sendbuf_clear (&h->hblock);
+  h->hblock_id = 0;
+  if (!ok)
+    {
+      h2_goaway (h, H2_COMPRESSION_ERROR);
+      return;
+    }
+  if (refused)
+    h2_rst (h, h->last_id, H2_REFUSED_STREAM);
+  if (NULL == st || st->end_in)
+    return;
+  // A second block is trailers, which must end the stream.
+  if (st->have_headers && !(h->hblock_flags & H2_END_STREAM))
+    {
+      h2_goaway (h, H2_PROTOCOL_ERROR);
+      return;
+    }
+  st->have_headers = true;
+  st->end_in = h->hblock_flags & H2_END_STREAM;
+  h2_start (h, i);
+}
+
+/* Drops the padding and the priority fields, false if malformed. */
+static bool
+h2_unpad (unsigned char flags, const unsigned char **p, size_t *s,
+bool priority)
+{
+  if (flags & H2_PADDED)
+    {
+      size_t pad;
+      if (1 > *s || (pad = (*p)[0]) >= *s)
+	return false;
+      (*p)++;
+      *s -= 1 + pad;
+    }
+  if (priority && flags & H2_PRIORITY_FLAG)
+    {
+      if (5 > *s)
+	return false;
+      *p += 5;
+      *s -= 5;
+    }
+  return true;
+}
+
+static void
+h2_settings (h2_h h, const unsigned char *p, size_t s)
+{
+  for (; 6 <= s; p += 6, s -= 6)
+    {
+      unsigned id = p[0] << 8 | p[1];
+      unsigned long v = h2_get32 (&p[2]);
+      if (4 == id)
+	{
+	  size_t i;
+	  if (H2_WINDOW_MAX < v)
+	    {
+	      h2_goaway (h, H2_FLOW_CONTROL_ERROR);
+	      return;
+	    }
+	  for (i = 0; i < h->streams.size; i++)
+	    (VECTOR_GET_AS(h2_stream_h, &h->streams, i))->window += (long) v
+		- h->initial_window;
+	  h->initial_window = v;
+	}
+      else if (5 == id && (16384 > v || 16777215 < v))
+	{
+	  h2_goaway (h, H2_PROTOCOL_ERROR);
+	  return;
+	}
+      // Header table size, max frame size and the rest don't concern us.
+    }
+  h2_frame (h, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+}
+
+static void
+h2_frame_in (h2_h h, unsigned char type, unsigned char flags, unsigned id,
+	     const unsigned char *p, size_t s)
+{
+  h2_stream_h st;
+  size_t i;
+  if (0 != h->hblock_id && (H2_CONTINUATION != type || id != h->hblock_id))
+    {
+      h2_goaway (h, H2_PROTOCOL_ERROR);
+      return;
+    }
+  switch (type)
+    {
+    case H2_DATA:
+      if (0 == id)
+	{
+	  h2_goaway (h, H2_PROTOCOL_ERROR);
+	  return;
+	}
+      // Padding counts against the window too.
+      if (0 != s)
+	h2_window_update (h, 0, s);
+      st = h2_find (h, id, &i);
+      if (NULL == st || st->end_in || !st->have_headers)
+	{
+	  if (id > h->last_id)
+	    h2_goaway (h, H2_PROTOCOL_ERROR);
+	  else
+	    h2_rst (h, id, H2_STREAM_CLOSED);
+	  return;
+	}
+      if (!h2_unpad (flags, &p, &s, false))
+	{
+	  h2_goaway (h, H2_PROTOCOL_ERROR);
+	  return;
+	}
+      if (H2_BODY < get_sendbuf_size (st->body) + s)
+	{
+	  h2_rst (h, id, H2_REFUSED_STREAM);
+	  h2_stream_free (h, i);
+	  return;
+	}
+      sendbuf_append (&st->body, p, s);
+      st->end_in = flags & H2_END_STREAM;
+      if (!st->end_in && 0 != s)
+	h2_window_update (h, id, s);
+      h2_start (h, i);
+      break;
+    case H2_HEADERS:
+      if (0 == id % 2 || !h2_unpad (flags, &p, &s, true))
+	{
+	  h2_goaway (h, H2_PROTOCOL_ERROR);
+	  return;
+	}
+      h->hblock_id = id;
+      h->hblock_flags = flags;
+      // Fall through.
+    case H2_CONTINUATION:
+      if (0 == h->hblock_id)
+	{
+	  h2_goaway (h, H2_PROTOCOL_ERROR);
+	  return;
+	}
+      if (H2_BODY < get_sendbuf_size (h->hblock) + s)
+	{
+	  h2_goaway (h, H2_ENHANCE_YOUR_CALM);
+	  return;
+	}
+      sendbuf_append (&h->hblock, p, s);
+      if (flags & H2_END_HEADERS)
+	h2_headers_done (h);
+      break;
+    case H2_PRIORITY:
+      if (0 == id)
+	h2_goaway (h, H2_PROTOCOL_ERROR);
+      break;
+    case H2_RST_STREAM:
+      if (0 == id || 4 != s)
+	h2_goaway (h, H2_PROTOCOL_ERROR);
+      else if (NULL != h2_find (h, id, &i))
+	h2_stream_free (h, i);
+      break;
+    case H2_SETTINGS:
+      if (0 != id || 0 != s % 6 || (flags & H2_ACK && 0 != s))
+	h2_goaway (h, H2_FRAME_SIZE_ERROR);
+      else if (!(flags & H2_ACK))
+	{
+	  h2_settings (h, p, s);
+	  h2_pump (h);
+	}
+      break;
+    case H2_PING:
+      if (0 != id || 8 != s)
+	h2_goaway (h, H2_FRAME_SIZE_ERROR);
+      else if (!(flags & H2_ACK))
+	h2_frame (h, H2_PING, H2_ACK, 0, p, 8);
+      break;
+    case H2_GOAWAY:
+      h->draining = true;
+      if (vector_is_empty (&h->streams))
+	gnutls_close_on_fin (h->tls);
+      break;
+    case H2_WINDOW_UPDATE:
+      {
+	unsigned long inc;
+	long *window;
+	if (4 != s)
+	  {
+	    h2_goaway (h, H2_FRAME_SIZE_ERROR);
+	    return;
+	  }
+	inc = h2_get32 (p) & H2_WINDOW_MAX;
+	if (0 == id)
+	  window = &h->window;
+	else if (NULL != (st = h2_find (h, id, &i)))
+	  window = &st->window;
+	else
+	  return;
+	if (0 == inc || H2_WINDOW_MAX < *window + (long) inc)
+	  {
+	    if (0 == id)
+	      h2_goaway (h, 0 == inc ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+	    else
+	      {
+		h2_rst (h, id, 0 == inc ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+		h2_stream_free (h, i);
+	      }
+	    return;
+	  }
+	*window += inc;
+	h2_pump (h);
+      }
+      break;
+    case H2_PUSH_PROMISE:
+      h2_goaway (h, H2_PROTOCOL_ERROR);
+      break;
+    default:
+      // Unknown frame types must be ignored.
+      break;
+    }
+}
+
+static size_t
+h2_process (void *c, const void *v, size_t s)
+{
+  h2_h h = c;
+  const unsigned char *d = v;
+  size_t ret = 0;
+  if (!h->have_preface)
+    {
+      if (H2_PREFACE_LEN > s)
+	return 0;
+      if (0 != memcmp (d, H2_PREFACE, H2_PREFACE_LEN))
+	{
+	  h2_goaway (h, H2_PROTOCOL_ERROR);
+	  return s;
+	}
+      h->have_preface = true;
+      ret = H2_PREFACE_LEN;
+    }
+  while (!h->goaway && 9 <= s - ret)
+    {
+      const unsigned char *f = d + ret;
+      size_t len = f[0] << 16 | f[1] << 8 | f[2];
+      if (H2_FRAME < len)
+	{
+	  h2_goaway (h, H2_FRAME_SIZE_ERROR);
+	  break;
+	}
+      if (9 + len > s - ret)
+	return ret;
+      ret += 9 + len;
+      h2_frame_in (h, f[3], f[4], h2_get32 (&f[5]) & H2_WINDOW_MAX, &f[9],
+		   len);
+    }
+  // After GOAWAY the rest is dropped.
+  return h->goaway ? s : ret;
+}
+
+void
+h2_in (h2_h h, const void *d, size_t s)
+{
+  sendbuf_append (&h->in, d, s);
+  sendbuf_send (h, &h->in, &h2_process);
+}
+
+void
+h2_in_early (h2_h h, const void *d, size_t s)
+{
+  h->early = true;
+  h2_in (h, d, s);
+}
+
+void
+h2_established (h2_h h)
+{
+  size_t i;
+  h->early = false;
+  // Start whatever was held back.
+  i = 0;
+  while (i < h->streams.size)
+    if (!h2_start (h, i))
+      i++;
+}
+
+/* Turns the HTTP/1.1 head into a HEADERS frame once it is complete. */
+static void
+h2_head (h2_stream_h st)
+{
+  const char *b = get_sendbuf_buf (st->head), *end = NULL, *line, *next;
+  size_t s = get_sendbuf_size (st->head), skip = 0;
+  sendbuf_h block = NULL;
+  int status = 0;
+  // The head ends with an empty line, end is where it starts.
+  for (line = memchr (b, '\n', s); NULL != line && NULL == end;
+      line = memchr (line + 1, '\n', b + s - line - 1))
+    {
+      size_t rest = b + s - line - 1;
+      if (1 <= rest && '\n' == line[1])
+	skip = 1;
+      else if (2 <= rest && '\r' == line[1] && '\n' == line[2])
+	skip = 2;
+      else
+	continue;
+      end = line + 1;
+    }
+  if (NULL == end)
+    return;
+  line = memchr (b, ' ', end - b);
+  if (NULL != line)
+    status = atoi (line + 1);
+  if (100 > status || 999 < status)
+    status = 502;
+  hpack_encode_status (&block, status);
+  line = memchr (b, '\n', end - b);
+  for (; NULL != line && line < end; line = next)
+    {
+      const char *colon, *v, *ve;
+      char name[128];
+      size_t nlen, i;
+      line++;
+      next = memchr (line, '\n', end - line);
+      if (NULL == next)
+	next = end;
+      colon = memchr (line, ':', next - line);
+      if (NULL == colon || sizeof(name) <= (nlen = colon - line))
+	continue;
+      for (i = 0; i < nlen; i++)
+	name[i] = tolower ((unsigned char) line[i]);
+      // Connection specific headers are not allowed in HTTP/2.
+      switch (header_lookup (name, nlen))
+	{
+	case HEADER_CONNECTION:
+	case HEADER_KEEP_ALIVE:
+	case HEADER_PROXY_CONNECTION:
+	case HEADER_TRANSFER_ENCODING:
+	case HEADER_UPGRADE:
+	  continue;
+	default:
+	  break;
+	}
+      for (v = colon + 1; v < next && (' ' == *v || '\t' == *v); v++)
+	;
+      for (ve = next; ve > v && isspace ((unsigned char) ve[-1]); ve--)
+	;
+      hpack_encode (&block, name, nlen, v, ve - v);
+    }
+  h2_send_headers (st->h2, st->id, block, false);
+  sendbuf_clear (&block);
+  st->have_head = true;
+  sendbuf_append (&st->data, end + skip, s - (end + skip - b));
+  sendbuf_clear (&st->head);
+}
+
+void
+h2_response (response_h r, const void *d, size_t s)
+{
+  h2_stream_h st = r->stream;
+  h2_h h = st->h2;
+  if (!st->have_head)
+    {
+      sendbuf_append (&st->head, d, s);
+      h2_head (st);
+    }
+  else
+    sendbuf_append (&st->data, d, s);
+  if (r->eof)
+    {
+      if (!st->have_head)
+	{
+	  sendbuf_clear (&st->head);
+	  h2_reply_status (st, 502);
+	}
+      st->end_out = true;
+      st->output = NULL;
+      sendbuf_clear (&r->sendbuf);
+      free (r);
+    }
+  h2_pump (h);
+}
+
+size_t
+h2_pending (struct h2_stream *st)
+{
+  return get_sendbuf_size (st->head) + get_sendbuf_size (st->data);
+}
+
+/* The connection's buffer went out, streams held back for it can go on.  A
+ * drain may end its stream, so the index is checked every time. */
+void
+h2_drain (h2_h h)
+{
+  size_t i;
+  for (i = 0; i < h->streams.size; i++)
+    {
+      h2_stream_h st = VECTOR_GET_AS(h2_stream_h, &h->streams, i);
+      if (NULL != st->output && NULL != st->output->drain)
+	st->output->drain (st->output);
+    }
+}
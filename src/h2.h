@@ -0,0 +1,48 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_H2_H
+#define __TOR2WEB_H2_H
+
+/**
+ * @file h2.h
+ * @brief HTTP/2 server side
+ * @author Mike Mestnik
+ */
+
+typedef struct h2 *h2_h;
+
+#include "gnutls.h"
+
+h2_h
+h2_new (tlssession_h);
+void
+h2_close (h2_h);
+void
+h2_in (h2_h, const void*, size_t);
+void
+h2_in_early (h2_h, const void*, size_t);
+void
+h2_established (h2_h);
+void
+h2_response (response_h, const void*, size_t);
+size_t
+h2_pending (struct h2_stream*);
+void
+h2_drain (h2_h);
+
+#endif
@@ -0,0 +1,83 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file header.c
+ * @brief Index of the fields in an HTTP head
+ * @author Mike Mestnik
+ */
+
+#include "header.h"
+#include "scan.h"
+
+#include <stdio.h>
+
+/* Index the field line [line, end) of the head at b, the line end being eol
+ * bytes.  Returns -1 for a continuation with nothing to continue, 0 for a
+ * line that was skipped and 1 when indexed. */
+int
+header_index (Vector *index, const char *b, size_t line, size_t end,
+	      size_t eol)
+{
+  const char *l = b + line, *p, *e = b + end - eol;
+  header_field_t field;
+  if (' ' == *l || '\t' == *l)
+    {
+      header_field_t *back;
+      // obs-fold, the value now runs to the end of this line.
+      if (vector_is_empty (index))
+	return -1;
+      back = (header_field_t*) vector_back (index);
+      while (e > l && (' ' == e[-1] || '\t' == e[-1]))
+	e--;
+      if (e > l)
+	back->value_len = e - b - back->value;
+      back->end = end;
+      return 1;
+    }
+  p = l + scan.delim (l, e - l);
+  if (p == e || ':' != *p || p == l || UINT16_MAX < p - l)
+    {
+      fprintf (stderr, "Skipping header: %.*s\n", (int) (e - l), l);
+      return 0;
+    }
+  field.name = line;
+  field.name_len = p - l;
+  field.id = header_lookup (l, field.name_len);
+  for (p++; p < e && (' ' == *p || '\t' == *p); p++)
+    ;
+  while (e > p && (' ' == e[-1] || '\t' == e[-1]))
+    e--;
+  field.value = p - b;
+  field.value_len = e - p;
+  field.end = end;
+  vector_push_back (index, &field);
+  return 1;
+}
+
+const header_field_t *
+header_find (Vector *index, header_t id)
+{
+  VECTOR_FOR_EACH(index, i)
+    {
+      const header_field_t *field;
+      field = (const header_field_t*) iterator_get (&i);
+      if (id == field->id)
+	return field;
+    }
+  return NULL;
+}
@@ -0,0 +1,49 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_HEADER_H
+#define __TOR2WEB_HEADER_H
+
+/**
+ * @file header.h
+ * @brief Index of the fields in an HTTP head
+ * @author Mike Mestnik
+ */
+
+#include "headers_hash.h"
+#include "vector.h"
+
+#include <stdint.h>
+
+/* One field of a head.  Offsets are from the start of the head, so the
+ * index holds however the bytes end up buffered. */
+typedef struct
+{
+  uint32_t name;
+  uint32_t value;
+  uint32_t value_len; // Continuation lines included, trailing OWS not.
+  uint32_t end; // Just past the line end.
+  uint16_t name_len;
+  uint8_t id; // header_t
+} header_field_t;
+
+int
+header_index (Vector*, const char*, size_t, size_t, size_t);
+const header_field_t *
+header_find (Vector*, header_t);
+
+#endif
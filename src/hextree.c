@@ -24,7 +24,6 @@
 #include "hextree.h"
 #include "vector.h"
 
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -70,7 +69,6 @@ hexnode_new (unsigned short depth, const unsigned char node[])
   memcpy (&ret->node, node, len);
   if (depthhaspartial (depth))
     ret->node[depthtoindex (depth)] &= 0xF0;
-  fprintf (stderr, "creating   : %p->%d\n", ret, depth);
   return ret;
 }
 
@@ -86,6 +84,25 @@ typedef struct
   unsigned char ctr;
 } iterator_node_t;
 
+/* Number of leading nibbles a and b have in common, at most max. */
+static inline unsigned short
+common_depth (const unsigned char a[], const unsigned char b[],
+	      unsigned short max)
+{
+  unsigned short d;
+  for (d = 0; d < max; d += 2)
+    if (a[d >> 1] != b[d >> 1])
+      return d + ((a[d >> 1] & 0xF0) == (b[d >> 1] & 0xF0));
+  return max;
+}
+
+/* A node at depth d holds the first d nibbles of every key below it and
+ * picks its children by nibble d + 1.  Nodes are only created where keys
+ * diverge, so a child may be many nibbles deeper than its parent.
+ *
+ * Returns 0 when found, 1 when the key is a prefix of an existing node, 2
+ * when the slot was empty and 3 when the key diverges from the node in its
+ * slot.  With create the missing node is made and is the last in ret. */
 static int
 _hexnode_lookup (hexnode_h root, Vector *ret, unsigned short depth,
 		 const unsigned char n[],
@@ -107,80 +124,77 @@ _hexnode_lookup (hexnode_h root, Vector *ret, unsigned short depth,
   memcpy (node, n, depthtolen (depth));
   if (depthhaspartial (depth))
     node[depthtoindex (depth)] &= 0xF0;
-  this.ctr = hextreetoindex (root->depth + 1, node);
-  lastptr = &root->next[this.ctr++];
-  vector_push_back (ret, &this);
-  this = (iterator_node_t
-	)
-	  { .hexnode = *lastptr, .ctr = 0, };
   while (1)
     {
-      if (NULL == this.hexnode)
+      hexnode_h child;
+      unsigned short common;
+      int found;
+      this.ctr = hextreetoindex (this.hexnode->depth + 1, node);
+      lastptr = &this.hexnode->next[this.ctr];
+      child = *lastptr;
+      if (NULL == child)
 	{
+	  found = 2;
 	  if (create)
 	    {
-	      hexnode_h new = hexnode_new (depth, node);
-	      *lastptr = new;
+	      this.ctr++;
+	      vector_push_back (ret, &this);
 	      this = (iterator_node_t
 		    )
-		      { .hexnode = new, .ctr = 0, };
-	      vector_push_back (ret, &this);
+		      { .hexnode = hexnode_new (depth, node), .ctr = 0, };
+	      *lastptr = this.hexnode;
 	    }
+	  vector_push_back (ret, &this);
 	  free (node);
-	  return 2;
+	  return found;
 	}
-      if (depth < this.hexnode->depth)
+      common = common_depth (
+	  node, child->node, depth < child->depth ? depth : child->depth);
+      if (common == child->depth)
 	{
-	  if (create)
+	  this.ctr++;
+	  vector_push_back (ret, &this);
+	  this = (iterator_node_t
+		)
+		  { .hexnode = child, .ctr = 0, };
+	  if (depth == child->depth)
 	    {
-	      hexnode_h new = hexnode_new (depth, node);
-	      new->next[hextreetoindex (this.hexnode->depth, this.hexnode->node)] =
-		  this.hexnode;
-	      *lastptr = new;
-	      this = (iterator_node_t
-		    )
-		      { .hexnode = new, .ctr = 0, };
 	      vector_push_back (ret, &this);
+	      free (node);
+	      return 0;
 	    }
-	  free (node);
-	  return 1;
+	  continue;
 	}
-      if (depth == this.hexnode->depth)
+      found = common == depth ? 1 : 3;
+      if (create)
 	{
-	  unsigned short i;
-	  unsigned short len = depthtolen (depth);
-	  for (i = 0; i < len && node[i] == this.hexnode->node[i]; i++)
-	    ;
-	  if (i != len)
+	  hexnode_h new = hexnode_new (depth, node);
+	  this.ctr++;
+	  vector_push_back (ret, &this);
+	  if (1 == found)
+	    *lastptr = new;
+	  else
 	    {
-	      if (create)
-		{
-		  unsigned short new_depth = (i << 1)
-		      + ((node[i] & 0xF0) == (this.hexnode->node[i] & 0xF0))
-		      - 1;
-		  vector_destroy (ret);
-		  _hexnode_lookup (root, ret, new_depth, node, true);
-		  iterator_node_t *it = (iterator_node_t*) vector_back (ret);
-		  hexnode_h new = hexnode_new (depth, node);
-		  it->ctr = hextreetoindex (new_depth, node);
-		  it->hexnode->next[it->ctr++] = new;
-		  this = (iterator_node_t
-			)
-			  { .hexnode = new, .ctr = 0, };
-		  vector_push_back (ret, &this);
-		}
-	      free (node);
-	      return 3;
+	      hexnode_h split = hexnode_new (common, node);
+	      split->next[hextreetoindex (common + 1, child->node)] = child;
+	      this = (iterator_node_t
+		    )
+		      { .hexnode = split, .ctr = hextreetoindex (common + 1,
+								 node), };
+	      split->next[this.ctr++] = new;
+	      vector_push_back (ret, &this);
+	      *lastptr = split;
+	      child = NULL;
 	    }
-	  this.ctr = 0;
-	  vector_push_back (ret, &this);
-	  free (node);
-	  return 0;
+	  if (NULL != child)
+	    new->next[hextreetoindex (depth + 1, child->node)] = child;
+	  this = (iterator_node_t
+		)
+		  { .hexnode = new, .ctr = 0, };
 	}
-      this.ctr = hextreetoindex (this.hexnode->depth, node);
-      lastptr = &(*lastptr)->next[this.ctr++];
       vector_push_back (ret, &this);
-      this.hexnode = *lastptr;
+      free (node);
+      return found;
     }
 }
 
@@ -200,41 +214,48 @@ bool create)
   return ret;
 }
 
-// TODO: Delete parent as well
+/* Removes a node without data, splicing its only child into its place.
+ * Parents left holding a single child and no data are removed as well. */
 int
 hexnode_delete (hexnode_h root, unsigned short depth,
 		const unsigned char node[])
 {
   int ret = 0;
-  unsigned short i;
-  hexnode_h t, found = NULL;
+  size_t level;
   Vector temp;
-  iterator_node_t a;
   assert(0 != depth);
   if (0 != _hexnode_lookup (root, &temp, depth, node, false))
     {
       ret = 1;
       goto SKIP;
     }
-  t = (VECTOR_BACK_AS(iterator_node_t, &temp)).hexnode;
-  if (NULL != t->data)
-    { // LCOV_EXCL_START
-      ret = -1;
-      goto SKIP;
-    } // LCOV_EXCL_STOP
-  for (i = 0; i < 16; i++)
-    if (NULL != t->next[i])
-      {
-	if (NULL != found)
+  for (level = temp.size - 1; 0 < level; level--)
+    {
+      unsigned short i;
+      hexnode_h t, found = NULL;
+      iterator_node_t a;
+      t = (VECTOR_GET_AS(iterator_node_t, &temp, level)).hexnode;
+      if (NULL != t->data)
+	{
+	  if (level == temp.size - 1)
+	    ret = -1; // LCOV_EXCL_LINE
+	  break;
+	}
+      for (i = 0; i < 16; i++)
+	if (NULL != t->next[i])
 	  {
-	    ret = 2;
-	    goto SKIP;
+	    if (NULL != found)
+	      {
+		if (level == temp.size - 1)
+		  ret = 2;
+		goto SKIP;
+	      }
+	    found = t->next[i];
 	  }
-	found = t->next[i];
-      }
-  a = VECTOR_GET_AS(iterator_node_t, &temp, temp.size - 2);
-  a.hexnode->next[a.ctr - 1] = found;
-  free (t);
+      a = VECTOR_GET_AS(iterator_node_t, &temp, level - 1);
+      a.hexnode->next[a.ctr - 1] = found;
+      free (t);
+    }
   SKIP: vector_destroy (&temp);
   return ret;
 }
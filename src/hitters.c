@@ -0,0 +1,338 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file hitters.c
+ * @brief The onions and URLs that make most of the load
+ * @author Mike Mestnik
+ *
+ * Every request is counted against its onion and its URL with the
+ * space-saving algorithm: HITTERS_SLOTS counters for each of the
+ * CONF.hitters_top shown, and a key that has none takes over the smallest,
+ * with what that one had as its error.  Any key asked for more than a
+ * counter's share of the requests is sure to hold one, whatever the number
+ * of keys, and the memory is fixed at startup.  A response carries a ticket
+ * with the hashes, so the bytes sent and the time it took are added to
+ * whichever counters still hold its keys once it is done.
+ *
+ * Every CONF.stats_interval the biggest are sorted into the table
+ * hitters_top() returns, and written to CONF.hittersfile for operators.
+ * Then all of it is halved, so what counts is the recent load and an onion
+ * that was busy yesterday gives way.
+ */
+
+#include "hitters.h"
+#include "snapshot.h"
+#include "schedule.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Counters kept for each key shown, more make the top more exact.
+#define HITTERS_SLOTS 4
+
+typedef struct
+{
+  uint64_t *hash; // 0 for a counter no key has had yet.
+  hitters_entry_t *entry;
+  size_t slots;
+  hitters_entry_t *top; // Biggest first, as last published.
+  size_t top_len;
+} hitters_counters_t;
+
+/* A counter as it goes in the snapshot. */
+typedef struct
+{
+  uint64_t hash;
+  hitters_entry_t entry;
+} hitters_saved_t;
+
+static const char *const table_names[HITTERS_TABLES] =
+  { "onion", "url", };
+static hitters_counters_t tables[HITTERS_TABLES];
+static int hitters_instanceid;
+
+static uint64_t
+hitters_hash (const char *a, const char *b)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; '\0' != *a; a++)
+    h = (h ^ (unsigned char) *a) * 0x100000001b3ULL;
+  for (; NULL != b && '\0' != *b; b++)
+    h = (h ^ (unsigned char) *b) * 0x100000001b3ULL;
+  // Zero marks a counter no key has had.
+  return h | 1;
+}
+
+static uint64_t
+hitters_now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+hitters_count (hitters_counters_t *t, uint64_t h, const char *a,
+	       const char *b)
+{
+  hitters_entry_t *e;
+  size_t i, min = 0;
+  for (i = 0; i < t->slots; i++)
+    {
+      if (h == t->hash[i])
+	{
+	  t->entry[i].count++;
+	  return;
+	}
+      if (t->entry[i].count < t->entry[min].count)
+	min = i;
+    }
+  t->hash[min] = h;
+  e = &t->entry[min];
+  *e = (hitters_entry_t
+	)
+	  { .count = e->count + 1, .error = e->count, .bytes = 0, .latency = 0,
+	      .done = 0, };
+  snprintf (e->key, sizeof(e->key), "%s%s", a, NULL == b ? "" : b);
+}
+
+static void
+hitters_account (hitters_counters_t *t, uint64_t h, unsigned long long bytes,
+		 uint64_t latency)
+{
+  size_t i;
+  for (i = 0; i < t->slots; i++)
+    if (h == t->hash[i])
+      {
+	t->entry[i].bytes += bytes;
+	t->entry[i].latency += latency;
+	t->entry[i].done++;
+	return;
+      }
+}
+
+/* Counts a request for target on hostname, the ticket goes with its
+ * response. */
+void
+hitters_request (hitters_ticket_t *ticket, const char *hostname,
+		 const char *target)
+{
+  if (0 == tables[HITTERS_ONIONS].slots)
+    return;
+  *ticket = (hitters_ticket_t
+	)
+	  { .onion = hitters_hash (hostname, NULL), .url = hitters_hash (
+	      hostname, target), .start = hitters_now (), .bytes = 0, };
+  hitters_count (&tables[HITTERS_ONIONS], ticket->onion, hostname, NULL);
+  hitters_count (&tables[HITTERS_URLS], ticket->url, hostname, target);
+}
+
+/* The response is complete, only the first call counts. */
+void
+hitters_done (hitters_ticket_t *ticket)
+{
+  uint64_t latency;
+  if (0 == ticket->onion)
+    return;
+  latency = hitters_now () - ticket->start;
+  hitters_account (&tables[HITTERS_ONIONS], ticket->onion, ticket->bytes,
+		   latency);
+  hitters_account (&tables[HITTERS_URLS], ticket->url, ticket->bytes,
+		   latency);
+  ticket->onion = ticket->url = 0;
+}
+
+/* The biggest as of the last CONF.stats_interval, biggest first. */
+size_t
+hitters_top (hitters_table_t table, const hitters_entry_t **top)
+{
+  *top = tables[table].top;
+  return tables[table].top_len;
+}
+
+static int
+hitters_cmp (const void *a, const void *b)
+{
+  unsigned long long x = ((const hitters_entry_t*) a)->count, y =
+      ((const hitters_entry_t*) b)->count;
+  return x > y ? -1 : x < y;
+}
+
+static int
+hitters_saved_cmp (const void *a, const void *b)
+{
+  return hitters_cmp (&((const hitters_saved_t*) a)->entry,
+		      &((const hitters_saved_t*) b)->entry);
+}
+
+static void
+hitters_publish (hitters_counters_t *t)
+{
+  size_t i;
+  t->top_len = 0;
+  for (i = 0; i < t->slots; i++)
+    if (0 != t->entry[i].count)
+      t->top[t->top_len++] = t->entry[i];
+  qsort (t->top, t->top_len, sizeof(hitters_entry_t), &hitters_cmp);
+  if ((size_t) CONF.hitters_top < t->top_len)
+    t->top_len = CONF.hitters_top;
+  for (i = 0; i < t->slots; i++)
+    {
+      t->entry[i].count /= 2;
+      t->entry[i].error /= 2;
+      t->entry[i].bytes /= 2;
+      t->entry[i].latency /= 2;
+      t->entry[i].done /= 2;
+    }
+}
+
+static void
+hitters_dump ()
+{
+  hitters_table_t table;
+  FILE *f;
+  char *tmp = NULL;
+  size_t i;
+  if (NULL == CONF.hittersfile)
+    return;
+  while (NULL == tmp)
+    tmp = malloc (strlen (CONF.hittersfile) + 5);
+  sprintf (tmp, "%s.tmp", CONF.hittersfile);
+  if (NULL == (f = fopen (tmp, "w")))
+    {
+      // LCOV_EXCL_START
+      perror ("hitters_dump: fopen");
+      free (tmp);
+      return;
+      // LCOV_EXCL_STOP
+    }
+  fprintf (f, "# table requests error bytes latency_ms key\n");
+  for (table = HITTERS_ONIONS; table < HITTERS_TABLES; table++)
+    for (i = 0; i < tables[table].top_len; i++)
+      {
+	const hitters_entry_t *e = &tables[table].top[i];
+	fprintf (f, "%s %llu %llu %llu %llu %s\n", table_names[table],
+		 e->count, e->error, e->bytes,
+		 0 == e->done ? 0 : e->latency / e->done, e->key);
+      }
+  fclose (f);
+  // Readers never see a half written file.
+  if (0 != rename (tmp, CONF.hittersfile))
+    perror ("hitters_dump: rename"); // LCOV_EXCL_LINE
+  free (tmp);
+}
+
+static void
+schedule_event (void *c)
+{
+  hitters_table_t table;
+  for (table = HITTERS_ONIONS; table < HITTERS_TABLES; table++)
+    hitters_publish (&tables[table]);
+  hitters_dump ();
+  schedule_timer (&schedule_event, NULL, &hitters_instanceid,
+		  CONF.stats_interval);
+}
+
+/* The counters, biggest first so a smaller table keeps the ones that
+ * matter. */
+void
+hitters_snapshot (sendbuf_h *buf)
+{
+  hitters_table_t table;
+  for (table = HITTERS_ONIONS; table < HITTERS_TABLES; table++)
+    {
+      hitters_counters_t *t = &tables[table];
+      hitters_saved_t *saved = NULL;
+      uint32_t n[2] =
+	{ 0, 0 };
+      size_t i;
+      while (NULL == saved && 0 != t->slots)
+	saved = malloc (t->slots * sizeof(hitters_saved_t));
+      for (i = 0; i < t->slots; i++)
+	if (0 != t->hash[i])
+	  saved[n[0]++] = (hitters_saved_t
+		)
+		  { .hash = t->hash[i], .entry = t->entry[i], };
+      qsort (saved, n[0], sizeof(hitters_saved_t), &hitters_saved_cmp);
+      sendbuf_append (buf, n, sizeof(n));
+      sendbuf_append (buf, saved, n[0] * sizeof(hitters_saved_t));
+      free (saved);
+    }
+}
+
+static void
+hitters_restore ()
+{
+  const char *b, *end;
+  hitters_table_t table;
+  size_t len;
+  if (NULL == (b = snapshot_section (SNAPSHOT_HITTERS, &len)))
+    return;
+  for (end = b + len, table = HITTERS_ONIONS; table < HITTERS_TABLES; table++)
+    {
+      hitters_counters_t *t = &tables[table];
+      const hitters_saved_t *saved;
+      uint32_t n[2];
+      size_t i;
+      if ((size_t) (end - b) < sizeof(n))
+	return;
+      memcpy (n, b, sizeof(n));
+      b += sizeof(n);
+      if ((size_t) (end - b) / sizeof(hitters_saved_t) < n[0])
+	return;
+      saved = (const hitters_saved_t*) b;
+      b += n[0] * sizeof(hitters_saved_t);
+      for (i = 0; i < n[0] && i < t->slots; i++)
+	{
+	  t->hash[i] = saved[i].hash;
+	  t->entry[i] = saved[i].entry;
+	  t->entry[i].key[HITTERS_KEY - 1] = '\0';
+	}
+    }
+}
+
+void
+hitters_init ()
+{
+  hitters_table_t table;
+  size_t slots;
+  if (0 >= CONF.hitters_top)
+    return;
+  slots = (size_t) CONF.hitters_top * HITTERS_SLOTS;
+  for (table = HITTERS_ONIONS; table < HITTERS_TABLES; table++)
+    {
+      hitters_counters_t *t = &tables[table];
+      *t = (hitters_counters_t
+	    )
+	      { .hash = NULL, .entry = NULL, .slots = slots, .top = NULL,
+		  .top_len = 0, };
+      while (NULL == t->hash)
+	t->hash = calloc (slots, sizeof(uint64_t));
+      while (NULL == t->entry)
+	t->entry = calloc (slots, sizeof(hitters_entry_t));
+      while (NULL == t->top)
+	t->top = calloc (slots, sizeof(hitters_entry_t));
+    }
+  hitters_restore ();
+  if (0 < CONF.stats_interval)
+    schedule_timer (&schedule_event, NULL, &hitters_instanceid,
+		    CONF.stats_interval);
+}
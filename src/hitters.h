@@ -0,0 +1,75 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_HITTERS_H
+#define __TOR2WEB_HITTERS_H
+
+/**
+ * @file hitters.h
+ * @brief The onions and URLs that make most of the load
+ * @author Mike Mestnik
+ */
+
+#include "sendbuf.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longer URLs are told apart but only this much of them is shown.
+#define HITTERS_KEY 256
+
+typedef enum
+{
+  HITTERS_ONIONS,
+  HITTERS_URLS,
+  HITTERS_TABLES,
+} hitters_table_t;
+
+typedef struct
+{
+  char key[HITTERS_KEY];
+  unsigned long long count; // Requests, at most error of them not its own.
+  unsigned long long error;
+  unsigned long long bytes; // Sent for the requests that are done.
+  unsigned long long latency; // Milliseconds, summed over those.
+  unsigned long long done;
+} hitters_entry_t;
+
+/* What a response carries to be accounted to its onion and URL once it is
+ * done. */
+typedef struct
+{
+  uint64_t onion; // 0 when there is nothing to account.
+  uint64_t url;
+  uint64_t start; // Milliseconds.
+  unsigned long long bytes;
+} hitters_ticket_t;
+
+#define HITTERS_NONE { .onion = 0, .url = 0, .start = 0, .bytes = 0, }
+
+void
+hitters_init ();
+void
+hitters_request (hitters_ticket_t*, const char*, const char*);
+void
+hitters_done (hitters_ticket_t*);
+size_t
+hitters_top (hitters_table_t, const hitters_entry_t**);
+void
+hitters_snapshot (sendbuf_h*);
+
+#endif
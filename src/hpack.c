@@ -0,0 +1,501 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file hpack.c
+ * @brief HTTP/2 header compression, RFC 7541
+ * @author Mike Mestnik
+ *
+ * The decoder keeps the dynamic table the client builds.  The encoder only
+ * emits literals that are never indexed, so no table is kept for what is
+ * sent and the client's SETTINGS_HEADER_TABLE_SIZE doesn't matter.
+ */
+
+#include "hpack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static const struct
+{
+  const char *n;
+  const char *v;
+} hpack_static[] =
+  {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }, };
+
+static const uint32_t hpack_huffman_codes[256] =
+  { 0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+      0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+      0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+      0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+      0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+      0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+      0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+      0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+      0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+      0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+      0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+      0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+      0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+      0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+      0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+      0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+      0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+      0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+      0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+      0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+      0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+      0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+      0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+      0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+      0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+      0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+      0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+      0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+      0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+      0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+      0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+      0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+      0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+      0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+      0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+      0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+      0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+      0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+      0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+      0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+      0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+      0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+      0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee };
+static const unsigned char hpack_huffman_lens[256] =
+  { 13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+      28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+      6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+      5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+      13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+      7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+      15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+      6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+      20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+      24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+      22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+      21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+      26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+      19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+      20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+      26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26 };
+
+#define HPACK_STATIC (sizeof(hpack_static) / sizeof(hpack_static[0]))
+#define HPACK_EOS 256
+
+/* Decoding tree, a negative child is -(symbol + 1). */
+static short huffman_tree[512][2];
+static short huffman_nodes = 0;
+
+typedef struct
+{
+  char *n;
+  size_t nlen;
+  char *v;
+  size_t vlen;
+} hpack_entry_t;
+
+typedef struct hpack
+{
+  hpack_entry_t *ring; // Newest first, starting at first.
+  size_t slots;
+  size_t first;
+  size_t count;
+  size_t size; // As counted by RFC 7541 4.1.
+  size_t max;
+  size_t limit; // What we told the peer in SETTINGS.
+} hpack_t;
+
+static void
+huffman_add (unsigned sym, uint32_t code, unsigned len)
+{
+  short node = 0;
+  while (len--)
+    {
+      unsigned b = (code >> len) & 1;
+      if (0 == len)
+	huffman_tree[node][b] = -(short) (sym + 1);
+      else
+	{
+	  if (0 == huffman_tree[node][b])
+	    huffman_tree[node][b] = ++huffman_nodes;
+	  node = huffman_tree[node][b];
+	}
+    }
+}
+
+hpack_h
+hpack_new (size_t limit)
+{
+  hpack_h h = NULL;
+  if (0 == huffman_nodes)
+    {
+      unsigned i;
+      for (i = 0; i < 256; i++)
+	huffman_add (i, hpack_huffman_codes[i], hpack_huffman_lens[i]);
+      huffman_add (HPACK_EOS, 0x3fffffff, 30);
+    }
+  while (NULL == h)
+    h = malloc (sizeof(hpack_t));
+  *h = (hpack_t
+	)
+	  { .ring = NULL, .slots = limit / 32 + 1, .first = 0, .count = 0,
+	      .size = 0, .max = limit, .limit = limit, };
+  while (NULL == h->ring)
+    h->ring = calloc (h->slots, sizeof(hpack_entry_t));
+  return h;
+}
+
+static void
+hpack_evict (hpack_h h, size_t need)
+{
+  while (0 < h->count && h->size + need > h->max)
+    {
+      hpack_entry_t *e = &h->ring[(h->first + h->count - 1) % h->slots];
+      h->size -= 32 + e->nlen + e->vlen;
+      free (e->n);
+      free (e->v);
+      h->count--;
+    }
+}
+
+void
+hpack_free (hpack_h h)
+{
+  h->max = 0;
+  hpack_evict (h, 0);
+  free (h->ring);
+  free (h);
+}
+
+/* Takes ownership of n and v. */
+static void
+hpack_insert (hpack_h h, char *n, size_t nlen, char *v, size_t vlen)
+{
+  size_t need = 32 + nlen + vlen;
+  hpack_evict (h, need);
+  if (need > h->max)
+    {
+      free (n);
+      free (v);
+      return;
+    }
+  h->first = (h->first + h->slots - 1) % h->slots;
+  h->ring[h->first] = (hpack_entry_t
+	)
+	  { .n = n, .nlen = nlen, .v = v, .vlen = vlen, };
+  h->count++;
+  h->size += need;
+}
+
+static bool
+hpack_get (hpack_h h, size_t i, const char **n, size_t *nlen, const char **v,
+	   size_t *vlen)
+{
+  hpack_entry_t *e;
+  if (0 == i)
+    return false;
+  if (HPACK_STATIC >= i)
+    {
+      *n = hpack_static[i - 1].n;
+      *nlen = strlen (*n);
+      *v = hpack_static[i - 1].v;
+      *vlen = strlen (*v);
+      return true;
+    }
+  i -= HPACK_STATIC + 1;
+  if (i >= h->count)
+    return false;
+  e = &h->ring[(h->first + i) % h->slots];
+  *n = e->n;
+  *nlen = e->nlen;
+  *v = e->v;
+  *vlen = e->vlen;
+  return true;
+}
+
+static bool
+hpack_int (const unsigned char **p, const unsigned char *end, int prefix,
+	   size_t *out)
+{
+  size_t mask = (1 << prefix) - 1, v, m = 0;
+  if (*p >= end)
+    return false;
+  v = *(*p)++ & mask;
+  if (v < mask)
+    {
+      *out = v;
+      return true;
+    }
+  do
+    {
+      if (*p >= end || 28 < m)
+	return false;
+      v += (size_t) (**p & 0x7f) << m;
+      m += 7;
+    }
+  while (*(*p)++ & 0x80);
+  *out = v;
+  return true;
+}
+
+static bool
+huffman_decode (char *out, size_t *outlen, const unsigned char *in,
+		size_t len)
+{
+  short node = 0;
+  unsigned bits = 0;
+  bool ones = true;
+  size_t i, o = 0;
+  for (i = 0; i < len; i++)
+    {
+      int bit;
+      for (bit = 7; bit >= 0; bit--)
+	{
+	  unsigned b = (in[i] >> bit) & 1;
+	  node = huffman_tree[node][b];
+	  bits++;
+	  ones = ones && b;
+	  if (0 > node)
+	    {
+	      if (HPACK_EOS == -node - 1)
+		return false;
+	      out[o++] = -node - 1;
+	      node = 0;
+	      bits = 0;
+	      ones = true;
+	    }
+	  else if (0 == node)
+	    return false; // LCOV_EXCL_LINE
+	}
+    }
+  *outlen = o;
+  // Padding is the start of EOS and shorter than a byte.
+  return 8 > bits && ones;
+}
+
+static char *
+hpack_string (const unsigned char **p, const unsigned char *end, size_t *len)
+{
+  bool huffman;
+  size_t n;
+  char *s = NULL;
+  if (*p >= end)
+    return NULL;
+  huffman = **p & 0x80;
+  if (!hpack_int (p, end, 7, &n) || n > (size_t) (end - *p))
+    return NULL;
+  // The shortest code is 5 bits.
+  while (NULL == s)
+    s = malloc (huffman ? n * 8 / 5 + 1 : n + 1);
+  if (!huffman)
+    {
+      memcpy (s, *p, n);
+      *len = n;
+    }
+  else if (!huffman_decode (s, len, *p, n))
+    {
+      free (s);
+      return NULL;
+    }
+  s[*len] = 0;
+  *p += n;
+  return s;
+}
+
+bool
+hpack_decode (hpack_h h, const unsigned char *p, size_t s, hpack_field_f f,
+	      void *c)
+{
+  const unsigned char *end = p + s;
+  bool fields = false;
+  while (p < end)
+    {
+      const char *cn, *cv;
+      char *n = NULL, *v = NULL;
+      size_t i, nlen, vlen;
+      bool index = false;
+      if (*p & 0x80)
+	{
+	  if (!hpack_int (&p, end, 7, &i)
+	      || !hpack_get (h, i, &cn, &nlen, &cv, &vlen))
+	    return false;
+	  f (c, cn, nlen, cv, vlen);
+	  fields = true;
+	  continue;
+	}
+      if (0x20 == (*p & 0xe0))
+	{
+	  // Table size updates may only start a block.
+	  if (fields || !hpack_int (&p, end, 5, &i) || i > h->limit)
+	    return false;
+	  h->max = i;
+	  hpack_evict (h, 0);
+	  continue;
+	}
+      if (*p & 0x40)
+	{
+	  index = true;
+	  if (!hpack_int (&p, end, 6, &i))
+	    return false;
+	}
+      else if (!hpack_int (&p, end, 4, &i))
+	return false;
+      if (0 == i)
+	{
+	  if (NULL == (n = hpack_string (&p, end, &nlen)))
+	    return false;
+	}
+      else if (!hpack_get (h, i, &cn, &nlen, &cv, &vlen))
+	return false;
+      else
+	{
+	  while (NULL == n)
+	    n = malloc (nlen + 1);
+	  memcpy (n, cn, nlen + 1);
+	}
+      if (NULL == (v = hpack_string (&p, end, &vlen)))
+	{
+	  free (n);
+	  return false;
+	}
+      f (c, n, nlen, v, vlen);
+      fields = true;
+      if (index)
+	hpack_insert (h, n, nlen, v, vlen);
+      else
+	{
+	  free (n);
+	  free (v);
+	}
+    }
+  return true;
+}
+
+static void
+hpack_put_int (sendbuf_h *out, unsigned char first, int prefix, size_t v)
+{
+  unsigned char b[16];
+  size_t n = 0, mask = (1 << prefix) - 1;
+  if (v < mask)
+    b[n++] = first | v;
+  else
+    {
+      b[n++] = first | mask;
+      for (v -= mask; 128 <= v; v >>= 7)
+	b[n++] = (v & 0x7f) | 0x80;
+      b[n++] = v;
+    }
+  sendbuf_append (out, b, n);
+}
+
+/* A literal that is never indexed, n must already be lower case. */
+void
+hpack_encode (sendbuf_h *out, const char *n, size_t nlen, const char *v,
+	      size_t vlen)
+{
+  hpack_put_int (out, 0x00, 4, 0);
+  hpack_put_int (out, 0x00, 7, nlen);
+  sendbuf_append (out, n, nlen);
+  hpack_put_int (out, 0x00, 7, vlen);
+  sendbuf_append (out, v, vlen);
+}
+
+void
+hpack_encode_status (sendbuf_h *out, int status)
+{
+  char buf[5];
+  size_t i;
+  for (i = 8; i <= 14; i++)
+    if (status == atoi (hpack_static[i - 1].v))
+      {
+	hpack_put_int (out, 0x80, 7, i);
+	return;
+      }
+  snprintf (buf, sizeof(buf), "%03d", status % 1000);
+  hpack_put_int (out, 0x00, 4, 8);
+  hpack_put_int (out, 0x00, 7, 3);
+  sendbuf_append (out, buf, 3);
+}
@@ -0,0 +1,47 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_HPACK_H
+#define __TOR2WEB_HPACK_H
+
+/**
+ * @file hpack.h
+ * @brief HTTP/2 header compression, RFC 7541
+ * @author Mike Mestnik
+ */
+
+#include "sendbuf.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct hpack *hpack_h;
+typedef void
+(*hpack_field_f) (void*, const char*, size_t, const char*, size_t);
+
+hpack_h
+hpack_new (size_t);
+void
+hpack_free (hpack_h);
+bool
+hpack_decode (hpack_h, const unsigned char*, size_t, hpack_field_f, void*);
+void
+hpack_encode (sendbuf_h*, const char*, size_t, const char*, size_t);
+void
+hpack_encode_status (sendbuf_h*, int);
+
+#endif
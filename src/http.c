@@ -22,8 +22,22 @@
  */
 
 #include "http.h"
+#include "scan.h"
+#include "headers_hash.h"
+#include "onion.h"
+#include "header.h"
+#include "rewrite.h"
+#include "codec.h"
+#include "variant.h"
+#include "cache.h"
+#include "stats.h"
+#include "conf.h"
 #include "sockets.h"
 #include "socks.h"
+#include "peer.h"
+#include "hitters.h"
+#include "control.h"
+#include "schedule.h"
 #include "vector.h"
 #include "hextree.h"
 #include "globals.h"
@@ -31,92 +45,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <assert.h>
 #include <errno.h>
 
-static const unsigned char base32_values[128] =
-  { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-      0xff, // 1
-      0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0xff, 0xff, 0xff, 0xff, 0xff,
-      0xff, 0xff, 0xff,
-      0xff, // A
-      0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
-      0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-      0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
-      0xff, // a
-      0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
-      0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-      0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff };
-
-static inline int
-base32_decode (unsigned char *out, unsigned short outlen,
-	       const unsigned char *in, unsigned short inlen)
-{
-
-  long long i, j = 0;
-  unsigned char u;
-  unsigned long long v = 0, vbits = 0;
-
-  for (i = 0; i < inlen; ++i)
-    {
-      if (in[i] & 0x80)
-	return 0; // LCOV_EXCL_LINE
-      u = base32_values[in[i]];
-      if (u > 0x1f)
-	return 0;
-      v |= u << vbits;
-      vbits += 5;
-
-      if (vbits >= 8)
-	{
-	  if (j >= outlen)
-	    return 0; // LCOV_EXCL_LINE
-	  out[j++] = v;
-	  vbits -= 8;
-	  v >>= 8;
-	}
-    }
-  // LCOV_EXCL_START
-  if (vbits)
-    {
-      if (j >= outlen)
-	return 0;
-      out[j++] = v;
-    }
-  return 1;
-  // LCOV_EXCL_STOP
-}
+#define HTTP_MAX_HEAD 65536
+// Seconds between topping up the spares.
+#define HTTP_PREWARM_INTERVAL 5
+// Requests an onion needs in the last CONF.stats_interval to get spares.
+#define HTTP_PREWARM_MIN 2
 
-regex_t regex_onion;
-regex_t regex_domain_av;
 static hexnode_h hexnode;
+// Connected ahead of any request, at most CONF.prewarm_max of them.
+static Vector spares;
+static int prewarm_instanceid;
 
 void
 http_init ()
 {
-  int reti;
-
-  /* Compile regular expressions */
-  reti = regcomp (&regex_onion, "[a-z2-7]{16}\\.onion",
-  REG_EXTENDED | REG_ICASE);
-  if (reti)
-    {
-      fprintf (stderr, "Could not compile onion regex\n");
-      exit (1);
-    }
-  reti = regcomp (&regex_domain_av, "; Domain=[^;\r\n]+",
-  REG_EXTENDED | REG_ICASE);
-  if (reti)
-    {
-      fprintf (stderr, "Could not compile domain_av regex\n");
-      exit (1);
-    }
   hexnode = hexnode_new (0, NULL);
+  while (VECTOR_SUCCESS != vector_setup (&spares, 16, sizeof(http_h)))
+    ;
 }
 
+typedef enum
+{
+  HTTP_PARSE_STATUS,
+  HTTP_PARSE_HEADER,
+  HTTP_PARSE_BODY,
+  HTTP_PARSE_CHUNK_SIZE,
+  HTTP_PARSE_CHUNK_EXT,
+  HTTP_PARSE_CHUNK_DATA,
+  HTTP_PARSE_CHUNK_CRLF,
+  HTTP_PARSE_TRAILER,
+  HTTP_PARSE_ERROR,
+} http_parse_state_t;
+
+/* What the parser hands to http_event(), the data points into the receive
+ * buffer and is only good for the duration of the call. */
+typedef enum
+{
+  HTTP_EVENT_HEAD, // Status line through the empty line, see h->head.
+  HTTP_EVENT_BODY, // Body bytes, with the chunk framing removed.
+  HTTP_EVENT_END,
+} http_event_t;
+
 typedef struct http
 {
   fd_closure_h fd;
@@ -124,17 +98,30 @@ typedef struct http
   sendbuf_h client_sendbuf;
   sendbuf_h out_sendbuf;
   sendbuf_h in_sendbuf;
-  sendbuf_h chunked_sendbuf;
   Vector request_v;
   socksapi_h socksapi;
   bool have_connect;
   bool have_socks_connect;
-  bool have_status_line;
+  http_parse_state_t state;
+  size_t scan;
+  size_t line; // Start of the line being scanned, within the head.
+  size_t status_len;
+  Vector head;
   bool is_html;
-  bool have_eoh;
   size_t body_length;
   bool chunked;
+  bool rewrite; // The body goes through rewrite_body().
+  bool chunked_out; // The length changes, the client gets chunks.
+  rewrite_body_t body;
+  codec_h decoder; // Compressed bodies are rewritten in between.
+  codec_h encoder;
+  codec_type_t coding; // What encoder makes.
+  char *validator; // Keep what encoder makes under this.
+  sendbuf_h capture;
+  cache_h cache; // What the client gets, to answer the next one with.
+  bool discard; // The rest of the body is dropped.
   bool inuse;
+  bool spare; // Opened by prewarm_event(), no request has had it yet.
 } http_t;
 
 static size_t
@@ -196,6 +183,9 @@ void
 http_write (http_h h, const void *b, size_t s)
 {
   http_request_t *p;
+  // The onion couldn't be reached, everything was already answered.
+  if (HTTP_PARSE_ERROR == h->state)
+    return;
   // Just guessing here.
   p = (http_request_t*) vector_back (&h->request_v);
   sendbuf_append (&p->retrybuf, b, s);
@@ -234,372 +224,739 @@ http_write (http_h h, const void *b, size_t s)
 static void
 responce_end (http_h h)
 {
-  h->have_status_line = false;
-  h->have_eoh = false;
   h->body_length = 0;
   h->chunked = false;
-  assert(h->chunked_sendbuf == NULL);
+  h->is_html = false;
+  h->rewrite = false;
+  h->chunked_out = false;
+  h->body = (rewrite_body_t
+	)
+	  { .carry_len = 0, };
+  codec_free (h->decoder);
+  codec_free (h->encoder);
+  h->decoder = h->encoder = NULL;
+  free (h->validator);
+  h->validator = NULL;
+  sendbuf_clear (&h->capture);
+  cache_abort (h->cache);
+  h->cache = NULL;
+  h->coding = CODEC_IDENTITY;
+  h->discard = false;
   if (h->request_v.size)
     {
       http_request_t *request;
       request = (http_request_t*) vector_front (&h->request_v);
       if (NULL != request->hostname)
 	free (request->hostname);
+      free (request->target);
+      cache_leave (request->flight);
       if (NULL != request->retrybuf)
 	free (request->retrybuf);
-      request->output.eof = true;
-      response_send (&request->output, NULL, 0);
+      request->output->eof = true;
+      response_send (request->output, NULL, 0);
       vector_pop_front (&h->request_v);
     }
 }
 
-static size_t
-process_func (void*, const void*, size_t);
-static inline size_t
-process_status_line (http_h h, http_request_t *request, const char **d,
-		     size_t s,
-		     bool *done)
-{
-  size_t ret = 0;
-  bool one_byte;
-  unsigned short len;
-  len = strcspn (*d, "\n");
-  if ('\n' != (*d)[len++])
-    {
-      *done = true;
-      return 0;
-    }
-  h->have_status_line = true;
-  response_send (&request->output, *d, len);
-  ret += len;
-  *d += len;
-  if ((s > ret && (one_byte = ('\n' == (*d)[0])))
-      || (s > ret + 1 && '\r' == (*d)[0] && '\n' == (*d)[1]))
-    {
-      // TODO: No headers.
-      response_send (&request->output, one_byte ? "\n" : "\r\n",
-		     one_byte ? 1 : 2);
-      *d += one_byte ? 1 : 2;
-      ret += one_byte ? 1 : 2;
-      // This automatically means no body, so the response is done.
-      responce_end (h);
-      if (0 < s - ret)
-	{
-	  fprintf (stderr, "Got %zu bytes after status line.\n%s\n", s - ret,
-		   *d);
-	  ret += process_func (h, *d, s - ret);
-	}
-      *done = true;
+/* End a response the upstream cut short, the client only sees the eof. */
+static void
+responce_abort (http_h h)
+{
+  responce_end (h);
+  h->state = HTTP_PARSE_STATUS;
+}
+
+static inline const char *
+skip_ows (const char *p, const char *e)
+{
+  while (p < e && (' ' == *p || '\t' == *p))
+    p++;
+  return p;
+}
+
+static void
+head_flush (void *c, const struct iovec *iov, size_t n)
+{
+  response_sendv (c, iov, n);
+}
+
+/* The part of the head that doesn't depend on how the body is framed. */
+static void
+head_keep (void *c, const struct iovec *iov, size_t n)
+{
+  http_h h = c;
+  http_request_t *request;
+  request = (http_request_t*) vector_front (&h->request_v);
+  if (NULL != h->cache)
+    cache_head (h->cache, iov, n);
+  response_sendv (request->output, iov, n);
+}
+
+/* The body as it goes to the client. */
+static void
+body_send (http_h h, const struct iovec *iov, size_t n)
+{
+  http_request_t *request;
+  struct iovec v[REWRITE_IOV + 2];
+  char size[20];
+  size_t i, len = 0;
+  request = (http_request_t*) vector_front (&h->request_v);
+  if (NULL != h->cache && !cache_body (h->cache, iov, n))
+    h->cache = NULL;
+  if (!h->chunked_out)
+    {
+      response_sendv (request->output, iov, n);
+      return;
     }
-  return ret;
+  for (i = 0; i < n; i++)
+    {
+      len += iov[i].iov_len;
+      v[i + 1] = iov[i];
+    }
+  v[0] = (struct iovec
+	)
+	  { .iov_base = size, .iov_len = snprintf (size, sizeof(size),
+						   "%zx\r\n", len), };
+  v[n + 1] = (struct iovec
+	)
+	  { .iov_base = "\r\n", .iov_len = 2, };
+  response_sendv (request->output, v, n + 2);
 }
 
-static inline void
-clip_domain_from_cookie (response_h output, const char *hstart, size_t hlen)
+static void
+body_broken (http_h h)
 {
-  int reti;
-  regmatch_t regmatch;
-  reti = regexec (&regex_domain_av, hstart, 1, &regmatch, 0);
-  if (!reti)
+  http_request_t *request;
+  request = (http_request_t*) vector_front (&h->request_v);
+  fprintf (stderr, "Dropping the rest of a body on fd %d\n", h->fd->fd);
+  h->discard = true;
+  cache_abort (h->cache);
+  h->cache = NULL;
+  // An unterminated body has to be ended by closing.
+  if (NULL == request->output->stream && NULL != request->output->tls)
+    gnutls_close_on_fin (request->output->tls);
+}
+
+static void
+encoder_out (void *c, const void *b, size_t s)
+{
+  http_h h = c;
+  if (NULL != h->validator)
     {
-      if (hlen > regmatch.rm_so)
+      // Too big to be worth keeping.
+      if ((size_t) CONF.compress_cache_size / 4
+	  < get_sendbuf_size (h->capture) + s)
 	{
-	  response_send (output, hstart, regmatch.rm_so);
-	  // Should be a \n at least.
-	  assert(hlen > regmatch.rm_eo);
-	  response_send (output, hstart + regmatch.rm_eo,
-			 hlen - regmatch.rm_eo);
+	  free (h->validator);
+	  h->validator = NULL;
+	  sendbuf_clear (&h->capture);
 	}
       else
 	{
-	  // The regex is incorrect if we somehow get here.
-	  fprintf ( stderr, "%s %zu, at %d.  In: <<EOR\n%s\nEOR",
-		   "Regex domain_av start past end of header", hlen,
-		   regmatch.rm_so, hstart);
-	  response_send (output, hstart, hlen);
+	  sendbuf_reserve (&h->capture, s);
+	  sendbuf_append (&h->capture, b, s);
 	}
     }
-  else if (reti != REG_NOMATCH)
-    {
-      char msgbuf[100];
-      regerror (reti, &regex_onion, msgbuf, sizeof(msgbuf));
-      fprintf (stderr, "Regex domain_av request line match failed: %s\n",
-	       msgbuf);
-      response_send (output, hstart, hlen);
-    }
-  else
-    // This is normal, the server didn't send domain-av.
-    response_send (output, hstart, hlen);
+  body_send (h, &(struct iovec
+	)
+	  { .iov_base = (void*) b, .iov_len = s, },
+	     1);
 }
 
-static inline void
-process_one_header (http_h h, http_request_t *request, const char *hstart,
-		    size_t hlen)
+static void
+body_flush (void *c, const struct iovec *iov, size_t n)
 {
-  size_t klen;
-  klen = strcspn (hstart, ": \t\n");
-  if (':' == hstart[klen])
+  http_h h = c;
+  size_t i;
+  if (NULL == h->encoder)
     {
-      switch (klen)
-	{
-	case 17:
-	  if (0 == strncasecmp (hstart, "Transfer-Encoding", 17)
-	      && 1 /* TODO: ": chunked" */)
-	    {
-	      h->chunked = true;
-	      // gnutls_send (request->tls, hstart, hlen);
-	    }
-	  else
-	    response_send (&request->output, hstart, hlen);
-	  break;
-	case 10:
-	  if (0 == strncasecmp (hstart, "Set-Cookie", 10))
-	    {
-	      clip_domain_from_cookie (&request->output, hstart, hlen);
-	    }
-	  else
-	    response_send (&request->output, hstart, hlen);
-	  break;
-	case 14:
-	  if (0 == strncasecmp (hstart, "ConTent-Length", 14))
-	    {
-	      size_t len = 0;
-	      if (1 == sscanf (&hstart[15], "%zu", &len))
-		h->body_length = len;
-	    }
-	  response_send (&request->output, hstart, hlen);
-	  break;
-	case 12:
-	  if (0 == strncasecmp (hstart, "Content-Type", 12))
-	    {
-	      const char *p = &hstart[13];
-	      while (*p == ' ' || *p == '\t')
-		p++;
-	      if (0 != strncasecmp (p, "text/html", 9))
-		goto NOT_HTML;
-	      p += 9;
-	      while (*p == ' ' || *p == '\t' || *p == '\n')
-		p++;
-	      h->is_html = p[-1] == '\n';
-	    }
-	  NOT_HTML: response_send (&request->output, hstart, hlen);
-	  break;
-	default:
-	  response_send (&request->output, hstart, hlen);
-	}
+      body_send (h, iov, n);
+      return;
     }
-  else
-    fprintf (stderr, "Skipping header: %s\n", hstart);
+  for (i = 0; i < n && !h->discard; i++)
+    if (!codec_write (h->encoder, iov[i].iov_base, iov[i].iov_len,
+		      &encoder_out, h))
+      body_broken (h);
+}
+
+static void
+decoder_out (void *c, const void *b, size_t s)
+{
+  http_h h = c;
+  rewrite_t rw =
+    { .flush = &body_flush, .closure = h, .n = 0, };
+  rewrite_body (&rw, &h->body, b, s);
+}
+
+static bool
+field_has (const char *p, const char *e, const char *token)
+{
+  size_t len = strlen (token);
+  for (; (size_t) (e - p) >= len; p++)
+    if (0 == strncasecmp (p, token, len))
+      return true;
+  return false;
+}
+
+/* Whether the Transfer-Encoding value [p, e) ends in chunked, the only coding
+ * that frames a body.  Any other is left to the Content-Length. */
+static bool
+te_chunked (const char *p, const char *e)
+{
+  while (e > p && (' ' == e[-1] || '\t' == e[-1]))
+    e--;
+  if (e - p < 7 || 0 != strncasecmp (e - 7, "chunked", 7))
+    return false;
+  for (e -= 7; e > p && (' ' == e[-1] || '\t' == e[-1]); e--)
+    ;
+  return e == p || ',' == e[-1];
+}
+
+/* A response to HEAD, a 204 or a 304 ends with its head, whatever its fields
+ * say the body would be. */
+static bool
+has_body (const http_request_t *request, const char *d, size_t status_len)
+{
+  const char *r = get_sendbuf_buf (request->retrybuf);
+  if (NULL != r && get_sendbuf_size (request->retrybuf) >= 5
+      && 0 == memcmp (r, "HEAD ", 5))
+    return false;
+  return 12 > status_len
+      || (0 != memcmp (d + 9, "204", 3) && 0 != memcmp (d + 9, "304", 3));
 }
 
-static inline size_t
-process_one_chunk (http_h h, http_request_t *request, const char **d, size_t s)
+/* The whole head is in hand, so every field is rewritten in one pass and
+ * what goes out is slices of d around the changes.  When the body will be
+ * rewritten or compressed its length changes, and a chunked one has none
+ * yet, so the client gets it chunked as it comes or, for HTTP/1.0, until
+ * the connection closes.  A body compressed before
+ * goes out from the variant store with its length. */
+static void
+process_head (http_h h, http_request_t *request, const char *d, size_t s)
 {
-  size_t clen = 0;
-  unsigned short pos = 0;
-  bool l = true;
-  while (l)
+  response_h output = request->output;
+  codec_type_t coding = CODEC_IDENTITY;
+  const header_field_t *validator = NULL;
+  bool compressible = false, storable = true, reframe;
+  bool body = has_body (request, d, h->status_len);
+  variant_h variant = NULL;
+  char buf[64];
+  rewrite_t rw =
+    { .flush = &head_keep, .closure = h, .n = 0, };
+  // An onion that is failing gets its last good answer sent for it, what it
+  // sent instead goes nowhere.
+  if (12 <= h->status_len && '5' == d[9]
+      && cache_serve_stale (output, request->hostname, request->target,
+			    get_sendbuf_buf (request->retrybuf),
+			    get_sendbuf_size (request->retrybuf)))
+    request->output = output = response_detached ();
+  VECTOR_FOR_EACH(&h->head, i)
     {
-      if (s < pos)
-	return 0;
-      switch ((*d)[pos++])
+      const header_field_t *field;
+      const char *p, *e;
+      field = (const header_field_t*) iterator_get (&i);
+      p = d + field->value;
+      e = p + field->value_len;
+      switch (field->id)
 	{
-	case 0:
-	  // This can happen if we try to read past end of string.
-	  fprintf ( stderr, "%s ('\\0', %zu); \\\n\t\tpos = %d;\n",
-		   "ERROR: http: process_chunked_body", s, pos);
-	  break;
-	case '\r':
-	case '\n':
-	  l = false;
-	  break;
-	case '0':
-	  clen = clen << 4;
+	case HEADER_TRANSFER_ENCODING:
+	  h->chunked = te_chunked (p, e);
 	  break;
-	case '1':
-	  clen = (clen << 4) + 1;
+	case HEADER_CONTENT_LENGTH:
+	  {
+	    size_t len = 0;
+	    while (p < e && '0' <= *p && '9' >= *p)
+	      len = len * 10 + (*p++ - '0');
+	    h->body_length = len;
+	  }
 	  break;
-	case '2':
-	  clen = (clen << 4) + 2;
-	  break;
-	case '3':
-	  clen = (clen << 4) + 3;
-	  break;
-	case '4':
-	  clen = (clen << 4) + 4;
-	  break;
-	case '5':
-	  clen = (clen << 4) + 5;
+	case HEADER_CONTENT_TYPE:
+	  compressible = codec_compressible (p, e - p);
+	  if (e - p >= 9 && 0 == strncasecmp (p, "text/html", 9))
+	    {
+	      p = skip_ows (p + 9, e);
+	      h->is_html = p == e || ';' == *p;
+	    }
 	  break;
-	case '6':
-	  clen = (clen << 4) + 6;
+	case HEADER_CONTENT_ENCODING:
+	  coding = codec_lookup (p, e - p);
 	  break;
-	case '7':
-	  clen = (clen << 4) + 7;
+	case HEADER_ETAG:
+	  validator = field;
 	  break;
-	case '8':
-	  clen = (clen << 4) + 8;
+	case HEADER_LAST_MODIFIED:
+	  if (NULL == validator)
+	    validator = field;
 	  break;
-	case '9':
-	  clen = (clen << 4) + 9;
+	case HEADER_SET_COOKIE:
+	  storable = false;
 	  break;
-	case 'a':
-	case 'A':
-	  clen = (clen << 4) + 0xa;
+	case HEADER_CACHE_CONTROL:
+	  if (field_has (p, e, "no-store") || field_has (p, e, "private"))
+	    storable = false;
 	  break;
-	case 'b':
-	case 'B':
-	  clen = (clen << 4) + 0xb;
+	default:
 	  break;
-	case 'c':
-	case 'C':
-	  clen = (clen << 4) + 0xc;
+	}
+    }
+  if (!body)
+    {
+      h->chunked = false;
+      h->body_length = 0;
+    }
+  h->rewrite = body && h->is_html && CODEC_UNKNOWN != coding
+      && rewrite_enabled ();
+  // It goes back out in the coding it came in.
+  if (h->rewrite && CODEC_IDENTITY != coding)
+    {
+      h->decoder = codec_new (coding, false);
+      h->encoder = codec_new (h->coding = coding, true);
+      h->rewrite = NULL != h->decoder && NULL != h->encoder;
+    }
+  // What the onion sent plain is compressed for the client.
+  else if (body && CODEC_IDENTITY == coding && compressible
+      && 12 <= h->status_len
+      && 0 == memcmp (d + 9, "200", 3)
+      && (h->chunked || CODEC_MIN_LENGTH <= h->body_length)
+      && CODEC_IDENTITY != (h->coding = codec_choose (request->accept_encoding)))
+    {
+      stats_inc (STATS_COMPRESSED);
+      if (storable && NULL != validator && NULL != request->target)
+	{
+	  size_t len = validator->value_len + 1;
+	  while (NULL == h->validator)
+	    h->validator = malloc (len + 1);
+	  // An ETag and a date can't be mistaken for each other.
+	  h->validator[0] = HEADER_ETAG == validator->id ? 'E' : 'L';
+	  memcpy (h->validator + 1, d + validator->value, len - 1);
+	  h->validator[len] = 0;
+	  variant = variant_find (request->hostname, request->target, h->coding,
+				  h->validator);
+	}
+      if (NULL != variant)
+	{
+	  stats_inc (STATS_COMPRESS_VARIANT_HITS);
+	  free (h->validator);
+	  h->validator = NULL;
+	}
+      else if (NULL == (h->encoder = codec_new (h->coding, true)))
+	h->coding = CODEC_IDENTITY;
+    }
+  else
+    h->coding = coding;
+  reframe = h->rewrite || (NULL != h->encoder && NULL == h->decoder)
+      || (h->chunked && NULL == variant);
+  // HTTP/2 frames the body itself.
+  h->chunked_out = reframe && NULL == output->stream
+      && request->http_subversion;
+  h->cache = cache_begin (request->flight, request->hostname,
+			  request->target, get_sendbuf_buf (request->retrybuf),
+			  get_sendbuf_size (request->retrybuf), d,
+			  h->status_len, &h->head);
+  rewrite_emit (&rw, d, h->status_len);
+  VECTOR_FOR_EACH(&h->head, i)
+    {
+      const header_field_t *field;
+      field = (const header_field_t*) iterator_get (&i);
+      switch (field->id)
+	{
+	case HEADER_TRANSFER_ENCODING:
+	case HEADER_CONTENT_LENGTH:
+	case HEADER_CONNECTION:
+	case HEADER_KEEP_ALIVE:
+	case HEADER_AGE:
+	  continue;
+	default:
 	  break;
-	case 'd':
-	case 'D':
-	  clen = (clen << 4) + 0xd;
+	}
+      rewrite_response_field (&rw, d, field);
+    }
+  if (CODEC_IDENTITY == coding && CODEC_IDENTITY != h->coding)
+    {
+      rewrite_emit (&rw, "Content-Encoding: ", 18);
+      rewrite_emit (&rw, codec_name (h->coding), strlen (codec_name (h->coding)));
+      rewrite_emit (&rw, "\r\nVary: Accept-Encoding\r\n", 25);
+    }
+  // The rest is framing and age, which a cache hit makes up fresh.
+  rewrite_flush (&rw);
+  rw.flush = &head_flush;
+  rw.closure = output;
+  VECTOR_FOR_EACH(&h->head, i)
+    {
+      const header_field_t *field;
+      field = (const header_field_t*) iterator_get (&i);
+      switch (field->id)
+	{
+	case HEADER_CONTENT_LENGTH:
+	  if (reframe || NULL != variant)
+	    continue;
 	  break;
-	case 'e':
-	case 'E':
-	  clen = (clen << 4) + 0xe;
+	case HEADER_CONNECTION:
+	case HEADER_KEEP_ALIVE:
+	  if (reframe && !h->chunked_out && NULL == output->stream)
+	    continue;
 	  break;
-	case 'f':
-	case 'F':
-	  clen = (clen << 4) + 0xf;
+	case HEADER_AGE:
 	  break;
 	default:
-	  fprintf (stderr, "Skipping unknown char 0x%x\n", (*d)[pos - 1]);
+	  continue;
 	}
+      rewrite_response_field (&rw, d, field);
     }
-  // TODO: Don't assume two byte line ends.
-  if (s < pos + 1 + clen + 2)
-    return 0;
-  // TODO: Don't assume two byte line ends.
-  *d += pos + 1;
-  if (0 == clen) // Last chunk.
-    {
-      // TODO: Make this a function.
-      char buf[100];
-      size_t slen;
-      // TODO: Process headers.
-      *d += 2;
-      slen = get_sendbuf_size (h->chunked_sendbuf);
-      response_send (
-	  &request->output, buf,
-	  snprintf (buf, sizeof(buf), "Content-Length: %zu\r\n\r\n", slen));
-      response_send (&request->output, get_sendbuf_buf (h->chunked_sendbuf),
-		     slen);
-      sendbuf_clear (&h->chunked_sendbuf);
-      responce_end (h);
-      return pos + 1 + 2;
+  if (NULL != variant)
+    rewrite_emit (
+	&rw, buf,
+	snprintf (buf, sizeof(buf), "Content-Length: %zu\r\n",
+		  get_variant_size (variant)));
+  else if (h->chunked_out)
+    rewrite_emit (&rw, "Transfer-Encoding: chunked\r\n", 28);
+  else if (reframe && NULL == output->stream)
+    {
+      rewrite_emit (&rw, "Connection: close\r\n", 19);
+      if (NULL != output->tls)
+	gnutls_close_on_fin (output->tls);
+    }
+  rewrite_emit (&rw, d + h->line, s - h->line);
+  rewrite_flush (&rw);
+  if (NULL != variant)
+    {
+      body_send (h, &(struct iovec
+		)
+		  { .iov_base = (void*) get_variant_buf (variant), .iov_len =
+		      get_variant_size (variant), },
+		 1);
+      h->discard = true;
     }
-  // TODO: Don't assume two byte line ends.
-  sendbuf_append (&h->chunked_sendbuf, *d, clen);
-  *d += clen + 2;
-  return pos + 1 + clen + 2;
 }
 
-static size_t
-process_func (void *c, const void *v, size_t s)
+/* Flush the codecs and the rewriter, and keep what was compressed. */
+static void
+body_end (http_h h, http_request_t *request)
+{
+  rewrite_t rw =
+    { .flush = &body_flush, .closure = h, .n = 0, };
+  if (NULL != h->decoder && !codec_flush (h->decoder, true, NULL, h))
+    body_broken (h);
+  if (h->rewrite && !h->discard)
+    rewrite_body_end (&rw, &h->body);
+  if (NULL != h->encoder && !h->discard
+      && !codec_flush (h->encoder, true, &encoder_out, h))
+    body_broken (h);
+  if (h->discard)
+    return;
+  if (h->chunked_out)
+    response_send (request->output, "0\r\n\r\n", 5);
+  if (NULL != h->validator)
+    {
+      sendbuf_trim (&h->capture);
+      variant_store (request->hostname, request->target, h->coding,
+		     h->validator, &h->capture);
+    }
+}
+
+static void
+http_event (http_h h, http_event_t event, const char *d, size_t s)
 {
-  http_h h = c;
-  const char *d = v, *hstart;
-  size_t ret = 0;
-  size_t hlen = 0;
-  bool done = false;
-  if (vector_is_empty (&h->request_v))
-    return (0);
   http_request_t *request;
   request = (http_request_t*) vector_front (&h->request_v);
-  if (!h->have_status_line)
-    ret += process_status_line (h, request, &d, s, &done);
-  if (done)
-    return ret;
-  hstart = d;
-  while (!h->have_eoh)
-    {
-      bool one_byte;
-      size_t len;
-      len = strcspn (d, "\n");
-      // Need to be able to read first byte on next line.
-      if ('\n' != d[len++] || s <= ret + len)
-	return ret;
-      hlen += len;
-      if (' ' != d[len] && '\t' != d[len])
+  switch (event)
+    {
+    case HTTP_EVENT_HEAD:
+      process_head (h, request, d, s);
+      break;
+    case HTTP_EVENT_BODY:
+      if (h->discard)
+	break;
+      if (NULL != h->decoder)
 	{
-	  process_one_header (h, request, hstart, hlen);
-	  ret += hlen;
-	  hstart += hlen;
-	  hlen = 0;
+	  if (!codec_write (h->decoder, d, s, &decoder_out, h))
+	    body_broken (h);
 	}
-      d += len;
-      one_byte = false;
-      if ((s > ret && (one_byte = ('\n' == d[0])))
-	  || (s > ret + 1 && '\r' == d[0] && '\n' == d[1]))
+      else if (h->rewrite)
+	decoder_out (h, d, s);
+      else if (NULL != h->encoder)
 	{
-	  // TODO: This is the last header.
-	  h->have_eoh = true;
-	  // Except for the content length added after un-chunking.
-	  if (!h->chunked)
-	    response_send (&request->output, one_byte ? "\n" : "\r\n",
-			   one_byte ? 1 : 2);
-	  d += one_byte ? 1 : 2;
-	  ret += one_byte ? 1 : 2;
+	  if (!codec_write (h->encoder, d, s, &encoder_out, h))
+	    body_broken (h);
 	}
+      else
+	body_send (h, &(struct iovec
+		  )
+		    { .iov_base = (void*) d, .iov_len = s, },
+		   1);
+      break;
+    case HTTP_EVENT_END:
+      body_end (h, request);
+      if (NULL != h->cache)
+	cache_end (h->cache);
+      h->cache = NULL;
+      responce_end (h);
+      break;
     }
+}
 
-  if (!h->have_eoh)
-    return ret;
-
-  if (h->chunked)
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+/* Length of the line end at nl, for a line that starts at l. */
+#define EOL_LEN(l, nl) ((nl) > (l) && '\r' == (nl)[-1] ? 2 : 1)
+/* Resumable response parser, called with everything not yet consumed.
+ * h->scan remembers how far past ret an incomplete line was already searched,
+ * so no byte is looked at twice.  The head is held unconsumed until its empty
+ * line, h->head indexes it and that index is relative to the head's start.
+ * Each iteration advances one state, pipelined responses are just more
+ * iterations. */
+static size_t
+process_func (void *c, const void *v, size_t s)
+{
+  http_h h = c;
+  const char *d = v, *b, *nl, *why;
+  size_t ret = 0, len;
+  uint64_t x;
+  if (HTTP_PARSE_ERROR == h->state)
+    return s;
+  while (ret < s && !vector_is_empty (&h->request_v))
     {
-      while (s > ret && !done)
+      b = d + ret;
+      switch (h->state)
 	{
-	  size_t len;
-	  ret += len = process_one_chunk (h, request, &d, s - ret);
-	  done = 0 == len;
+	case HTTP_PARSE_STATUS:
+	  nl = b + h->scan + scan.eol (b + h->scan, s - ret - h->scan);
+	  if (d + s == nl)
+	    goto head_more;
+	  h->status_len = h->line = h->scan = nl + 1 - b;
+	  h->state = HTTP_PARSE_HEADER;
+	  break;
+	case HTTP_PARSE_HEADER:
+	  if (h->scan == h->line)
+	    {
+	      // The read may end right after the last line.
+	      if (ret + h->line == s)
+		goto more;
+	      len = 0;
+	      if ('\n' == b[h->line])
+		len = 1;
+	      else if ('\r' == b[h->line])
+		{
+		  if (ret + h->line + 1 == s)
+		    goto more;
+		  if ('\n' == b[h->line + 1])
+		    len = 2;
+		}
+	      // An interim answer, the final one follows for the same request.
+	      if (len && 12 <= h->status_len && '1' == b[9])
+		{
+		  ret += h->line + len;
+		  h->scan = h->line = 0;
+		  vector_clear (&h->head);
+		  h->state = HTTP_PARSE_STATUS;
+		  break;
+		}
+	      if (len)
+		{
+		  http_event (h, HTTP_EVENT_HEAD, b, h->line + len);
+		  ret += h->line + len;
+		  h->scan = h->line = 0;
+		  vector_clear (&h->head);
+		  if (h->chunked)
+		    {
+		      h->body_length = 0;
+		      h->state = HTTP_PARSE_CHUNK_SIZE;
+		    }
+		  else if (0 == h->body_length)
+		    {
+		      http_event (h, HTTP_EVENT_END, NULL, 0);
+		      h->state = HTTP_PARSE_STATUS;
+		    }
+		  else
+		    h->state = HTTP_PARSE_BODY;
+		  break;
+		}
+	    }
+	  nl = b + h->scan + scan.eol (b + h->scan, s - ret - h->scan);
+	  if (d + s == nl)
+	    goto head_more;
+	  len = nl + 1 - b;
+	  if (0 > header_index (&h->head, b, h->line, len,
+				EOL_LEN(b + h->line, nl)))
+	    fprintf (stderr, "Skipping continuation: %.*s\n",
+		     (int) (nl - b - h->line), b + h->line);
+	  h->line = h->scan = len;
+	  break;
+	case HTTP_PARSE_BODY:
+	  len = MIN(s - ret, h->body_length);
+	  http_event (h, HTTP_EVENT_BODY, b, len);
+	  ret += len;
+	  h->body_length -= len;
+	  if (0 == h->body_length)
+	    {
+	      http_event (h, HTTP_EVENT_END, NULL, 0);
+	      h->state = HTTP_PARSE_STATUS;
+	    }
+	  break;
+	case HTTP_PARSE_CHUNK_SIZE:
+	  if (0 < (len = scan.hex (b, s - ret, &x)))
+	    {
+	      if ((uint64_t) h->body_length > (uint64_t) SIZE_MAX >> 4 * len
+		  || x > SIZE_MAX)
+		{
+		  why = "Chunk size overflow";
+		  goto error;
+		}
+	      h->body_length = h->body_length << 4 * len | x;
+	      ret += len;
+	      break;
+	    }
+	  ret++;
+	  if (';' == *b)
+	    h->state = HTTP_PARSE_CHUNK_EXT;
+	  else if ('\n' == *b)
+	    h->state =
+		h->body_length ? HTTP_PARSE_CHUNK_DATA : HTTP_PARSE_TRAILER;
+	  else if ('\r' != *b && ' ' != *b && '\t' != *b)
+	    fprintf (stderr, "Skipping unknown char 0x%x\n", *b);
+	  break;
+	case HTTP_PARSE_CHUNK_EXT:
+	  // Chunk extensions are ignored.
+	  nl = b + scan.eol (b, s - ret);
+	  if (d + s == nl)
+	    {
+	      ret = s;
+	      goto more;
+	    }
+	  ret = nl + 1 - d;
+	  h->state = h->body_length ? HTTP_PARSE_CHUNK_DATA : HTTP_PARSE_TRAILER;
+	  break;
+	case HTTP_PARSE_CHUNK_DATA:
+	  len = MIN(s - ret, h->body_length);
+	  http_event (h, HTTP_EVENT_BODY, b, len);
+	  ret += len;
+	  h->body_length -= len;
+	  if (0 == h->body_length)
+	    h->state = HTTP_PARSE_CHUNK_CRLF;
+	  break;
+	case HTTP_PARSE_CHUNK_CRLF:
+	  nl = b + scan.eol (b, s - ret);
+	  if (d + s == nl)
+	    {
+	      ret = s;
+	      goto more;
+	    }
+	  ret = nl + 1 - d;
+	  h->state = HTTP_PARSE_CHUNK_SIZE;
+	  break;
+	case HTTP_PARSE_TRAILER:
+	  // Trailers are read past and dropped.  The client's body is framed
+	  // anew and a cache hit has none, so nothing would carry them.
+	  if (0 == h->scan)
+	    {
+	      len = 0;
+	      if ('\n' == *b)
+		len = 1;
+	      else if ('\r' == *b)
+		{
+		  if (ret + 1 == s)
+		    goto more;
+		  if ('\n' == b[1])
+		    len = 2;
+		}
+	      if (len)
+		{
+		  ret += len;
+		  http_event (h, HTTP_EVENT_END, NULL, 0);
+		  h->state = HTTP_PARSE_STATUS;
+		  break;
+		}
+	    }
+	  nl = b + h->scan + scan.eol (b + h->scan, s - ret - h->scan);
+	  if (d + s == nl)
+	    {
+	      h->scan = s - ret;
+	      goto more;
+	    }
+	  ret = nl + 1 - d;
+	  h->scan = 0;
+	  break;
+	case HTTP_PARSE_ERROR:
+	  ret = s; // LCOV_EXCL_LINE
+	  break; // LCOV_EXCL_LINE
 	}
-      return ret;
     }
+  more: return ret;
+  head_more: h->scan = s - ret;
+  if (HTTP_MAX_HEAD >= h->scan)
+    return ret;
+  why = "Response head too large";
+  error: fprintf (stderr, "%s on fd %d\n", why, h->fd->fd);
+  while (!vector_is_empty (&h->request_v))
+    responce_abort (h);
+  // Swallow the rest of the connection, it can't be framed anymore.
+  h->state = HTTP_PARSE_ERROR;
+  h->scan = h->line = 0;
+  vector_clear (&h->head);
+  return s;
+}
 
-  if (0 == h->body_length)
-    {
-      responce_end (h);
-    }
-  else if (s < ret + h->body_length)
+/* Parse straight out of the caller's buffer, only what can't be consumed yet
+ * is copied to in_sendbuf. */
+static void
+process_in (http_h h, const char *b, size_t s)
+{
+  size_t ret;
+  if (NULL != h->in_sendbuf)
     {
-      size_t len = s - ret;
-      ret += len;
-      assert(s == ret);
-      response_send (&request->output, d, len);
-      h->body_length -= len;
+      sendbuf_append (&h->in_sendbuf, b, s);
+      sendbuf_send (h, &h->in_sendbuf, &process_func);
+      return;
     }
-  else
+  ret = process_func (h, b, s);
+  sendbuf_append (&h->in_sendbuf, b + ret, s - ret);
+}
+
+/* Whatever came in goes out once the socket is drained, Tor is slow enough
+ * already.  Not after every read, each flush ends a compressed block. */
+static void
+process_flush (http_h h)
+{
+  if (NULL != h->encoder && !h->discard
+      && !codec_flush (h->encoder, false, &encoder_out, h))
+    body_broken (h);
+}
+
+/* The onion can't be reached through Tor.  What was asked of it is answered
+ * from a stale copy where the cache still has one, the rest get a 502, and h
+ * takes no more requests. */
+static void
+upstream_failed (http_h h)
+{
+  sockets_close (h->fd);
+  while (!vector_is_empty (&h->request_v))
     {
-      response_send (&request->output, d, h->body_length);
-      ret += h->body_length;
-      d += h->body_length;
+      http_request_t *request;
+      request = (http_request_t*) vector_front (&h->request_v);
+      if (cache_serve_stale (request->output, request->hostname,
+			     request->target,
+			     get_sendbuf_buf (request->retrybuf),
+			     get_sendbuf_size (request->retrybuf)))
+	request->output = response_detached ();
+      else
+	response_send (request->output,
+		       "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n",
+		       47);
       responce_end (h);
-      // Loop to next response.
-      if (0 < s - ret)
-	ret += process_func (h, d, s - ret);
     }
-  return ret;
+  h->state = HTTP_PARSE_ERROR;
+  sendbuf_clear (&h->client_sendbuf);
+  sendbuf_clear (&h->out_sendbuf);
 }
 
 static void
 send_begin_socks (http_h h)
 {
-  char hostname[] = "oooooooooooooooo.onion";
-  fprintf (stderr, "fullname: \"%s\"\n", h->hostname);
-  for (int i = 0; i < 16; i++)
-    hostname[i] = h->hostname[i];
   h->have_connect = true;
   int i = begin_socks4_relay (h->socksapi, "", "", &(struct sockaddr_in
 	)
 	  { .sin_addr =
 	    { .s_addr = 0 } },
-			      hostname, 80);
+			      h->hostname, 80);
   switch (i)
     {
     case 0:
@@ -611,7 +968,7 @@ send_begin_socks (http_h h)
       break;
     case -1:
       fprintf (stderr, "Begin_socks failure on fd %d\n", h->fd->fd);
-      sockets_close (h->fd);
+      upstream_failed (h);
       break;
     case 16:
       break;
@@ -650,7 +1007,8 @@ http_can (fd_closure_h c, bool write)
 	      ret = recv (h->fd->fd, buf, size, 0);
 	      if (0 == ret)
 		{
-		  sockets_close (h->fd);
+		  free (buf);
+		  upstream_failed (h);
 		  return;
 		}
 	      else if (-1 == ret)
@@ -665,8 +1023,8 @@ http_can (fd_closure_h c, bool write)
 		  else if (ECONNRESET == errno)
 		    {
 		      free (buf);
-		      sockets_close (h->fd);
 		      perror ("*socks_in() failed to recv()");
+		      upstream_failed (h);
 		      // reinit (h);
 		      return;
 		    }
@@ -699,7 +1057,7 @@ http_can (fd_closure_h c, bool write)
 	      break;
 	    case -1:
 	      fprintf (stderr, "Socks failure on fd %d\n", h->fd->fd);
-	      sockets_close (h->fd);
+	      upstream_failed (h);
 	      break;
 	    case 16:
 	      break;
@@ -718,17 +1076,27 @@ http_can (fd_closure_h c, bool write)
 		{
 		  if (EAGAIN == errno)
 		    {
-		      sendbuf_send (h, &h->in_sendbuf, &process_func);
+		      process_flush (h);
 		      return;
 		    }
-		  else
-		    // TODO: Handle errors
-		    perror ("client_in() failed to recv()");
+		  // TODO: Handle errors
+		  perror ("client_in() failed to recv()");
+		  break;
 		}
-	      sendbuf_append (&h->in_sendbuf, buf, ret);
+	      if (0 < ret)
+		process_in (h, buf, ret);
 	    }
 	  while (0 != ret);
-	  sendbuf_send (h, &h->in_sendbuf, &process_func);
+	  // Nothing waits on a spare, prewarm_event() decides if it's missed.
+	  if (h->spare)
+	    {
+	      sockets_close (h->fd);
+	      h->state = HTTP_PARSE_ERROR;
+	      return;
+	    }
+	  // Whatever was already sent of a response can't be taken back.
+	  if (HTTP_PARSE_STATUS != h->state)
+	    responce_abort (h);
 	  sockets_close (h->fd);
 	  reinit (h);
 	  VECTOR_FOR_EACH(&h->request_v, i)
@@ -757,18 +1125,11 @@ http_can (fd_closure_h c, bool write)
 		{
 		  send_begin_socks (h);
 		}
-	      else if (ECONNREFUSED == optval)
-		{
-		  sockets_close (h->fd);
-		  // reinit (h);
-		  fprintf (stderr, "*Connect to socks failed: %s\n",
-			   strerror (optval));
-		}
 	      else
 		{
-		  // TODO: Close socket and retry.
 		  fprintf (stderr, "Connect to socks failed: %s\n",
 			   strerror (optval));
+		  upstream_failed (h);
 		}
 	    }
 	  else
@@ -784,6 +1145,10 @@ reinit (http_h h)
 {
   h->have_connect = false;
   h->have_socks_connect = false;
+  h->state = HTTP_PARSE_STATUS;
+  h->scan = h->line = 0;
+  vector_clear (&h->head);
+  sendbuf_clear (&h->in_sendbuf);
   if (NULL != h->socksapi)
     free (h->socksapi);
   h->socksapi = new_socksapi ();
@@ -798,24 +1163,22 @@ reinit (http_h h)
   h->fd->closure = h;
 }
 
-#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
-http_h
-http_new (http_request_t request, const void *b, size_t s)
+/* The upstream connections to hostname's service, NULL for a name that
+ * isn't an onion. */
+static Vector *
+http_services (const char *hostname)
 {
   Vector **services_h_h;
-  unsigned char out[10];
-  http_h h = NULL;
-  request.retrybuf = NULL;
-  if (!base32_decode (out, 10, (const unsigned char*) request.hostname, 16))
-    {
-      fprintf (stderr, "Couldn't parse hostname\n");
-      services_h_h = (Vector **) &hexnode_lookup (
-	  hexnode, strnlen (request.hostname, 9) + 1,
-	  (const unsigned char*) request.hostname,
-	  true)->data;
-    }
-  else
-    services_h_h = (Vector **) &hexnode_lookup (hexnode, 10, out, true)->data;
+  unsigned char key[ONION_KEY_MAX];
+  size_t key_len, len = strlen (hostname);
+  if (sizeof(".onion") > len
+      || 0 != strcmp (hostname + len - sizeof(".onion") + 1, ".onion"))
+    return NULL;
+  key_len = onion_key (hostname, len - sizeof(".onion") + 1, key);
+  if (0 == key_len)
+    return NULL;
+  services_h_h = (Vector **) &hexnode_lookup (hexnode, key_len, key,
+					      true)->data;
   if ( NULL == *services_h_h)
     {
       while ( NULL == *services_h_h)
@@ -824,41 +1187,204 @@ http_new (http_request_t request, const void *b, size_t s)
 	    )VECTOR_INITIALIZER;
       vector_setup (*services_h_h, 3, sizeof(http_h));
     }
-  VECTOR_FOR_EACH(*services_h_h, i)
+  return *services_h_h;
+}
+
+/* A new connection to hostname through Tor, request is the first thing
+ * asked of it or NULL for a spare. */
+static http_h
+http_open (const char *hostname, Vector *services, http_request_t *request)
+{
+  http_h h = NULL;
+  while (NULL == h)
+    h = malloc (sizeof(http_t));
+  *h = (http_t
+	)
+	  { .hostname = NULL, .client_sendbuf = NULL, .out_sendbuf =
+	  NULL, .in_sendbuf = NULL, .socksapi =
+	  NULL, .inuse = NULL != request, .spare = NULL == request, .is_html =
+	  false, };
+  while (NULL == h->hostname)
+    h->hostname = strdup (hostname);
+  while (VECTOR_SUCCESS
+      != vector_setup (&h->request_v, 5, sizeof(http_request_t)))
+    ;
+  while (VECTOR_SUCCESS
+      != vector_setup (&h->head, 16, sizeof(header_field_t)))
+    ;
+  responce_end (h);
+  // Before reinit(), a SOCKS failure there answers it.
+  if (NULL != request)
+    vector_push_back (&h->request_v, request);
+  reinit (h);
+  vector_push_back (services, &h);
+  return h;
+}
+
+/* Only for a spare that failed or was closed, nothing refers to it. */
+static void
+http_free (http_h h)
+{
+  Vector *services = http_services (h->hostname);
+  size_t i;
+  for (i = 0; i < services->size; i++)
+    if (h == *(http_h*) vector_get (services, i))
+      {
+	vector_erase (services, i);
+	break;
+      }
+  sendbuf_clear (&h->client_sendbuf);
+  sendbuf_clear (&h->out_sendbuf);
+  sendbuf_clear (&h->in_sendbuf);
+  free_socksapi (h->socksapi);
+  vector_destroy (&h->request_v);
+  vector_destroy (&h->head);
+  free ((char*) h->hostname);
+  free (h);
+}
+
+static void
+spare_forget (http_h h)
+{
+  size_t i;
+  for (i = 0; i < spares.size; i++)
+    if (h == *(http_h*) vector_get (&spares, i))
+      {
+	vector_erase (&spares, i);
+	break;
+      }
+  h->spare = false;
+}
+
+/* Keeps CONF.prewarm idle connections that are already through Tor, so
+ * already paid for the descriptor and the rendezvous, to each of the
+ * busiest onions.  hitters_top() ranks them, and only as many as
+ * CONF.prewarm_max covers are kept warm, those whose descriptor
+ * control_state() says Tor has first.  Spares that failed are dropped,
+ * connected ones to onions that cooled off are shut down and dropped the
+ * next time round. */
+static void
+prewarm_event (void *c)
+{
+  const hitters_entry_t *top;
+  size_t n, hot, i;
+  int pass;
+  n = hitters_top (HITTERS_ONIONS, &top);
+  for (hot = 0;
+      hot < n
+	  && hot
+	      < (size_t) (CONF.prewarm_max + CONF.prewarm - 1) / CONF.prewarm
+	  && HTTP_PREWARM_MIN <= top[hot].count; hot++)
+    ;
+  for (i = spares.size; i-- > 0;)
+    {
+      http_h h = *(http_h*) vector_get (&spares, i);
+      size_t j;
+      if (HTTP_PARSE_ERROR == h->state)
+	{
+	  vector_erase (&spares, i);
+	  http_free (h);
+	  continue;
+	}
+      if (!h->have_socks_connect)
+	continue;
+      for (j = 0; j < hot; j++)
+	if (0 == strcmp (h->hostname, top[j].key))
+	  break;
+      // Closed from http_can(), the fd is in this round's select() already.
+      if (hot == j)
+	shutdown (h->fd->fd, SHUT_RDWR);
+    }
+  // Onions whose descriptor Tor has go first, ones whose failed wait.
+  for (pass = 0; pass < 2; pass++)
+    for (i = 0; i < hot && spares.size < (size_t) CONF.prewarm_max; i++)
+      {
+	control_state_t state = control_state (top[i].key);
+	Vector *services;
+	int idle = 0;
+	if (CONTROL_FAILED == state || (0 == pass) != (CONTROL_WARM == state))
+	  continue;
+	if (NULL == (services = http_services (top[i].key)))
+	  continue;
+	VECTOR_FOR_EACH(services, k)
+	  {
+	    http_h try;
+	    try = ITERATOR_GET_AS(http_h, &k);
+	    if (!try->inuse && HTTP_PARSE_ERROR != try->state
+		&& vector_is_empty (&try->request_v))
+	      idle++;
+	  }
+	for (;
+	    idle < CONF.prewarm && spares.size < (size_t) CONF.prewarm_max;
+	    idle++)
+	  {
+	    http_h h = http_open (top[i].key, services, NULL);
+	    vector_push_back (&spares, &h);
+	    stats_inc (STATS_PREWARM_OPENED);
+	  }
+      }
+  schedule_timer (&prewarm_event, NULL, &prewarm_instanceid,
+		  HTTP_PREWARM_INTERVAL);
+}
+
+void
+http_prewarm_init ()
+{
+  // The ranking comes from hitters, it has to be on.
+  if (0 >= CONF.prewarm || 0 >= CONF.prewarm_max || 0 >= CONF.hitters_top
+      || 0 >= CONF.stats_interval)
+    return;
+  schedule_timer (&prewarm_event, NULL, &prewarm_instanceid,
+		  HTTP_PREWARM_INTERVAL);
+}
+
+http_h
+http_new (http_request_t request, const void *b, size_t s)
+{
+  Vector *services;
+  http_h h = NULL;
+  request.retrybuf = NULL;
+  // The gateway that owns the key may have it, that is cheaper than Tor.
+  if (peer_ask (&request, b, s))
+    return NULL;
+  // Whatever a fetch on its way brings back is this one's answer too.
+  if (cache_join (&request, b, s))
+    return NULL;
+  // Callers only pass names onion_find() took, "<label>.onion".
+  services = http_services (request.hostname);
+  assert(NULL != services);
+  VECTOR_FOR_EACH(services, i)
     {
       http_h try;
       try = ITERATOR_GET_AS(http_h, &i);
-      if (!try->inuse && 1000000 >= try->body_length
+      if (!try->inuse && HTTP_PARSE_ERROR != try->state
+	  && 1000000 >= try->body_length
 	  && 7 >= try->request_v.size)
 	{
-	  h = try;
-	  break;
+	  if (NULL == h)
+	    h = try;
+	  // An idle one that is through Tor already beats queueing.
+	  if (try->have_socks_connect && vector_is_empty (&try->request_v))
+	    {
+	      h = try;
+	      break;
+	    }
 	}
     }
   if (NULL != h)
     {
+      if (h->spare)
+	{
+	  spare_forget (h);
+	  stats_inc (STATS_PREWARM_USED);
+	}
       vector_push_back (&h->request_v, &request);
       h->inuse = true;
       http_write (h, b, s);
       return h;
     }
-  while (NULL == h)
-    h = malloc (sizeof(http_t));
-  *h = (http_t
-	)
-	  { .hostname = NULL, .client_sendbuf = NULL, .out_sendbuf =
-	  NULL, .in_sendbuf = NULL, .chunked_sendbuf = NULL, .socksapi =
-	  NULL, .inuse = true, .is_html = false, };
-  while (NULL == h->hostname)
-    h->hostname = strndup (request.hostname, 22);
-  while (VECTOR_SUCCESS
-      != vector_setup (&h->request_v, 5, sizeof(http_request_t)))
-    ;
-  responce_end (h);
-  vector_push_back (&h->request_v, &request);
-  reinit (h);
+  h = http_open (request.hostname, services, &request);
   http_write (h, b, s);
-  vector_push_back (*services_h_h, &h);
   return h;
 }
 
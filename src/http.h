@@ -26,20 +26,24 @@
 
 #include "gnutls.h"
 
-#include <regex.h>
-
 typedef struct
 {
   long int handle; // Some of this is not known, use this handle.
-  response_t output;
+  response_h output;
   bool http_subversion;
   char *hostname;
+  char *target; // As sent upstream, for keying what comes back.
+  unsigned accept_encoding; // 1 << codec_type_t the client takes.
+  struct flight *flight; // The fetch others wait on, if this one leads it.
+  bool alone; // Never waits on another fetch.
+  bool peered; // The peer that owns its key was asked, or there is none.
   sendbuf_h retrybuf;
 } http_request_t;
 
-extern regex_t regex_onion;
 void
 http_init ();
+void
+http_prewarm_init ();
 
 typedef struct http *http_h;
 http_h
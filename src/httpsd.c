@@ -23,11 +23,31 @@
 
 #include "httpsd.h"
 #include "http.h"
+#include "scan.h"
+#include "header.h"
+#include "rewrite.h"
+#include "codec.h"
+#include "cache.h"
+#include "hitters.h"
+#include "onion.h"
+#include "vector.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
+// Largest request line plus headers, anything bigger gets a 431.
+#define HTTPSD_MAX_HEAD 65536
+
+typedef enum
+{
+  HTTPSD_PARSE_REQUEST_LINE,
+  HTTPSD_PARSE_HEADER,
+  HTTPSD_PARSE_BODY,
+  HTTPSD_PARSE_ERROR,
+} httpsd_parse_state_t;
+
 typedef struct httpsd
 {
   struct sockaddr_storage addr;
@@ -36,53 +56,52 @@ typedef struct httpsd
   sendbuf_h sendbuf;
   sendbuf_h lover;
   http_h http;
-  bool have_request_line;
-  bool have_eoh;
-  size_t body_length;
+  httpsd_parse_state_t state;
+  size_t scan; // Head bytes already searched for a line end.
+  size_t line; // Start of the line being parsed.
   struct
   {
-    unsigned short begin;
-    unsigned short end;
-  }*request_line_clip;
+    uint32_t method_len;
+    uint32_t target;
+    uint32_t target_len;
+    uint32_t version;
+    uint32_t end;
+  } request_line;
+  Vector headers;
+  size_t body_length;
   bool http_close;
+  bool early;
   tlssession_h tls;
 } httpsd_t;
 
-static void
-write_http (httpsd_h h, const void *b, size_t s)
-{
-  if (NULL == h->http)
-    {
-      sendbuf_append (&h->sendbuf, b, s);
-    }
-  else
-    {
-      http_write (h->http, b, s);
-    }
-}
-
 static void
 new_request (httpsd_h h)
 {
   if (h->http_close)
     gnutls_close_on_fin (h->tls);
-  h->body_length = 0;
-  h->have_request_line = false;
   if (NULL != h->http)
     {
-      http_detach (h->http, h->have_eoh, h->body_length);
+      http_detach (h->http, HTTPSD_PARSE_REQUEST_LINE != h->state
+		       && HTTPSD_PARSE_HEADER != h->state,
+		   h->body_length);
       h->http = NULL;
     }
-  if (NULL != h->request_line_clip)
-    {
-      free (h->request_line_clip);
-      h->request_line_clip = NULL;
-    }
-  h->have_eoh = false;
+  h->body_length = 0;
+  h->state = HTTPSD_PARSE_REQUEST_LINE;
+  h->scan = 0;
+  h->line = 0;
+  vector_clear (&h->headers);
+  // A refused request's body was collected here.
+  sendbuf_clear (&h->sendbuf);
   // Try and make sure we don't get the same one twice.
   h->http_request.handle = random () ^ random () ^ random ();
   h->http_request.http_subversion = true;
   h->http_request.hostname = NULL;
+  h->http_request.target = NULL;
+  h->http_request.accept_encoding = 0;
+  h->http_request.flight = NULL;
+  h->http_request.alone = false;
+  h->http_request.peered = false;
 }
 
 httpsd_h
@@ -95,8 +114,11 @@ httpsd_new (tlssession_h tls, struct sockaddr *addr, socklen_t alen)
   *h = (httpsd_t
 	)
 	  { .alen = alen, .tls = tls, .sendbuf = NULL, .lover =
-	  NULL, .http = NULL, .request_line_clip = NULL, .tls = tls,
-	      .http_close = false, };
+	  NULL, .http = NULL, .headers = VECTOR_INITIALIZER, .tls = tls,
+	      .http_close = false, .early = false, };
+  while (VECTOR_SUCCESS
+      != vector_setup (&h->headers, 16, sizeof(header_field_t)))
+    ;
   new_request (h);
   return h;
 }
@@ -107,254 +129,280 @@ httpsd_close (httpsd_h h)
   new_request (h);
   if (NULL != h->lover)
     free (h->lover);
+  vector_destroy (&h->headers);
   free (h);
 }
 
-static size_t
-process_func (void*, const void*, size_t);
-static inline size_t
-process_request_line (httpsd_h h, const char *d[], size_t s,
-bool *done)
+static response_h
+new_output (httpsd_h h)
+{
+  response_h output = NULL;
+  while (NULL == output)
+    output = malloc (sizeof(response_t));
+  *output = (response_t
+	)
+	  { .next = NULL, .tls = h->tls, .eof = false, .sendbuf = NULL,
+	      .stream = NULL, .drain = NULL, .closure = NULL, .hits =
+		  HITTERS_NONE, };
+  response_attach (output);
+  return output;
+}
+
+static void
+send_status (response_h output, const char *status)
 {
-  size_t ret = 0;
-  unsigned short len;
-  len = strcspn (*d, "\n");
-  if ('\n' == (*d)[len++])
+  char buf[100];
+  response_send (
+      output, buf,
+      snprintf (buf, sizeof(buf),
+		"HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n", status));
+  output->eof = true;
+  response_send (output, NULL, 0);
+}
+
+/* Nothing after a malformed head can be framed, answer and hang up. */
+static void
+reject (httpsd_h h, const char *status)
+{
+  fprintf (stderr, "Rejecting request: %s\n", status);
+  send_status (new_output (h), status);
+  h->http_close = true;
+  new_request (h);
+  h->state = HTTPSD_PARSE_ERROR;
+}
+
+/* Split the request line at b, len excludes the line end.  Returns false to
+ * hold the request back until the handshake is done. */
+static bool
+process_request_line (httpsd_h h, const char *b, size_t len)
+{
+  const char *sp, *e = b + len;
+  sp = memchr (b, ' ', len);
+  if (NULL == sp || sp == b)
+    {
+      reject (h, "400 Bad Request");
+      return true;
+    }
+  h->request_line.method_len = sp - b;
+  // Early data can be replayed, anything else waits for the handshake.
+  if (h->early
+      && !(3 == h->request_line.method_len && 0 == strncmp (b, "GET", 3))
+      && !(4 == h->request_line.method_len && 0 == strncmp (b, "HEAD", 4)))
+    return false;
+  h->request_line.target = sp + 1 - b;
+  sp = memchr (sp + 1, ' ', e - sp - 1);
+  if (NULL == sp || e - sp - 1 != 8 || 0 != strncmp (sp + 1, "HTTP/1.", 7))
+    {
+      reject (h, "400 Bad Request");
+      return true;
+    }
+  h->request_line.target_len = sp - b - h->request_line.target;
+  h->request_line.version = sp + 1 - b;
+  if ('0' == sp[8])
+    h->http_request.http_subversion = false;
+  h->state = HTTPSD_PARSE_HEADER;
+  return true;
+}
+
+static void
+head_flush (void *c, const struct iovec *iov, size_t n)
+{
+  sendbuf_appendv (c, iov, n);
+}
+
+/* The head [b, b + len) is complete, forward it with the rewrites. */
+static void
+process_head (httpsd_h h, const char *b, size_t len)
+{
+  const header_field_t *header;
+  response_h output;
+  size_t v = h->request_line.version;
+  rewrite_t rw =
+    { .flush = &head_flush, .closure = &h->sendbuf, .n = 0, };
+  // The onion always sees HTTP/1.1.
+  if (h->http_request.http_subversion)
+    rewrite_emit (&rw, b, h->request_line.end);
+  else
+    {
+      rewrite_emit (&rw, b, v + 7);
+      rewrite_emit (&rw, "1", 1);
+      rewrite_emit (&rw, b + v + 8, h->request_line.end - v - 8);
+    }
+  header = header_find (&h->headers, HEADER_CONTENT_LENGTH);
+  if (NULL != header)
     {
-      bool one_byte;
-      h->have_request_line = true;
-      if ((one_byte = '0' == (*d)[len - 3]) || '0' == (*d)[len - 2])
-	h->http_request.http_subversion = false;
-      switch (((NULL != h->request_line_clip) << 2)
-	  | (!h->http_request.http_subversion << 1) | !one_byte)
+      const char *p = b + header->value, *e = p + header->value_len;
+      for (; p < e && '0' <= *p && '9' >= *p; p++)
+	h->body_length = h->body_length * 10 + (*p - '0');
+    }
+  VECTOR_FOR_EACH(&h->headers, i)
+    {
+      header = (const header_field_t*) iterator_get (&i);
+      if (HEADER_HOST == header->id && NULL == h->http_request.hostname)
 	{
-	case 0:
-	case 1:
-	  write_http (h, *d, len);
-	  break;
-	case 1 << 2:
-	case 1 << 2 | 1:
-	  write_http (h, *d, h->request_line_clip->begin);
-	  write_http (h, *d + h->request_line_clip->end,
-		      len - h->request_line_clip->end);
-	  free (h->request_line_clip);
-	  h->request_line_clip = NULL;
-	  break;
-	case 1 << 1:
-	  write_http (h, *d, len - 3);
-	  write_http (h, "1\r\n", 3);
-	  break;
-	case 1 << 1 | 1:
-	  write_http (h, *d, len - 2);
-	  write_http (h, "1\n", 2);
-	  break;
-	case 1 << 2 | 1 << 1:
-	  write_http (h, *d, h->request_line_clip->begin);
-	  write_http (h, *d + h->request_line_clip->end,
-		      len - h->request_line_clip->end - 3);
-	  free (h->request_line_clip);
-	  h->request_line_clip = NULL;
-	  write_http (h, "1\r\n", 3);
-	  break;
-	case 1 << 2 | 1 << 1 | 1:
-	  write_http (h, *d, h->request_line_clip->begin);
-	  write_http (h, *d + h->request_line_clip->end,
-		      len - h->request_line_clip->end - 2);
-	  free (h->request_line_clip);
-	  h->request_line_clip = NULL;
-	  write_http (h, "1\n", 2);
-	  break;
-	default:
-	  // LCOV_EXCL_START
-	  fprintf (stderr, "Invalid switch\n");
-	  write_http (h, *d, len);
-	  // LCOV_EXCL_STOP
+	  onion_t onion;
+	  if (onion_find (b + header->value, header->value_len, &onion))
+	    {
+	      h->http_request.hostname = onion_hostname (b + header->value,
+							 &onion);
+	      rewrite_emit (&rw, "Host: ", 6);
+	      rewrite_emit (&rw, h->http_request.hostname,
+			    onion.len + sizeof(".onion") - 1);
+	      rewrite_emit (&rw, "\r\n", 2);
+	      continue;
+	    }
+	  fprintf (stderr, "No onion in host: \"%.*s\"\n",
+		   (int) header->value_len, b + header->value);
 	}
-      ret += len;
-      *d += len;
-      one_byte = false;
-      if (!((s > ret && (one_byte = ('\n' == (*d)[0])))
-	  || (s > ret + 1 && '\r' == (*d)[0] && '\n' == (*d)[1])))
-	return ret;
-      // TODO: No headers.
-      write_http (h, one_byte ? "\n" : "\r\n", one_byte ? 1 : 2);
-      *d += one_byte ? 1 : 2;
-      ret += one_byte ? 1 : 2;
-      // This automatically means no body, so the request is done.
-      h->have_eoh = true;
-      new_request (h);
-      // Loop to next request.
-      if (0 < s - ret)
+      rewrite_request_field (&rw, b, header);
+    }
+  // The empty line.
+  rewrite_emit (&rw, b + h->line, len - h->line);
+  rewrite_flush (&rw);
+  output = new_output (h);
+  h->http_request.output = output;
+  if (NULL != h->http_request.hostname)
+    {
+      header = header_find (&h->headers, HEADER_ACCEPT_ENCODING);
+      if (NULL != header)
+	h->http_request.accept_encoding = codec_accept (b + header->value,
+							header->value_len);
+      while (NULL == h->http_request.target)
+	h->http_request.target = strndup (b + h->request_line.target,
+					  h->request_line.target_len);
+      hitters_request (&output->hits, h->http_request.hostname,
+		       h->http_request.target);
+      if (cache_serve (output, h->http_request.hostname,
+		       h->http_request.target, get_sendbuf_buf (h->sendbuf),
+		       get_sendbuf_size (h->sendbuf)))
 	{
-	  fprintf (stderr, "Got %zu bytes after request line.\n%s\n", s - ret,
-		   *d);
-	  ret += process_func (h, *d, s - ret);
+	  free (h->http_request.hostname);
+	  free (h->http_request.target);
 	}
+      else
+	h->http = http_new (h->http_request, get_sendbuf_buf (h->sendbuf),
+			    get_sendbuf_size (h->sendbuf));
     }
-  *done = true;
-  return ret;
+  else
+    send_status (output, "400 Bad Request");
+  sendbuf_clear (&h->sendbuf);
+  h->state = HTTPSD_PARSE_BODY;
+  if (0 == h->body_length)
+    new_request (h);
 }
 
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+/* Resumable request parser, called with everything not yet consumed.  A
+ * request's head is only consumed once complete, h->scan remembers how much
+ * of it was already searched and the header index points into it.  Bodies
+ * pass straight through and any number of pipelined requests are handled in
+ * one call. */
 static size_t
 process_func (void *c, const void *v, size_t s)
 {
   httpsd_h h = c;
-  const char *d = v, *hstart;
-  unsigned short hlen = 0;
-  size_t ret = 0;
-  bool done = false;
-  if (!h->have_request_line)
-    ret += process_request_line (h, &d, s, &done);
-  if (done)
-    return ret;
-  hstart = d;
-  while (!h->have_eoh)
+  const char *d = v, *b, *nl;
+  size_t ret = 0, len, eol;
+  while (ret < s)
     {
-      bool one_byte;
-      unsigned short len;
-      len = strcspn (d, "\n");
-      // Need to be able to read first byte on next line.
-      if ('\n' != d[len++] || s <= ret + len)
-	return ret;
-      hlen += len;
-      if (' ' != d[len] && '\t' != d[len])
+      b = d + ret;
+      switch (h->state)
 	{
-	  unsigned short klen;
-	  klen = strcspn (hstart, ": \t\n");
-	  if (':' == hstart[klen])
-	    {
-	      if (4 == klen && NULL == h->http
-		  && 0 == strncasecmp (hstart, "Host", 4))
-		{
-		  int reti;
-		  regmatch_t regmatch;
-		  const char *dstart = hstart + 5;
-		  reti = regexec (&regex_onion, dstart, 1, &regmatch, 0);
-		  if (!reti)
-		    {
-		      if (hlen - 5 > regmatch.rm_so)
-			{
-			  bool one_byte;
-			  write_http (h, hstart, 5 + regmatch.rm_eo);
-			  one_byte = '\r' == hstart[hlen - 2];
-			  write_http (h, !one_byte ? "\n" : "\r\n",
-				      !one_byte ? 1 : 2);
-			  if (NULL != h->http_request.hostname)
-			    {
-			      free (h->http_request.hostname);
-			      h->http_request.hostname = NULL;
-			    }
-			  fprintf (
-			      stderr,
-			      "rm_so: %d \"%.*s\"\n",
-			      strspn (
-				  dstart + regmatch.rm_so,
-				  "qwertyuiopasdfghjklzxcvbnmQWERTYUIOPASDFGHJKLZXCVBNM1234567890._-"),
-			      strspn (
-				  dstart + regmatch.rm_so,
-				  "qwertyuiopasdfghjklzxcvbnmQWERTYUIOPASDFGHJKLZXCVBNM1234567890._-")
-				  + 2,
-			      dstart + regmatch.rm_so);
-			  while (NULL == h->http_request.hostname)
-			    h->http_request.hostname =
-				strndup (
-				    dstart + regmatch.rm_so,
-				    strspn (
-					dstart + regmatch.rm_so,
-					"qwertyuiopasdfghjklzxcvbnmQWERTYUIOPASDFGHJKLZXCVBNM1234567890._-"));
-			}
-		    }
-		  else if (reti != REG_NOMATCH)
-		    {
-		      char msgbuf[100];
-		      // LCOV_EXCL_START
-		      regerror (reti, &regex_onion, msgbuf, sizeof(msgbuf));
-		      fprintf (stderr, "Regex onion header match failed: %s\n",
-			       msgbuf);
-		      write_http (h, hstart, hlen);
-		      // LCOV_EXCL_STOP
-
-		    }
-		  else
-		    {
-		      fprintf (stderr,
-			       "Regex onion header no match: \"%.*s\"\n",
-			       hlen - 5, hstart + 5);
-		      write_http (h, hstart, hlen);
-		    }
-		}
-	      else if (14 == klen
-		  && 0 == strncasecmp (hstart, "ConTent-Length", 14))
-		{
-		  size_t len = 0;
-		  if (1 == sscanf (&hstart[15], "%zu", &len))
-		    h->body_length = len;
-		  write_http (h, hstart, hlen);
-		}
-	      else
-		{
-		  write_http (h, hstart, hlen);
-		}
-	    }
-	  else
-	    fprintf (stderr, "Skipping response header: %s\n", hstart);
-	  ret += hlen;
-	  hstart += hlen;
-	  hlen = 0;
+	case HTTPSD_PARSE_BODY:
+	  len = MIN(s - ret, h->body_length);
+	  // Without an onion, as with a 400, the body is dropped.
+	  if (NULL != h->http)
+	    http_write (h->http, b, len);
+	  ret += len;
+	  h->body_length -= len;
+	  if (0 == h->body_length)
+	    new_request (h);
+	  continue;
+	case HTTPSD_PARSE_ERROR:
+	  return s;
+	default:
+	  break;
 	}
-      d += len;
-      one_byte = false;
-      if ((s > ret && (one_byte = ('\n' == d[0])))
-	  || (s > ret + 1 && '\r' == d[0] && '\n' == d[1]))
+      nl = b + h->scan + scan.eol (b + h->scan, s - ret - h->scan);
+      if (d + s == nl)
 	{
-	  // TODO: This is the last header.
-	  h->have_eoh = true;
-	  h->http_request.output = (response_t
-		)
-		  { .next = NULL, .tls = h->tls, .eof = false, .sendbuf =
-		  NULL, };
-	  write_http (h, one_byte ? "\n" : "\r\n", one_byte ? 1 : 2);
-	  h->http = http_new (h->http_request, get_sendbuf_buf (h->sendbuf),
-			      get_sendbuf_size (h->sendbuf));
-	  sendbuf_clear (&h->sendbuf);
-	  d += one_byte ? 1 : 2;
-	  ret += one_byte ? 1 : 2;
-	}
-    }
-  if (h->have_eoh)
-    {
-      if (0 == h->body_length)
-	{
-	  new_request (h);
+	  h->scan = s - ret;
+	  if (HTTPSD_MAX_HEAD < h->scan)
+	    {
+	      reject (h, "431 Request Header Fields Too Large");
+	      return s;
+	    }
+	  break;
 	}
-      else if (s < ret + h->body_length)
+      h->scan = nl + 1 - b;
+      len = h->scan - h->line;
+      eol = 1 < len && '\r' == nl[-1] ? 2 : 1;
+      if (len - eol != scan.invalid (b + h->line, len - eol))
 	{
-	  unsigned short len = s - ret;
-	  ret = s; // Simple mathematics
-	  h->body_length -= len;
-	  write_http (h, d, len);
+	  reject (h, "400 Bad Request");
+	  return s;
 	}
-      else
+      if (HTTPSD_PARSE_REQUEST_LINE == h->state)
 	{
-	  write_http (h, d, h->body_length);
-	  ret += h->body_length;
-	  d += h->body_length;
-	  new_request (h);
-	  // Loop to next request.
-	  if (0 < s - ret)
+	  if (len == eol)
+	    {
+	      // Stray line end between requests.
+	      ret += h->scan;
+	      h->scan = 0;
+	      continue;
+	    }
+	  h->request_line.end = h->scan;
+	  if (!process_request_line (h, b, len - eol))
 	    {
-	      fprintf (stderr, "Got %zu bytes after request.\n%s\n", s - ret,
-		       d);
-	      ret += process_func (h, d, s - ret);
+	      h->scan = 0;
+	      break;
 	    }
 	}
+      else if (len == eol)
+	{
+	  ret += h->scan;
+	  process_head (h, b, h->scan);
+	  continue;
+	}
+      else if (HTTPSD_MAX_HEAD < h->scan)
+	reject (h, "431 Request Header Fields Too Large");
+      else if (0 > header_index (&h->headers, b, h->line, h->scan, eol))
+	reject (h, "400 Bad Request");
+      if (HTTPSD_PARSE_ERROR == h->state)
+	return s;
+      h->line = h->scan;
     }
   return ret;
 }
 
+/* Parse straight out of the record, only what can't be consumed yet is
+ * copied to lover. */
 void
 httpsd_in (httpsd_h h, const void *d, size_t s)
 {
-  sendbuf_append (&h->lover, d, s);
-  sendbuf_send (h, &h->lover, &process_func);
+  size_t ret;
+  if (NULL != h->lover)
+    {
+      sendbuf_append (&h->lover, d, s);
+      sendbuf_send (h, &h->lover, &process_func);
+      return;
+    }
+  ret = process_func (h, d, s);
+  sendbuf_append (&h->lover, d + ret, s - ret);
+}
+
+void
+httpsd_in_early (httpsd_h h, const void *d, size_t s)
+{
+  h->early = true;
+  httpsd_in (h, d, s);
+}
+
+void
+httpsd_established (httpsd_h h)
+{
+  h->early = false;
+  // Release whatever was held back.
+  if (NULL != h->lover)
+    sendbuf_send (h, &h->lover, &process_func);
 }
@@ -34,5 +34,9 @@ void
 httpsd_close (httpsd_h);
 void
 httpsd_in (httpsd_h, const void*, size_t);
+void
+httpsd_in_early (httpsd_h, const void*, size_t);
+void
+httpsd_established (httpsd_h);
 
 #endif
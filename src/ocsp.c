@@ -0,0 +1,186 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file ocsp.c
+ * @brief Staple OCSP responses kept in memory, re-read before they expire
+ * @author Mike Mestnik
+ *
+ * Responses are fetched by something else and written to ssl_ocsp as DER.
+ * When ssl_ocsp is a directory the response for a certificate file is
+ * named after it, "<dir>/<basename of cert>.ocsp".  Handshakes only ever
+ * copy from memory, the file is read from a scheduler timer.
+ */
+
+#include "ocsp.h"
+#include "conf.h"
+#include "schedule.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <gnutls/ocsp.h>
+#include <gnutls/x509.h>
+
+// Refresh this long before nextUpdate, fetchers usually renew at half life.
+#define OCSP_MARGIN 300
+
+typedef struct ocsp
+{
+  char *path;
+  gnutls_x509_crt_t crt;
+  pthread_mutex_t lock; // Handshakes may run on worker threads.
+  gnutls_datum_t der;
+  time_t next_update;
+  time_t mtime;
+  int instanceid;
+} ocsp_t;
+typedef ocsp_t *ocsp_h;
+
+static int
+ocsp_func (gnutls_session_t session, void *ptr, gnutls_datum_t *resp)
+{
+  ocsp_h h = ptr;
+  int ret = GNUTLS_E_NO_CERTIFICATE_STATUS;
+  pthread_mutex_lock (&h->lock);
+  if (NULL != h->der.data && time (NULL) < h->next_update
+      && NULL != (resp->data = gnutls_malloc (h->der.size)))
+    {
+      memcpy (resp->data, h->der.data, h->der.size);
+      resp->size = h->der.size;
+      ret = 0;
+    }
+  pthread_mutex_unlock (&h->lock);
+  return ret;
+}
+
+/* Returns nextUpdate of a good response for our certificate, or 0. */
+static time_t
+ocsp_check (ocsp_h h, const gnutls_datum_t *der)
+{
+  gnutls_ocsp_resp_t resp;
+  unsigned int status;
+  time_t next_update = 0;
+  if (0 != gnutls_ocsp_resp_init (&resp))
+    return 0; // LCOV_EXCL_LINE
+  if (0 == gnutls_ocsp_resp_import (resp, der)
+      && GNUTLS_OCSP_RESP_SUCCESSFUL == gnutls_ocsp_resp_get_status (resp)
+      && (NULL == h->crt || 0 == gnutls_ocsp_resp_check_crt (resp, 0, h->crt))
+      && 0 <= gnutls_ocsp_resp_get_single (resp, 0, NULL, NULL, NULL, NULL,
+					    &status, NULL, &next_update, NULL,
+					    NULL)
+      && GNUTLS_OCSP_CERT_GOOD == status)
+    {
+      // Responses without nextUpdate are good until replaced.
+      if (-1 == next_update)
+	next_update = time (NULL) + CONF.ssl_ocsp_refresh + OCSP_MARGIN;
+    }
+  else
+    next_update = 0;
+  gnutls_ocsp_resp_deinit (resp);
+  return next_update;
+}
+
+static void
+ocsp_load (ocsp_h h)
+{
+  gnutls_datum_t der =
+    { NULL, 0 };
+  struct stat st;
+  time_t next_update;
+  if (0 != stat (h->path, &st) || st.st_mtime == h->mtime)
+    return;
+  if (0 != gnutls_load_file (h->path, &der))
+    {
+      fprintf (stderr, "Can't read OCSP response %s\n", h->path);
+      return;
+    }
+  if (0 == (next_update = ocsp_check (h, &der)))
+    {
+      fprintf (stderr, "Ignoring unusable OCSP response %s\n", h->path);
+      gnutls_free (der.data);
+      return;
+    }
+  h->mtime = st.st_mtime;
+  pthread_mutex_lock (&h->lock);
+  gnutls_free (h->der.data);
+  h->der = der;
+  h->next_update = next_update;
+  pthread_mutex_unlock (&h->lock);
+}
+
+static void
+schedule_event (void *c)
+{
+  ocsp_h h = c;
+  time_t left;
+  int interval = CONF.ssl_ocsp_refresh;
+  ocsp_load (h);
+  left = h->next_update - time (NULL) - OCSP_MARGIN;
+  // Keep looking often once the response is about to go stale.
+  if (left < interval)
+    interval = left > 60 ? left : 60;
+  schedule_timer (&schedule_event, h, &h->instanceid, interval);
+}
+
+void
+ocsp_attach (gnutls_certificate_credentials_t cred, unsigned idx,
+	     const char *certfile)
+{
+  ocsp_h h = NULL;
+  struct stat st;
+  gnutls_datum_t raw;
+  if (NULL == CONF.ssl_ocsp)
+    return;
+  while (NULL == h)
+    h = malloc (sizeof(ocsp_t));
+  *h = (ocsp_t
+	)
+	  { .path = NULL, .crt = NULL, .der =
+	    { NULL, 0 }, .next_update = 0, .mtime = 0, .instanceid = 0, };
+  pthread_mutex_init (&h->lock, NULL);
+  if (0 == stat (CONF.ssl_ocsp, &st) && S_ISDIR(st.st_mode))
+    {
+      char *copy = NULL, *base;
+      while (NULL == copy)
+	copy = strdup (certfile);
+      base = basename (copy);
+      while (NULL == h->path)
+	h->path = malloc (strlen (CONF.ssl_ocsp) + strlen (base) + 7);
+      sprintf (h->path, "%s/%s.ocsp", CONF.ssl_ocsp, base);
+      free (copy);
+    }
+  else
+    while (NULL == h->path)
+      h->path = strdup (CONF.ssl_ocsp);
+  if (0 == gnutls_certificate_get_crt_raw (cred, idx, 0, &raw)
+      && 0 == gnutls_x509_crt_init (&h->crt)
+      && 0 != gnutls_x509_crt_import (h->crt, &raw, GNUTLS_X509_FMT_DER))
+    {
+      // LCOV_EXCL_START
+      gnutls_x509_crt_deinit (h->crt);
+      h->crt = NULL;
+      // LCOV_EXCL_STOP
+    }
+  gnutls_certificate_set_ocsp_status_request_function2 (cred, idx, &ocsp_func,
+							 h);
+  schedule_event (h);
+}
@@ -0,0 +1,129 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file onion.c
+ * @brief Recognize and decode onion service names
+ * @author Mike Mestnik
+ */
+
+#include "onion.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+// RFC 4648 base32, either case, 0x80 for anything else.
+static const unsigned char base32_values[256] =
+  { [0 ... 255] = 0x80, ['a'] = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+      14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, ['A'] = 0, 1, 2, 3, 4,
+      5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23,
+      24, 25, ['2'] = 26, 27, 28, 29, 30, 31, };
+
+/* Eight characters at a time into five bytes, both label lengths are whole
+ * groups.  Returns false on anything outside the alphabet. */
+static inline bool
+base32_decode (unsigned char *out, const char *in, size_t inlen)
+{
+  unsigned char bad = 0;
+  for (size_t i = 0; i < inlen; i += 8, out += 5)
+    {
+      uint64_t v = 0;
+      for (int j = 0; j < 8; j++)
+	{
+	  unsigned char u = base32_values[(unsigned char) in[i + j]];
+	  bad |= u;
+	  v = v << 5 | u;
+	}
+      out[0] = v >> 32;
+      out[1] = v >> 24;
+      out[2] = v >> 16;
+      out[3] = v >> 8;
+      out[4] = v;
+    }
+  return !(bad & 0x80);
+}
+
+/* rend-spec-v3: the checksum is the start of
+ * SHA3-256(".onion checksum" | pubkey | version) and the version is 3. */
+static bool
+onion_v3_valid (const unsigned char key[ONION_KEY_MAX])
+{
+  static const char prefix[] = ".onion checksum";
+  unsigned char buf[sizeof(prefix) - 1 + 33], digest[32];
+  if (3 != key[34])
+    return false;
+  memcpy (buf, prefix, sizeof(prefix) - 1);
+  memcpy (buf + sizeof(prefix) - 1, key, 32);
+  buf[sizeof(buf) - 1] = key[34];
+  if (0 > gnutls_hash_fast (GNUTLS_DIG_SHA3_256, buf, sizeof(buf), digest))
+    return false; // LCOV_EXCL_LINE
+  return digest[0] == key[32] && digest[1] == key[33];
+}
+
+/* Decode the label into key, which holds ONION_KEY_MAX, without checking a
+ * v3 checksum.  For names onion_find() already took.  Returns the length of
+ * the service key at the front, or 0. */
+size_t
+onion_key (const char *label, size_t len, unsigned char *key)
+{
+  if (ONION_V2_LEN != len && ONION_V3_LEN != len)
+    return 0;
+  if (!base32_decode (key, label, len))
+    return 0;
+  return ONION_V2_LEN == len ? 10 : 32;
+}
+
+/* Find the "<label>.onion" in a Host value, as a whole label followed by the
+ * end, a port or more labels.  v3 names must carry a valid checksum. */
+bool
+onion_find (const char *host, size_t len, onion_t *onion)
+{
+  const char *e = host + len, *dot, *label = host;
+  for (dot = memchr (host, '.', len); NULL != dot;
+      label = dot + 1, dot = memchr (label, '.', e - label))
+    {
+      size_t llen = dot - label;
+      if (e - dot < 6 || 0 != strncasecmp (dot + 1, "onion", 5)
+	  || (e - dot > 6 && '.' != dot[6] && ':' != dot[6]))
+	continue;
+      if (0 == (onion->key_len = onion_key (label, llen, onion->key)))
+	continue;
+      if (ONION_V3_LEN == llen && !onion_v3_valid (onion->key))
+	continue;
+      onion->start = label - host;
+      onion->len = llen;
+      return true;
+    }
+  return false;
+}
+
+/* "<label>.onion" in lower case, as handed to the SOCKS server. */
+char *
+onion_hostname (const char *host, const onion_t *onion)
+{
+  char *name = NULL;
+  while (NULL == name)
+    name = malloc (onion->len + sizeof(".onion"));
+  for (size_t i = 0; i < onion->len; i++)
+    name[i] = host[onion->start + i] | 0x20;
+  memcpy (name + onion->len, ".onion", sizeof(".onion"));
+  return name;
+}
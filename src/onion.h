@@ -0,0 +1,50 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_ONION_H
+#define __TOR2WEB_ONION_H
+
+/**
+ * @file onion.h
+ * @brief Recognize and decode onion service names
+ * @author Mike Mestnik
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ONION_V2_LEN 16
+#define ONION_V3_LEN 56
+// Decoded v3 label: ed25519 key, checksum and version.
+#define ONION_KEY_MAX 35
+
+typedef struct
+{
+  size_t start; // Offset of the label in the host.
+  size_t len; // ONION_V2_LEN or ONION_V3_LEN, ".onion" follows.
+  unsigned char key[ONION_KEY_MAX];
+  size_t key_len; // 10 for v2, the 32 byte ed25519 key for v3.
+} onion_t;
+
+bool
+onion_find (const char*, size_t, onion_t*);
+size_t
+onion_key (const char*, size_t, unsigned char*);
+char *
+onion_hostname (const char*, const onion_t*);
+
+#endif
@@ -0,0 +1,777 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file peer.c
+ * @brief Cache sharing between the gateways of a cluster
+ * @author Mike Mestnik
+ *
+ * CONF.cache_peers names every gateway of the cluster, "host:port" or the
+ * path of a unix socket, this one included under the name it listens on in
+ * CONF.cache_peer_listen.  Each name is hashed onto a ring PEER_POINTS
+ * times, and the gateway whose point follows a cache key on the ring owns
+ * that key.  The names must be the same on every gateway, so they all agree
+ * on the owners, and a gateway joining or leaving only moves its own share.
+ *
+ * A request this gateway's cache can't answer is asked of the owner of its
+ * key before it goes to Tor.  The owner answers from its memory or disk with
+ * the whole response, as a client would get it, or with a miss.  After a
+ * miss, a peer that is down or one that takes longer than PEER_TIMEOUT the
+ * request goes to the onion as it always would, and what comes back is
+ * handed to the owner to keep.
+ *
+ * Each gateway keeps one connection to each other gateway it asks, the
+ * answers come back in the order asked.  Connections are only taken from
+ * the addresses in CONF.cache_peers, and a response handed over comes with
+ * the hostname and target its key is recomputed from, so a key can't be
+ * made to hold another URL's response.  Everything sent is a peer_frame_t
+ * followed by its payload.
+ */
+
+#include "peer.h"
+#include "cache.h"
+#include "sockets.h"
+#include "schedule.h"
+#include "sendbuf.h"
+#include "vector.h"
+#include "globals.h"
+#include "stats.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <endian.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#define PEER_MAGIC 0x50573254 // "T2WP" on little endian.
+// Points each gateway has on the ring, more spread the keys more evenly.
+#define PEER_POINTS 64
+// Seconds an asked peer may go without answering before it is down.
+#define PEER_TIMEOUT 3
+// Seconds a peer that is down isn't tried again.
+#define PEER_RETRY 10
+// Larger frames are taken for garbage and the connection is dropped.
+#define PEER_FRAME_MAX (256 << 20)
+// What may wait to go out to one peer before responses stop being handed
+// to it.
+#define PEER_QUEUE_BYTES (16 << 20)
+
+typedef enum
+{
+  PEER_GET, // hostname, NUL, target, NUL, the request head.
+  PEER_HIT, // The response.
+  PEER_MISS, // Nothing.
+  PEER_PUT, // A peer_put_t, hostname, NUL, target, NUL, vary, head and body.
+} peer_type_t;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t type;
+  uint32_t len; // Of the payload that follows.
+} peer_frame_t;
+
+typedef struct
+{
+  unsigned char key[PEER_KEY];
+  unsigned char vary_key[PEER_KEY];
+  int64_t date;
+  int64_t expires;
+  uint32_t origin_len; // Hostname and target, each with its NUL.
+  uint32_t coding; // The key is recomputed from these by the owner.
+  uint32_t vary_len; // With its NUL, 0 for none.
+  uint32_t head_len;
+} peer_put_t;
+
+/* A request waiting on the answer of a peer. */
+typedef struct peer_ask
+{
+  http_request_t request;
+  sendbuf_h head;
+} peer_ask_t;
+typedef peer_ask_t *peer_ask_h;
+
+typedef struct peer
+{
+  char *name;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  fd_closure_h fd;
+  bool connected;
+  sendbuf_h out;
+  sendbuf_h in;
+  Vector asked; // peer_ask_h, in the order they were sent.
+  time_t down_until;
+  int timer;
+} peer_t;
+typedef peer_t *peer_h;
+
+/* A gateway asking this one. */
+typedef struct
+{
+  fd_closure_h fd;
+  sendbuf_h out;
+  sendbuf_h in;
+} peer_client_t;
+typedef peer_client_t *peer_client_h;
+
+typedef struct
+{
+  uint64_t point;
+  peer_h peer; // NULL for this gateway.
+} peer_point_t;
+
+static peer_point_t *ring = NULL;
+static size_t ring_len = 0;
+
+static uint64_t
+peer_point (const unsigned char *b)
+{
+  uint64_t point;
+  memcpy (&point, b, sizeof(point));
+  return be64toh (point);
+}
+
+static int
+peer_point_cmp (const void *a, const void *b)
+{
+  uint64_t x = ((const peer_point_t*) a)->point, y =
+      ((const peer_point_t*) b)->point;
+  return x < y ? -1 : x > y;
+}
+
+/* The first point at or after the key's, NULL when this gateway owns it. */
+static peer_h
+peer_owner (const unsigned char key[PEER_KEY])
+{
+  uint64_t point = peer_point (key);
+  size_t lo = 0, hi = ring_len;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (ring[mid].point < point)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return ring[lo == ring_len ? 0 : lo].peer;
+}
+
+static void
+peer_closed (fd_closure_h fd, bool write)
+{
+  // The select() that reported this fd ran before it was closed.
+}
+
+/* Puts the header of a frame in iov[0] and the frame in *out, the payload
+ * is the rest of iov. */
+static void
+peer_append (sendbuf_h *out, peer_type_t type, struct iovec *iov, size_t n)
+{
+  peer_frame_t f =
+    { .magic = htonl (PEER_MAGIC), .type = htonl (type), .len = 0, };
+  size_t i, len = 0;
+  for (i = 1; i < n; i++)
+    len += iov[i].iov_len;
+  f.len = htonl (len);
+  iov[0] = (struct iovec
+	)
+	  { .iov_base = &f, .iov_len = sizeof(f), };
+  sendbuf_appendv (out, iov, n);
+}
+
+/* 1 when a whole frame is at offset at of in, 0 while it is still coming
+ * and -1 when what came is no frame. */
+static int
+peer_frame (sendbuf_h in, size_t at, peer_frame_t *f)
+{
+  if (at + sizeof(*f) > get_sendbuf_size (in))
+    return 0;
+  memcpy (f, (const char*) get_sendbuf_buf (in) + at, sizeof(*f));
+  f->magic = ntohl (f->magic);
+  f->type = ntohl (f->type);
+  f->len = ntohl (f->len);
+  if (PEER_MAGIC != f->magic || PEER_FRAME_MAX < f->len)
+    return -1;
+  return at + sizeof(*f) + f->len <= get_sendbuf_size (in);
+}
+
+/* Drops the n bytes of frames that were handled, the rest is moved so a
+ * connection that is never idle doesn't hold on to all it ever got. */
+static void
+peer_consumed (sendbuf_h *in, size_t n)
+{
+  sendbuf_h rest = NULL;
+  if (0 == n)
+    return;
+  sendbuf_skip (in, n);
+  if (NULL == *in)
+    return;
+  sendbuf_append (&rest, get_sendbuf_buf (*in), get_sendbuf_size (*in));
+  sendbuf_clear (in);
+  *in = rest;
+}
+
+/* Everything fd has goes in *in, false once the connection is gone. */
+static bool
+peer_recv (fd_closure_h fd, sendbuf_h *in)
+{
+  char b[16 << 10];
+  ssize_t ret;
+  while (0 < (ret = recv (fd->fd, b, sizeof(b), 0)))
+    sendbuf_append (in, b, ret);
+  return 0 > ret && (EAGAIN == errno || EWOULDBLOCK == errno);
+}
+
+static size_t
+peer_send_f (void *closure, const void *b, size_t len)
+{
+  fd_closure_h fd = closure;
+  ssize_t ret = send (fd->fd, b, len, MSG_NOSIGNAL);
+  return 0 > ret ? 0 : ret;
+}
+
+/* A failed send shows up as the connection closing on the next read. */
+static void
+peer_flush (fd_closure_h fd, sendbuf_h *out)
+{
+  if (NULL != *out)
+    sendbuf_send (fd, out, &peer_send_f);
+  if (NULL == *out)
+    FD_CLR(fd->fd, &WRITE_FDSET);
+  else
+    FD_SET(fd->fd, &WRITE_FDSET);
+}
+
+static void
+peer_ask_free (peer_ask_h a)
+{
+  free (a->request.hostname);
+  free (a->request.target);
+  sendbuf_clear (&a->head);
+  free (a);
+}
+
+/* The owner didn't have it, off to the onion as if it was never asked. */
+static void
+peer_miss (peer_ask_h a)
+{
+  http_h http;
+  a->request.peered = true;
+  http = http_new (a->request, get_sendbuf_buf (a->head),
+		   get_sendbuf_size (a->head));
+  if (NULL != http)
+    http_detach (http, true, 0);
+  // http_new() took the names.
+  a->request.hostname = a->request.target = NULL;
+  peer_ask_free (a);
+}
+
+/* Everything asked of p goes to the onion instead, and p is left alone for
+ * PEER_RETRY. */
+static void
+peer_down (peer_h p)
+{
+  if (NULL != p->fd)
+    {
+      sockets_close (p->fd);
+      p->fd->can = &peer_closed;
+      p->fd = NULL;
+    }
+  sendbuf_clear (&p->out);
+  sendbuf_clear (&p->in);
+  p->down_until = time (NULL) + PEER_RETRY;
+  ++p->timer;
+  while (!vector_is_empty (&p->asked))
+    {
+      peer_ask_h a = *(peer_ask_h*) vector_front (&p->asked);
+      vector_pop_front (&p->asked);
+      peer_miss (a);
+    }
+}
+
+static void
+peer_timeout (void *c)
+{
+  peer_h p = c;
+  fprintf (stderr, "peer %s: no answer in %d seconds\n", p->name,
+	   PEER_TIMEOUT);
+  // Closed from peer_can(), the fd is in the sets select() is about to get.
+  if (p->connected && 0 == shutdown (p->fd->fd, SHUT_RDWR))
+    return;
+  peer_down (p);
+}
+
+static void
+peer_answer (peer_h p, const peer_frame_t *f, const void *b)
+{
+  peer_ask_h a = *(peer_ask_h*) vector_front (&p->asked);
+  vector_pop_front (&p->asked);
+  if (vector_is_empty (&p->asked))
+    ++p->timer;
+  else
+    schedule_timer (&peer_timeout, p, &p->timer, PEER_TIMEOUT);
+  if (PEER_HIT != f->type)
+    {
+      peer_miss (a);
+      return;
+    }
+  stats_inc (STATS_PEER_HITS);
+  response_send (a->request.output, b, f->len);
+  a->request.output->eof = true;
+  response_send (a->request.output, NULL, 0);
+  peer_ask_free (a);
+}
+
+static void
+peer_can (fd_closure_h fd, bool write)
+{
+  peer_h p = fd->closure;
+  peer_frame_t f;
+  size_t consumed = 0;
+  bool open;
+  int ret;
+  if (write)
+    {
+      if (!p->connected)
+	{
+	  int err = 0;
+	  socklen_t len = sizeof(err);
+	  getsockopt (fd->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	  if (0 != err)
+	    {
+	      fprintf (stderr, "peer %s: %s\n", p->name, strerror (err));
+	      peer_down (p);
+	      return;
+	    }
+	  p->connected = true;
+	}
+      peer_flush (fd, &p->out);
+      return;
+    }
+  open = peer_recv (fd, &p->in);
+  while (0 < (ret = peer_frame (p->in, consumed, &f)))
+    {
+      if ((PEER_HIT != f.type && PEER_MISS != f.type)
+	  || vector_is_empty (&p->asked))
+	{
+	  ret = -1;
+	  break;
+	}
+      peer_answer (p, &f,
+		   (const char*) get_sendbuf_buf (p->in) + consumed
+		       + sizeof(f));
+      consumed += sizeof(f) + f.len;
+    }
+  peer_consumed (&p->in, consumed);
+  if (!open || 0 > ret)
+    peer_down (p);
+}
+
+/* False when p is down or can't be reached. */
+static bool
+peer_up (peer_h p)
+{
+  int fd;
+  if (NULL != p->fd)
+    return true;
+  if (time (NULL) < p->down_until)
+    return false;
+  if (0 > (fd = socket (p->addr.ss_family, SOCK_STREAM, 0)))
+    {
+      // LCOV_EXCL_START
+      perror ("peer socket");
+      p->down_until = time (NULL) + PEER_RETRY;
+      return false;
+      // LCOV_EXCL_STOP
+    }
+  p->fd = sockets_watch (fd, &peer_can, p);
+  p->connected = false;
+  if (0 == connect (fd, (struct sockaddr*) &p->addr, p->addr_len))
+    p->connected = true;
+  else if (EINPROGRESS != errno)
+    {
+      fprintf (stderr, "peer %s: %s\n", p->name, strerror (errno));
+      peer_down (p);
+      return false;
+    }
+  // Told when the connect is done, what was queued meanwhile goes then.
+  FD_SET(fd, &WRITE_FDSET);
+  return true;
+}
+
+bool
+peer_ask (http_request_t *request, const char *b, size_t len)
+{
+  unsigned char key[PEER_KEY];
+  struct iovec iov[4];
+  peer_ask_h a = NULL;
+  peer_h p;
+  if (0 == ring_len || request->alone || request->peered
+      || !cache_request_key (request->hostname, request->target, b, len, key)
+      || NULL == (p = peer_owner (key)) || !peer_up (p))
+    return false;
+  while (NULL == a)
+    a = malloc (sizeof(peer_ask_t));
+  *a = (peer_ask_t
+	)
+	  { .request = *request, .head = NULL, };
+  sendbuf_append (&a->head, b, len);
+  iov[1] = (struct iovec
+	)
+	  { .iov_base = request->hostname, .iov_len = strlen (
+	      request->hostname) + 1, };
+  iov[2] = (struct iovec
+	)
+	  { .iov_base = request->target, .iov_len = strlen (request->target)
+	      + 1, };
+  iov[3] = (struct iovec
+	)
+	  { .iov_base = (void*) b, .iov_len = len, };
+  peer_append (&p->out, PEER_GET, iov, 4);
+  vector_push_back (&p->asked, &a);
+  if (1 == p->asked.size)
+    schedule_timer (&peer_timeout, p, &p->timer, PEER_TIMEOUT);
+  stats_inc (STATS_PEER_ASKS);
+  if (p->connected)
+    peer_flush (p->fd, &p->out);
+  return true;
+}
+
+void
+peer_store (const char *hostname, const char *target, codec_type_t coding,
+	    const char *vary, const unsigned char vary_key[PEER_KEY],
+	    time_t date, time_t expires, const void *head, size_t head_len,
+	    const void *body, size_t body_len)
+{
+  unsigned char key[PEER_KEY];
+  peer_put_t put;
+  struct iovec iov[7];
+  peer_h p;
+  if (0 == ring_len || !cache_key (hostname, target, coding, key)
+      || NULL == (p = peer_owner (key)) || !peer_up (p)
+      || PEER_QUEUE_BYTES < get_sendbuf_size (p->out))
+    return;
+  memcpy (put.key, key, PEER_KEY);
+  memcpy (put.vary_key, vary_key, PEER_KEY);
+  put.date = htobe64 (date);
+  put.expires = htobe64 (expires);
+  put.origin_len = htonl (strlen (hostname) + strlen (target) + 2);
+  put.coding = htonl (coding);
+  put.vary_len = htonl (NULL == vary ? 0 : strlen (vary) + 1);
+  put.head_len = htonl (head_len);
+  iov[1] = (struct iovec
+	)
+	  { .iov_base = &put, .iov_len = sizeof(put), };
+  iov[2] = (struct iovec
+	)
+	  { .iov_base = (void*) hostname, .iov_len = strlen (hostname) + 1, };
+  iov[3] = (struct iovec
+	)
+	  { .iov_base = (void*) target, .iov_len = strlen (target) + 1, };
+  iov[4] = (struct iovec
+	)
+	  { .iov_base = (void*) vary, .iov_len = ntohl (put.vary_len), };
+  iov[5] = (struct iovec
+	)
+	  { .iov_base = (void*) head, .iov_len = head_len, };
+  iov[6] = (struct iovec
+	)
+	  { .iov_base = (void*) body, .iov_len = body_len, };
+  peer_append (&p->out, PEER_PUT, iov, 7);
+  stats_inc (STATS_PEER_STORES);
+  if (p->connected)
+    peer_flush (p->fd, &p->out);
+}
+
+/* False when the frame makes no sense. */
+static bool
+peer_serve (peer_client_h c, const peer_frame_t *f, const char *b)
+{
+  if (PEER_GET == f->type)
+    {
+      const char *hostname = b, *target, *end = b + f->len;
+      sendbuf_h answer = NULL;
+      struct iovec iov[2];
+      if (NULL == (target = memchr (hostname, '\0', end - hostname))
+	  || NULL == (b = memchr (target + 1, '\0', end - target - 1)))
+	return false;
+      ++target;
+      ++b;
+      if (cache_serve_peer (&answer, hostname, target, b, end - b))
+	stats_inc (STATS_PEER_SERVED);
+      iov[1] = (struct iovec
+	    )
+	      { .iov_base = (void*) get_sendbuf_buf (answer), .iov_len =
+		  get_sendbuf_size (answer), };
+      peer_append (&c->out, NULL == answer ? PEER_MISS : PEER_HIT, iov, 2);
+      sendbuf_clear (&answer);
+      return true;
+    }
+  if (PEER_PUT == f->type)
+    {
+      unsigned char key[PEER_KEY];
+      peer_put_t put;
+      const char *hostname, *target, *vary;
+      size_t origin_len, vary_len, head_len, rest;
+      if (sizeof(put) > f->len)
+	return false;
+      memcpy (&put, b, sizeof(put));
+      origin_len = ntohl (put.origin_len);
+      vary_len = ntohl (put.vary_len);
+      head_len = ntohl (put.head_len);
+      rest = f->len - sizeof(put);
+      if (rest < origin_len || rest - origin_len < vary_len
+	  || rest - origin_len - vary_len < head_len
+	  || CODEC_UNKNOWN <= ntohl (put.coding))
+	return false;
+      hostname = b + sizeof(put);
+      if (0 == origin_len || '\0' != hostname[origin_len - 1]
+	  || NULL == (target = memchr (hostname, '\0', origin_len))
+	  || ++target == hostname + origin_len
+	  || (0 != vary_len && '\0' != hostname[origin_len + vary_len - 1]))
+	return false;
+      // Whatever the key says, the response is only kept where it belongs.
+      if (!cache_key (hostname, target, ntohl (put.coding), key)
+	  || 0 != memcmp (key, put.key, PEER_KEY))
+	{
+	  fprintf (stderr, "peer: PUT for %s%s under another key\n", hostname,
+		   target);
+	  return false;
+	}
+      vary = 0 == vary_len ? NULL : hostname + origin_len;
+      b = hostname + origin_len + vary_len;
+      cache_adopt (key, vary, put.vary_key, be64toh (put.date),
+		   be64toh (put.expires), b, head_len, b + head_len,
+		   rest - origin_len - vary_len - head_len);
+      return true;
+    }
+  return false;
+}
+
+static void
+peer_client_can (fd_closure_h fd, bool write)
+{
+  peer_client_h c = fd->closure;
+  peer_frame_t f;
+  size_t consumed = 0;
+  bool open = true;
+  int ret = 0;
+  if (!write)
+    {
+      open = peer_recv (fd, &c->in);
+      while (0 < (ret = peer_frame (c->in, consumed, &f)))
+	{
+	  if (!peer_serve (c, &f,
+			   (const char*) get_sendbuf_buf (c->in) + consumed
+			       + sizeof(f)))
+	    {
+	      ret = -1;
+	      break;
+	    }
+	  consumed += sizeof(f) + f.len;
+	}
+      peer_consumed (&c->in, consumed);
+    }
+  if (!open || 0 > ret)
+    {
+      sockets_close (fd);
+      fd->can = &peer_closed;
+      sendbuf_clear (&c->in);
+      sendbuf_clear (&c->out);
+      free (c);
+      return;
+    }
+  peer_flush (fd, &c->out);
+}
+
+/* Whether a connection from addr comes from one of CONF.cache_peers, only
+ * their addresses count, the port is whatever they connect from. */
+static bool
+peer_known (const struct sockaddr_storage *addr)
+{
+  size_t i;
+  if (AF_UNIX == addr->ss_family)
+    return true; // The socket's permissions say who may.
+  for (i = 0; i < ring_len; i++)
+    {
+      const struct sockaddr_storage *p;
+      if (NULL == ring[i].peer)
+	continue;
+      p = &ring[i].peer->addr;
+      if (p->ss_family != addr->ss_family)
+	continue;
+      if (AF_INET == p->ss_family
+	  && 0 == memcmp (&((const struct sockaddr_in*) p)->sin_addr,
+			  &((const struct sockaddr_in*) addr)->sin_addr,
+			  sizeof(struct in_addr)))
+	return true;
+      if (AF_INET6 == p->ss_family
+	  && 0 == memcmp (&((const struct sockaddr_in6*) p)->sin6_addr,
+			  &((const struct sockaddr_in6*) addr)->sin6_addr,
+			  sizeof(struct in6_addr)))
+	return true;
+    }
+  return false;
+}
+
+static void
+peer_accept (fd_closure_h h, bool write)
+{
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  peer_client_h c = NULL;
+  int fd;
+  if (0 > (fd = accept (h->fd, (struct sockaddr*) &addr, &len)))
+    {
+      perror ("peer accept"); // LCOV_EXCL_LINE
+      return; // LCOV_EXCL_LINE
+    }
+  // Anyone else could put what they like in the cache.
+  if (!peer_known (&addr))
+    {
+      char name[INET6_ADDRSTRLEN] = "?";
+      inet_ntop (addr.ss_family,
+		 AF_INET == addr.ss_family ?
+		     (void*) &((struct sockaddr_in*) &addr)->sin_addr :
+		     (void*) &((struct sockaddr_in6*) &addr)->sin6_addr, name,
+		 sizeof(name));
+      fprintf (stderr, "peer: refused %s, not in cache_peers\n", name);
+      close (fd);
+      return;
+    }
+  assert(FD_SETSIZE > fd);
+  while (NULL == c)
+    c = malloc (sizeof(peer_client_t));
+  *c = (peer_client_t
+	)
+	  { .fd = NULL, .out = NULL, .in = NULL, };
+  c->fd = sockets_watch (fd, &peer_client_can, c);
+}
+
+static void
+peer_listen (const char *name)
+{
+  struct sockaddr_storage addr;
+  socklen_t len;
+  int yes = 1;
+  int fd;
+  if (!sockets_addr (name, &addr, &len))
+    {
+      fprintf (stderr, "peer_init: can't listen on %s\n", name);
+      return;
+    }
+  if (AF_UNIX == addr.ss_family)
+    unlink (((struct sockaddr_un*) &addr)->sun_path);
+  if (0 > (fd = socket (addr.ss_family, SOCK_STREAM, 0)))
+    {
+      // LCOV_EXCL_START
+      perror ("peer_init: socket");
+      return;
+      // LCOV_EXCL_STOP
+    }
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  if (0 != bind (fd, (struct sockaddr*) &addr, len) || 0 != listen (fd, 64))
+    {
+      perror ("peer_init: bind");
+      close (fd);
+      return;
+    }
+  sockets_watch (fd, &peer_accept, NULL);
+}
+
+/* The points of one gateway, digests of its name and the point's number. */
+static void
+peer_points (const char *name, peer_h p)
+{
+  unsigned char digest[PEER_KEY];
+  size_t i;
+  for (i = 0; i < PEER_POINTS; i++)
+    {
+      char point[256 + 16];
+      snprintf (point, sizeof(point), "%s#%zu", name, i);
+      gnutls_hash_fast (GNUTLS_DIG_SHA256, point, strlen (point), digest);
+      ring[ring_len++] = (peer_point_t
+	    )
+	      { .point = peer_point (digest), .peer = p, };
+    }
+}
+
+void
+peer_init ()
+{
+  char *names, *name, *save = NULL;
+  size_t n = 1;
+  if (NULL == CONF.cache_peers)
+    return;
+  for (name = CONF.cache_peers; NULL != (name = strchr (name, ',')); name++)
+    n++;
+  while (NULL == ring)
+    ring = malloc (n * PEER_POINTS * sizeof(peer_point_t));
+  names = NULL;
+  while (NULL == names)
+    names = strdup (CONF.cache_peers);
+  for (name = strtok_r (names, ", \t", &save); NULL != name;
+      name = strtok_r (NULL, ", \t", &save))
+    {
+      peer_h p = NULL;
+      if (NULL != CONF.cache_peer_listen
+	  && 0 == strcmp (name, CONF.cache_peer_listen))
+	{
+	  peer_points (name, NULL);
+	  continue;
+	}
+      while (NULL == p)
+	p = malloc (sizeof(peer_t));
+      *p = (peer_t
+	    )
+	      { .name = NULL, .addr_len = 0, .fd = NULL, .connected = false,
+		  .out = NULL, .in = NULL, .asked = VECTOR_INITIALIZER,
+		  .down_until = 0, .timer = 0, };
+      if (!sockets_addr (name, &p->addr, &p->addr_len))
+	{
+	  fprintf (stderr, "peer_init: bad peer %s\n", name);
+	  free (p);
+	  continue;
+	}
+      while (NULL == p->name)
+	p->name = strdup (name);
+      while (VECTOR_SUCCESS
+	  != vector_setup (&p->asked, 16, sizeof(peer_ask_h)))
+	;
+      peer_points (name, p);
+    }
+  free (names);
+  if (0 == ring_len)
+    {
+      free (ring);
+      ring = NULL;
+      return;
+    }
+  qsort (ring, ring_len, sizeof(peer_point_t), &peer_point_cmp);
+  if (NULL != CONF.cache_peer_listen)
+    peer_listen (CONF.cache_peer_listen);
+}
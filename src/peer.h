@@ -0,0 +1,46 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_PEER_H
+#define __TOR2WEB_PEER_H
+
+/**
+ * @file peer.h
+ * @brief Cache sharing between the gateways of a cluster
+ * @author Mike Mestnik
+ */
+
+#include "http.h"
+#include "disk.h"
+#include "codec.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define PEER_KEY DISK_KEY
+
+void
+peer_init ();
+bool
+peer_ask (http_request_t*, const char*, size_t);
+void
+peer_store (const char*, const char*, codec_type_t, const char*,
+	    const unsigned char[PEER_KEY], time_t, time_t, const void*, size_t,
+	    const void*, size_t);
+
+#endif
@@ -0,0 +1,135 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file replay.c
+ * @brief Reject replayed TLS 1.3 early data
+ * @author Mike Mestnik
+ *
+ * GnuTLS already refuses ClientHellos whose ticket age falls outside of
+ * ssl_early_data_window, and tickets issued before the current window
+ * began, this remembers the ones seen inside of it.  So the window also
+ * bounds how long a visitor can be away and still send early data.  Two
+ * generations of fingerprints are kept, the older one is dropped once the
+ * newer one has been filling for a whole window.  So each entry lives for
+ * at least one window and the memory used is fixed.  A full table refuses
+ * early data, which only costs the client a round trip.
+ */
+
+#include "replay.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define REPLAY_SLOTS (1 << 16)
+
+static gnutls_anti_replay_t anti_replay = NULL;
+// Handshakes can run on the worker pool.
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *generation[2] =
+  { NULL, NULL };
+static size_t generation_used = 0;
+static time_t generation_start = 0;
+
+static inline uint64_t
+replay_hash (const gnutls_datum_t *key)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  unsigned i;
+  for (i = 0; i < key->size; i++)
+    h = (h ^ key->data[i]) * 0x100000001b3ULL;
+  // Zero marks an empty slot.
+  return h | 1;
+}
+
+/* Returns the slot holding h, or the empty one it would go in. */
+static inline uint64_t *
+replay_slot (uint64_t *table, uint64_t h)
+{
+  size_t i;
+  for (i = h & (REPLAY_SLOTS - 1); 0 != table[i] && h != table[i];
+      i = (i + 1) & (REPLAY_SLOTS - 1))
+    ;
+  return &table[i];
+}
+
+static int
+replay_add (void *ptr, time_t exp_time, const gnutls_datum_t *key,
+	    const gnutls_datum_t *data)
+{
+  uint64_t h = replay_hash (key), *slot;
+  time_t now = time (NULL);
+  int ret = 0;
+  pthread_mutex_lock (&replay_lock);
+  if (now - generation_start >= CONF.ssl_early_data_window)
+    {
+      uint64_t *old = generation[1];
+      generation[1] = generation[0];
+      generation[0] = old;
+      memset (generation[0], 0, REPLAY_SLOTS * sizeof(uint64_t));
+      generation_used = 0;
+      generation_start = now;
+    }
+  if (h == *replay_slot (generation[1], h)
+      || h == *(slot = replay_slot (generation[0], h))
+      || generation_used >= REPLAY_SLOTS / 2)
+    ret = GNUTLS_E_DB_ENTRY_EXISTS;
+  else
+    {
+      *slot = h;
+      generation_used++;
+    }
+  pthread_mutex_unlock (&replay_lock);
+  return ret;
+}
+
+void
+replay_init ()
+{
+  int i;
+  if (0 >= CONF.ssl_early_data)
+    return;
+  if (0 != gnutls_anti_replay_init (&anti_replay))
+    {
+      // LCOV_EXCL_START
+      fprintf (stderr, "Can't set up anti-replay, early data disabled\n");
+      CONF.ssl_early_data = 0;
+      return;
+      // LCOV_EXCL_STOP
+    }
+  gnutls_anti_replay_set_window (anti_replay,
+				 CONF.ssl_early_data_window * 1000);
+  gnutls_anti_replay_set_add_function (anti_replay, &replay_add);
+  for (i = 0; i < 2; i++)
+    while (NULL == generation[i])
+      generation[i] = calloc (REPLAY_SLOTS, sizeof(uint64_t));
+  generation_start = time (NULL);
+}
+
+void
+replay_enable (gnutls_session_t session)
+{
+  if (NULL == anti_replay)
+    return;
+  gnutls_record_set_max_early_data_size (session, CONF.ssl_early_data);
+  gnutls_anti_replay_enable (session, anti_replay);
+}
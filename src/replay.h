@@ -0,0 +1,34 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_REPLAY_H
+#define __TOR2WEB_REPLAY_H
+
+/**
+ * @file replay.h
+ * @brief Reject replayed TLS 1.3 early data
+ * @author Mike Mestnik
+ */
+
+#include <gnutls/gnutls.h>
+
+void
+replay_init ();
+void
+replay_enable (gnutls_session_t);
+
+#endif
@@ -0,0 +1,421 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file rewrite.c
+ * @brief Header rewriting between onion names and the basehost
+ * @author Mike Mestnik
+ *
+ * Responses have onion URLs moved under the basehost, "http://x.onion/" to
+ * "https://x.onion.<basehost>/", and cookie domains with them.  Requests
+ * get the reverse for the headers that carry the client's view of the URL.
+ * Each field is one pass over its value, untouched bytes are never copied
+ * here, only referenced.
+ *
+ * HTML bodies get the same treatment for onion names as they stream by,
+ * "x.onion" becomes "x.onion.<basehost>".  Only ".onion" and two bytes past
+ * it are ever held back between pieces, the label in front is tracked as a
+ * count.  The onions linked are passed to control_want(), who follows a
+ * link finds its descriptor fetched.
+ */
+
+#include "rewrite.h"
+#include "conf.h"
+#include "onion.h"
+#include "scan.h"
+#include "control.h"
+
+#include <string.h>
+#include <strings.h>
+
+static const char *basehost;
+static size_t basehost_len;
+
+void
+rewrite_init ()
+{
+  // Without one, onion URLs are left alone and cookie domains dropped.
+  if (NULL != CONF.basehost && 0 != strcmp (CONF.basehost, "AUTO"))
+    {
+      basehost = CONF.basehost;
+      basehost_len = strlen (basehost);
+    }
+}
+
+bool
+rewrite_enabled ()
+{
+  return NULL != basehost;
+}
+
+void
+rewrite_flush (rewrite_t *rw)
+{
+  if (0 != rw->n)
+    rw->flush (rw->closure, rw->iov, rw->n);
+  rw->n = 0;
+}
+
+void
+rewrite_emit (rewrite_t *rw, const void *p, size_t len)
+{
+  if (0 == len)
+    return;
+  // Runs of untouched bytes stay one slice.
+  if (0 != rw->n
+      && (const char*) rw->iov[rw->n - 1].iov_base + rw->iov[rw->n - 1].iov_len
+	  == p)
+    {
+      rw->iov[rw->n - 1].iov_len += len;
+      return;
+    }
+  if (REWRITE_IOV == rw->n)
+    rewrite_flush (rw);
+  rw->iov[rw->n++] = (struct iovec
+	)
+	  { .iov_base = (void*) p, .iov_len = len, };
+}
+
+static inline bool
+ends_with (const char *p, const char *e, const char *s, size_t n)
+{
+  return (size_t) (e - p) >= n && 0 == strncasecmp (e - n, s, n);
+}
+
+/* Split a URL at [p, e) into the scheme and authority, *a is the start of
+ * the host and *ae the end of the authority.  *he is where the host ends,
+ * before any port. */
+static bool
+url_authority (const char *p, const char *e, const char **a, const char **he,
+	       const char **ae)
+{
+  if (e - p >= 7 && 0 == strncasecmp (p, "http://", 7))
+    *a = p + 7;
+  else if (e - p >= 8 && 0 == strncasecmp (p, "https://", 8))
+    *a = p + 8;
+  else if (e - p >= 2 && '/' == p[0] && '/' == p[1])
+    *a = p + 2;
+  else
+    return false;
+  for (*ae = *a; *ae < e && '/' != **ae && '?' != **ae && '#' != **ae;
+      (*ae)++)
+    ;
+  for (*he = *a; *he < *ae && ':' != **he; (*he)++)
+    ;
+  return true;
+}
+
+/* "http://x.onion:80/p" to "https://x.onion.<basehost>/p". */
+static void
+rewrite_url_out (rewrite_t *rw, const char *p, const char *e)
+{
+  const char *a, *he, *ae;
+  if (NULL == basehost || !url_authority (p, e, &a, &he, &ae)
+      || he - a <= 6 || !ends_with (a, he, ".onion", 6))
+    {
+      rewrite_emit (rw, p, e - p);
+      return;
+    }
+  if ('/' == p[0])
+    rewrite_emit (rw, p, 2);
+  else
+    rewrite_emit (rw, "https://", 8);
+  rewrite_emit (rw, a, he - a);
+  rewrite_emit (rw, ".", 1);
+  rewrite_emit (rw, basehost, basehost_len);
+  rewrite_emit (rw, ae, e - ae);
+}
+
+/* "https://x.onion.<basehost>/p" to "http://x.onion/p". */
+static void
+rewrite_url_in (rewrite_t *rw, const char *p, const char *e)
+{
+  const char *a, *he, *ae, *onion;
+  if (NULL == basehost || !url_authority (p, e, &a, &he, &ae)
+      || he - a <= 7 + basehost_len
+      || !ends_with (a, he, basehost, basehost_len) || '.' != he[-basehost_len - 1])
+    {
+      rewrite_emit (rw, p, e - p);
+      return;
+    }
+  onion = he - basehost_len - 1;
+  if (!ends_with (a, onion, ".onion", 6))
+    {
+      rewrite_emit (rw, p, e - p);
+      return;
+    }
+  if ('/' == p[0])
+    rewrite_emit (rw, p, 2);
+  else
+    rewrite_emit (rw, "http://", 7);
+  rewrite_emit (rw, a, onion - a);
+  rewrite_emit (rw, ae, e - ae);
+}
+
+/* Domain attributes naming an onion move under the basehost, any other
+ * domain couldn't be set through us anyway and is dropped. */
+static void
+rewrite_cookie (rewrite_t *rw, const char *p, const char *e)
+{
+  const char *s = p, *a, *ae, *v, *ve;
+  // The name=value before the first ';' is opaque.
+  for (a = memchr (p, ';', e - p); NULL != a; a = e == ae ? NULL : ae)
+    {
+      if (NULL == (ae = memchr (a + 1, ';', e - a - 1)))
+	ae = e;
+      for (v = a + 1; v < ae && (' ' == *v || '\t' == *v); v++)
+	;
+      if (ae - v < 7 || 0 != strncasecmp (v, "domain=", 7))
+	continue;
+      for (v += 7, ve = ae; ve > v && (' ' == ve[-1] || '\t' == ve[-1]); ve--)
+	;
+      rewrite_emit (rw, s, a - s);
+      if (NULL != basehost && ends_with (v, ve, ".onion", 6))
+	{
+	  rewrite_emit (rw, a, ve - a);
+	  rewrite_emit (rw, ".", 1);
+	  rewrite_emit (rw, basehost, basehost_len);
+	  s = ve;
+	}
+      else
+	s = ae;
+    }
+  rewrite_emit (rw, s, e - s);
+}
+
+/* "5; url=http://x.onion/", the URL may be quoted. */
+static void
+rewrite_refresh (rewrite_t *rw, const char *p, const char *e)
+{
+  const char *u, *ue;
+  for (u = p; u < e && ';' != *u && ',' != *u; u++)
+    ;
+  for (u++; u < e && (' ' == *u || '\t' == *u); u++)
+    ;
+  if (e - u < 3 || 0 != strncasecmp (u, "url", 3))
+    {
+      rewrite_emit (rw, p, e - p);
+      return;
+    }
+  for (u += 3; u < e && (' ' == *u || '\t' == *u); u++)
+    ;
+  if (u == e || '=' != *u)
+    {
+      rewrite_emit (rw, p, e - p);
+      return;
+    }
+  for (u++; u < e && (' ' == *u || '\t' == *u); u++)
+    ;
+  ue = e;
+  if (u < e && ('\'' == *u || '"' == *u))
+    {
+      const char *q = memchr (u + 1, *u, e - u - 1);
+      u++;
+      if (NULL != q)
+	ue = q;
+    }
+  rewrite_emit (rw, p, u - p);
+  rewrite_url_out (rw, u, ue);
+  rewrite_emit (rw, ue, e - ue);
+}
+
+void
+rewrite_response_field (rewrite_t *rw, const char *b,
+			const header_field_t *field)
+{
+  const char *n = b + field->name, *v = b + field->value, *ve = v
+      + field->value_len;
+  switch (field->id)
+    {
+    case HEADER_SET_COOKIE:
+      rewrite_emit (rw, n, v - n);
+      rewrite_cookie (rw, v, ve);
+      break;
+    case HEADER_LOCATION:
+    case HEADER_CONTENT_LOCATION:
+      rewrite_emit (rw, n, v - n);
+      rewrite_url_out (rw, v, ve);
+      break;
+    case HEADER_REFRESH:
+      rewrite_emit (rw, n, v - n);
+      rewrite_refresh (rw, v, ve);
+      break;
+    default:
+      rewrite_emit (rw, n, field->end - field->name);
+      return;
+    }
+  rewrite_emit (rw, ve, b + field->end - ve);
+}
+
+void
+rewrite_request_field (rewrite_t *rw, const char *b,
+		       const header_field_t *field)
+{
+  const char *n = b + field->name, *v = b + field->value, *ve = v
+      + field->value_len;
+  switch (field->id)
+    {
+    case HEADER_ORIGIN:
+    case HEADER_REFERER:
+      rewrite_emit (rw, n, v - n);
+      rewrite_url_in (rw, v, ve);
+      break;
+    default:
+      rewrite_emit (rw, n, field->end - field->name);
+      return;
+    }
+  rewrite_emit (rw, ve, b + field->end - ve);
+}
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+static inline bool
+is_label (char c)
+{
+  return ('a' <= (c | 0x20) && 'z' >= (c | 0x20)) || ('0' <= c && '9' >= c)
+      || '-' == c;
+}
+
+static inline bool
+is_base32 (char c)
+{
+  return ('a' <= (c | 0x20) && 'z' >= (c | 0x20)) || ('2' <= c && '7' >= c);
+}
+
+/* Count the label bytes ending at p + k, continuing into the ones before p. */
+static size_t
+body_run (const rewrite_body_t *st, const char *p, size_t k, bool *base32)
+{
+  size_t i = k;
+  *base32 = true;
+  while (0 < i && is_label (p[i - 1]) && ONION_V3_LEN >= k - i)
+    *base32 = is_base32 (p[--i]) && *base32;
+  if (0 != i)
+    return k - i;
+  *base32 = *base32 && (0 == st->run || st->run_base32);
+  return MIN(k + st->run, ONION_V3_LEN + 1);
+}
+
+/* Bring st->in_tag from p + *from up to p + k. */
+static bool
+body_in_tag (rewrite_body_t *st, const char *p, size_t *from, size_t k)
+{
+  size_t i;
+  for (i = k; i > *from; i--)
+    if ('<' == p[i - 1] || '>' == p[i - 1])
+      {
+	st->in_tag = '<' == p[i - 1];
+	break;
+      }
+  *from = k;
+  return st->in_tag;
+}
+
+/* Whether q, at a '.', ends an onion name, m bytes being there.  Bytes past
+ * the end of the document count as not part of a name. */
+static bool
+body_is_onion (const char *q, size_t m)
+{
+  if (6 > m || 0 != strncasecmp (q, ".onion", 6))
+    return false;
+  if (6 == m || '.' != q[6])
+    return 6 == m || !is_label (q[6]);
+  // "x.onion." ending a sentence, but not "x.onion.<anything>".
+  return 7 == m || !is_label (q[7]);
+}
+
+/* Pass [p, p + n) through with the rewrites, except for a tail that needs
+ * more input to decide.  Returns the length passed. */
+static size_t
+body_scan (rewrite_t *rw, rewrite_body_t *st, const char *p, size_t n,
+	   bool final)
+{
+  size_t i = 0, k, start = 0, tag = 0, run;
+  bool base32;
+  while (i < n)
+    {
+      k = i + scan.dot_o (p + i, n - i);
+      if (k == n)
+	break;
+      if (REWRITE_CARRY > n - k && !final)
+	{
+	  n = k;
+	  break;
+	}
+      i = k + 1;
+      if (!body_is_onion (p + k, n - k))
+	continue;
+      run = body_run (st, p, k, &base32);
+      if (!base32 || (ONION_V2_LEN != run && ONION_V3_LEN != run))
+	continue;
+      // A label split from the last piece was passed already, it goes
+      // without.
+      if (k >= run)
+	control_want (p + k - run, run);
+      if (CONF.avoid_rewriting_visible_content
+	  && !body_in_tag (st, p, &tag, k))
+	continue;
+      rewrite_emit (rw, p + start, k + 6 - start);
+      rewrite_emit (rw, ".", 1);
+      rewrite_emit (rw, basehost, basehost_len);
+      start = i = k + 6;
+    }
+  rewrite_emit (rw, p + start, n - start);
+  st->run = body_run (st, p, n, &st->run_base32);
+  body_in_tag (st, p, &tag, n);
+  return n;
+}
+
+void
+rewrite_body (rewrite_t *rw, rewrite_body_t *st, const char *d, size_t s)
+{
+  char join[2 * REWRITE_CARRY];
+  size_t c, k, len;
+  if (0 != st->carry_len)
+    {
+      // Enough of d to decide everything carried.
+      k = MIN(s, REWRITE_CARRY);
+      memcpy (join, st->carry, st->carry_len);
+      memcpy (join + st->carry_len, d, k);
+      len = st->carry_len + k;
+      c = body_scan (rw, st, join, len, false);
+      rewrite_flush (rw);
+      if (k == s)
+	{
+	  memcpy (st->carry, join + c, len - c);
+	  st->carry_len = len - c;
+	  return;
+	}
+      d += c - st->carry_len;
+      s -= c - st->carry_len;
+      st->carry_len = 0;
+    }
+  c = body_scan (rw, st, d, s, false);
+  rewrite_flush (rw);
+  memcpy (st->carry, d + c, s - c);
+  st->carry_len = s - c;
+}
+
+void
+rewrite_body_end (rewrite_t *rw, rewrite_body_t *st)
+{
+  body_scan (rw, st, st->carry, st->carry_len, true);
+  rewrite_flush (rw);
+  *st = (rewrite_body_t
+	)
+	  { .carry_len = 0, };
+}
@@ -0,0 +1,77 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_REWRITE_H
+#define __TOR2WEB_REWRITE_H
+
+/**
+ * @file rewrite.h
+ * @brief Header rewriting between onion names and the basehost
+ * @author Mike Mestnik
+ */
+
+#include "header.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define REWRITE_IOV 32
+// ".onion" and the two bytes that show whether the name ends there.
+#define REWRITE_CARRY 8
+
+typedef void
+(*rewrite_flush_f) (void*, const struct iovec*, size_t);
+
+/* Output is gathered as slices of the head, of CONF.basehost and of string
+ * constants, handed to flush whenever iov fills and by rewrite_flush(). */
+typedef struct
+{
+  rewrite_flush_f flush;
+  void *closure;
+  size_t n;
+  struct iovec iov[REWRITE_IOV];
+} rewrite_t;
+
+/* Body rewriting state carried from one piece of a document to the next. */
+typedef struct
+{
+  char carry[REWRITE_CARRY]; // Undecided bytes, starting with a '.'.
+  size_t carry_len;
+  size_t run; // Label bytes just before carry, at most ONION_V3_LEN + 1.
+  bool run_base32; // And all of them could be in an onion name.
+  bool in_tag; // Between a '<' and a '>'.
+} rewrite_body_t;
+
+void
+rewrite_init ();
+bool
+rewrite_enabled ();
+void
+rewrite_emit (rewrite_t*, const void*, size_t);
+void
+rewrite_flush (rewrite_t*);
+void
+rewrite_response_field (rewrite_t*, const char*, const header_field_t*);
+void
+rewrite_request_field (rewrite_t*, const char*, const header_field_t*);
+void
+rewrite_body (rewrite_t*, rewrite_body_t*, const char*, size_t);
+void
+rewrite_body_end (rewrite_t*, rewrite_body_t*);
+
+#endif
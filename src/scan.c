@@ -0,0 +1,377 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file scan.c
+ * @brief Byte scanning kernels shared by the HTTP parsers
+ * @author Mike Mestnik
+ *
+ * A portable version of every kernel, and SSE2/AVX2 ones picked at startup
+ * from what the CPU has.  scan_kernels_get() hands out any of them by name,
+ * for comparing them against each other.
+ */
+
+#include "scan.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+enum
+{
+  SCAN_DELIM = 1, SCAN_INVALID = 2,
+};
+
+static unsigned char scan_class[256];
+
+static inline int
+scan_hex_value (unsigned char c)
+{
+  if ('0' <= c && '9' >= c)
+    return c - '0';
+  c |= 0x20;
+  if ('a' <= c && 'f' >= c)
+    return c - 'a' + 0xa;
+  return -1;
+}
+
+static size_t
+eol_scalar (const char *p, size_t n)
+{
+  const char *nl = memchr (p, '\n', n);
+  return NULL == nl ? n : (size_t) (nl - p);
+}
+
+static size_t
+delim_scalar (const char *p, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (scan_class[(unsigned char) p[i]] & SCAN_DELIM)
+      break;
+  return i;
+}
+
+static size_t
+invalid_scalar (const char *p, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (scan_class[(unsigned char) p[i]] & SCAN_INVALID)
+      break;
+  return i;
+}
+
+static size_t
+dot_o_scalar (const char *p, size_t n)
+{
+  const char *q = p, *e = p + n;
+  while (NULL != (q = memchr (q, '.', e - q)))
+    if (++q == e || 'o' == (*q | 0x20))
+      return q - 1 - p;
+  return n;
+}
+
+static size_t
+hex_scalar (const char *p, size_t n, uint64_t *value)
+{
+  size_t i;
+  int x;
+  *value = 0;
+  for (i = 0; i < n && SCAN_HEX_MAX > i; i++)
+    {
+      if (0 > (x = scan_hex_value (p[i])))
+	break;
+      *value = (*value << 4) | x;
+    }
+  return i;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static inline unsigned
+delim_mask_sse2 (__m128i v)
+{
+  __m128i m;
+  m = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (':')),
+		    _mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n')));
+  return _mm_movemask_epi8 (m);
+}
+
+__attribute__((target("sse2")))
+static inline unsigned
+invalid_mask_sse2 (__m128i v)
+{
+  __m128i ctl, ok;
+  // Unsigned v <= 0x1f.
+  ctl = _mm_cmpeq_epi8 (_mm_min_epu8 (v, _mm_set1_epi8 (0x1f)), v);
+  ok = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')),
+		     _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r')));
+  ok = _mm_or_si128 (ok, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n')));
+  ctl = _mm_andnot_si128 (ok, ctl);
+  ctl = _mm_or_si128 (ctl, _mm_cmpeq_epi8 (v, _mm_set1_epi8 (0x7f)));
+  return _mm_movemask_epi8 (ctl);
+}
+
+__attribute__((target("sse2")))
+static size_t
+eol_sse2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  for (; i + 16 <= n; i += 16)
+    {
+      m = _mm_movemask_epi8 (
+	  _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*) (p + i)),
+			  _mm_set1_epi8 ('\n')));
+      if (m)
+	return i + __builtin_ctz (m);
+    }
+  return i + eol_scalar (p + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static size_t
+delim_sse2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  for (; i + 16 <= n; i += 16)
+    if ((m = delim_mask_sse2 (_mm_loadu_si128 ((const __m128i*) (p + i)))))
+      return i + __builtin_ctz (m);
+  return i + delim_scalar (p + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static size_t
+invalid_sse2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  for (; i + 16 <= n; i += 16)
+    if ((m = invalid_mask_sse2 (_mm_loadu_si128 ((const __m128i*) (p + i)))))
+      return i + __builtin_ctz (m);
+  return i + invalid_scalar (p + i, n - i);
+}
+
+/* A '.' lined up with an 'o' one byte on, so a pair straddling two blocks
+ * is still seen. */
+__attribute__((target("sse2")))
+static size_t
+dot_o_sse2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  __m128i dot, o;
+  for (; i + 17 <= n; i += 16)
+    {
+      dot = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*) (p + i)),
+			    _mm_set1_epi8 ('.'));
+      o = _mm_cmpeq_epi8 (
+	  _mm_or_si128 (_mm_loadu_si128 ((const __m128i*) (p + i + 1)),
+			_mm_set1_epi8 (0x20)),
+	  _mm_set1_epi8 ('o'));
+      if ((m = _mm_movemask_epi8 (_mm_and_si128 (dot, o))))
+	return i + __builtin_ctz (m);
+    }
+  return i + dot_o_scalar (p + i, n - i);
+}
+
+/* All 16 bytes are classified and turned into nibbles at once, then packed
+ * two to a byte, which leaves the digits as a big-endian number. */
+__attribute__((target("sse2")))
+static size_t
+hex_sse2 (const char *p, size_t n, uint64_t *value)
+{
+  __m128i v, digit, alpha, lower, nib, mask;
+  unsigned m;
+  size_t k;
+  uint64_t x;
+  // Short tails aren't worth a bounce buffer.
+  if (16 > n)
+    return hex_scalar (p, n, value);
+  v = _mm_loadu_si128 ((const __m128i*) p);
+  // Signed compares, anything at or above 0x80 is below '0' here.
+  digit = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('0' - 1)),
+			 _mm_cmplt_epi8 (v, _mm_set1_epi8 ('9' + 1)));
+  lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+  alpha = _mm_and_si128 (_mm_cmpgt_epi8 (lower, _mm_set1_epi8 ('a' - 1)),
+			 _mm_cmplt_epi8 (lower, _mm_set1_epi8 ('f' + 1)));
+  m = ~_mm_movemask_epi8 (_mm_or_si128 (digit, alpha)) | 1 << SCAN_HEX_MAX;
+  k = __builtin_ctz (m);
+  *value = 0;
+  if (0 == k)
+    return 0;
+  // '0'-'9' are 0x3X and 'a'-'f' 0x6X, the low nibble plus 9 for letters.
+  nib = _mm_add_epi8 (_mm_and_si128 (v, _mm_set1_epi8 (0x0f)),
+		      _mm_and_si128 (alpha, _mm_set1_epi8 (9)));
+  mask = _mm_cmplt_epi8 (
+      _mm_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+      _mm_set1_epi8 (k));
+  nib = _mm_and_si128 (nib, mask);
+  nib = _mm_and_si128 (
+      _mm_or_si128 (_mm_slli_epi16 (nib, 4), _mm_srli_epi16 (nib, 8)),
+      _mm_set1_epi16 (0xff));
+  _mm_storel_epi64 ((__m128i*) &x, _mm_packus_epi16 (nib, nib));
+  *value = __builtin_bswap64 (x) >> (64 - 4 * k);
+  return k;
+}
+
+__attribute__((target("avx2")))
+static size_t
+eol_avx2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  for (; i + 32 <= n; i += 32)
+    {
+      m = _mm256_movemask_epi8 (
+	  _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (p + i)),
+			     _mm256_set1_epi8 ('\n')));
+      if (m)
+	return i + __builtin_ctz (m);
+    }
+  return i + eol_sse2 (p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+delim_avx2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  __m256i v, r;
+  for (; i + 32 <= n; i += 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i*) (p + i));
+      r = _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (':')),
+			   _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' ')));
+      r = _mm256_or_si256 (r, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t')));
+      r = _mm256_or_si256 (r, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r')));
+      r = _mm256_or_si256 (r, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n')));
+      if ((m = _mm256_movemask_epi8 (r)))
+	return i + __builtin_ctz (m);
+    }
+  return i + delim_sse2 (p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+invalid_avx2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  __m256i v, ctl, ok;
+  for (; i + 32 <= n; i += 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i*) (p + i));
+      ctl = _mm256_cmpeq_epi8 (_mm256_min_epu8 (v, _mm256_set1_epi8 (0x1f)),
+			       v);
+      ok = _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t')),
+			    _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r')));
+      ok = _mm256_or_si256 (ok, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n')));
+      ctl = _mm256_andnot_si256 (ok, ctl);
+      ctl = _mm256_or_si256 (ctl,
+			     _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (0x7f)));
+      if ((m = _mm256_movemask_epi8 (ctl)))
+	return i + __builtin_ctz (m);
+    }
+  return i + invalid_sse2 (p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+dot_o_avx2 (const char *p, size_t n)
+{
+  size_t i = 0;
+  unsigned m;
+  __m256i dot, o;
+  for (; i + 33 <= n; i += 32)
+    {
+      dot = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (p + i)),
+			       _mm256_set1_epi8 ('.'));
+      o = _mm256_cmpeq_epi8 (
+	  _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i*) (p + i + 1)),
+			   _mm256_set1_epi8 (0x20)),
+	  _mm256_set1_epi8 ('o'));
+      if ((m = _mm256_movemask_epi8 (_mm256_and_si256 (dot, o))))
+	return i + __builtin_ctz (m);
+    }
+  return i + dot_o_sse2 (p + i, n - i);
+}
+#endif
+
+static const scan_kernels_t scan_kernels[] =
+  {
+#ifdef SCAN_X86
+	{ "avx2", &eol_avx2, &delim_avx2, &invalid_avx2, &dot_o_avx2, &hex_sse2, },
+	{ "sse2", &eol_sse2, &delim_sse2, &invalid_sse2, &dot_o_sse2, &hex_sse2, },
+#endif
+	{ "scalar", &eol_scalar, &delim_scalar, &invalid_scalar, &dot_o_scalar,
+	    &hex_scalar, }, };
+
+scan_kernels_t scan =
+  { "scalar", &eol_scalar, &delim_scalar, &invalid_scalar, &dot_o_scalar,
+      &hex_scalar, };
+
+static int
+scan_supported (const char *name)
+{
+#ifdef SCAN_X86
+  __builtin_cpu_init ();
+  if (0 == strcmp (name, "avx2"))
+    return __builtin_cpu_supports ("avx2");
+  if (0 == strcmp (name, "sse2"))
+    return __builtin_cpu_supports ("sse2");
+#endif
+  return 0 == strcmp (name, "scalar");
+}
+
+const scan_kernels_t *
+scan_kernels_get (const char *name)
+{
+  for (size_t i = 0; i < sizeof(scan_kernels) / sizeof(scan_kernels[0]); i++)
+    if (0 == strcmp (name, scan_kernels[i].name))
+      return scan_supported (name) ? &scan_kernels[i] : NULL;
+  return NULL;
+}
+
+void
+scan_init ()
+{
+  static const char delim[] = ": \t\r\n";
+  for (int c = 0; c < 256; c++)
+    if ((c < 0x20 && '\t' != c && '\r' != c && '\n' != c) || 0x7f == c)
+      scan_class[c] |= SCAN_INVALID;
+  for (const char *p = delim; *p; p++)
+    scan_class[(unsigned char) *p] |= SCAN_DELIM;
+  // Best first.
+  for (size_t i = 0; i < sizeof(scan_kernels) / sizeof(scan_kernels[0]); i++)
+    if (scan_supported (scan_kernels[i].name))
+      {
+	scan = scan_kernels[i];
+	break;
+      }
+  fprintf (stderr, "Scanning with %s kernels\n", scan.name);
+}
@@ -0,0 +1,58 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_SCAN_H
+#define __TOR2WEB_SCAN_H
+
+/**
+ * @file scan.h
+ * @brief Byte scanning kernels shared by the HTTP parsers
+ * @author Mike Mestnik
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Most hex digits scan.hex() decodes in one call, so the value never wraps.
+#define SCAN_HEX_MAX 15
+
+/* Each kernel returns the offset of the first byte it is looking for, or the
+ * length when there is none. */
+typedef size_t
+(*scan_f) (const char*, size_t);
+/* Decodes the leading hex digits, up to SCAN_HEX_MAX, returning how many. */
+typedef size_t
+(*scan_hex_f) (const char*, size_t, uint64_t*);
+
+typedef struct
+{
+  const char *name;
+  scan_f eol; // '\n'
+  scan_f delim; // ':', ' ', '\t', '\r' or '\n'
+  scan_f invalid; // Control bytes, other than '\t', '\r' and '\n', or DEL.
+  scan_f dot_o; // ".o" or ".O", a '.' ending the input counts.
+  scan_hex_f hex;
+} scan_kernels_t;
+
+extern scan_kernels_t scan;
+
+void
+scan_init ();
+const scan_kernels_t *
+scan_kernels_get (const char*);
+
+#endif
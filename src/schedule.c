@@ -32,6 +32,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
 #include <assert.h>
 
 typedef struct timeval timeval_t;
@@ -160,93 +162,69 @@ schedule_timer (schedule_event_t e, void *d, int *instanceid, int s)
   vector_push_back (*events_h_h, &t);
 }
 
+/* Returns the earliest bucket of events, or NULL when there are none. */
+static hexnode_h
+first_bucket ()
+{
+  hexnode_h b;
+  unsigned char buf[8] =
+    { 0 };
+  hexnode_iterator_set (iterator, 0, buf);
+  // Children come out before their parents, so the first leaf is the least.
+  while (NULL != (b = hexnode_next (iterator)) && hexnode != b)
+    if (8 << 1 == b->depth && NULL != b->data)
+      return b;
+  return NULL;
+}
+
+static void
+delete_bucket (hexnode_h b)
+{
+  vector_destroy (b->data);
+  free (b->data);
+  b->data = NULL;
+  hexnode_delete (hexnode, b->depth, b->node);
+}
+
 void
 process_pending_timers (uint64_t prev, timeval_t *ret, bool *_sleep)
 {
-  hexnode_h last = NULL;
-  unsigned char buf[8];
-  if (prev == time_ptr)
-    return;
-  time_to_chars (buf, prev);
-  hexnode_iterator_set (iterator, 8 << 1, buf);
-  fprintf (stderr, "begin(%d)\n", prev);
-  do
+  hexnode_h b;
+  // Events may schedule more events, so always start over from the least.
+  while (NULL != (b = first_bucket ()))
     {
-      hexnode_h b;
-      uint64_t btime;
-      b = hexnode_next (iterator);
-      if (NULL != last)
-	{
-	  int i;
-	  if (last == b)
-	    { // This is odd!
-	      hexnode_next (iterator);
-	      continue;
-	    }
-
-	  if (NULL != last->data)
-	    {
-	      assert(8 << 1 == last->depth); // If not true then the following is way bad.
-	      vector_destroy (last->data);
-	      free (last->data);
-	      last->data = NULL;
-	    }
-	  fprintf (stderr, "deleting   : %p->%d\n", last, last->depth);
-	  i = hexnode_delete (hexnode, last->depth, last->node);
-
-	  if (NULL == b || hexnode == b)
-	    break; // returns, pushing last oos.
-
-	  last = NULL;
-	  if (0 == i)
-	    {
-	      int ret = hexnode_iterator_set (iterator, b->depth, b->node);
-	      fprintf (stderr, "reset == %d : %p->%d\n", ret, b, b->depth);
-	    }
-	}
-      else if (NULL == b || hexnode == b)
-	break;
-
-      if (8 << 1 != b->depth || NULL == b->data)
-	{
-	  if (hexnode != b)
-	    last = b;
-	  continue;
-	}
-
-      btime = chars_to_time (b->node);
+      uint64_t btime = chars_to_time (b->node);
       if (time_ptr >= btime)
 	{
 	  while (!vector_is_empty (b->data))
 	    {
-	      a_h try = (a_h) vector_get (b->data, 0);
-	      if (NULL == try->instanceid
-		  || try->sequance_num == *try->instanceid)
-		try->e (try->d);
+	      a_t try = VECTOR_GET_AS(a_t, b->data, 0);
 	      vector_pop_front (b->data);
+	      if (NULL == try.instanceid
+		  || try.sequance_num == *try.instanceid)
+		try.e (try.d);
 	    }
+	  delete_bucket (b);
+	  continue;
 	}
-      else
+      while (!vector_is_empty (b->data))
 	{
-	  while (!vector_is_empty (b->data))
-	    {
-	      a_h try = (a_h) vector_get (b->data, 0);
-	      if (try->sequance_num == *try->instanceid)
-		break;
-	      vector_pop_front (b->data);
-	    }
-	  if (!vector_is_empty (b->data))
-	    {
-	      *ret = (timeval_t
-		    )
-		      { btime - time_ptr, 0 };
-	      *_sleep = true;
-	      return;
-	    }
+	  a_h try = (a_h) vector_get (b->data, 0);
+	  if (NULL == try->instanceid || try->sequance_num == *try->instanceid)
+	    break;
+	  vector_pop_front (b->data);
+	}
+      if (vector_is_empty (b->data))
+	{
+	  delete_bucket (b);
+	  continue;
 	}
-      last = b;
+      *ret = (timeval_t
+	    )
+	      { btime - time_ptr, 0 };
+      *_sleep = true;
+      return;
     }
-  while (1);
   *_sleep = false;
 }
 
@@ -254,6 +232,16 @@ process_pending_timers (uint64_t prev, timeval_t *ret, bool *_sleep)
 void __gcov_flush(void);
 #endif
 
+static volatile sig_atomic_t stopping = 0;
+
+/* Safe from a signal handler, schedule_run() returns once the select() it
+ * interrupted does. */
+void
+schedule_stop ()
+{
+  stopping = 1;
+}
+
 void
 schedule_run ()
 {
@@ -261,7 +249,7 @@ schedule_run ()
   uint64_t prev = time_ptr;
   bool _sleep = false;
   timeval_t sleep_time;
-  while (running)
+  while (running && !stopping)
     {
       int nready, i;
       timeval_t timeout = TESTING_TIMEOUT;
@@ -273,7 +261,11 @@ schedule_run ()
       if (-1 == (nready = select (sockets_maxfd, &_read_fdset, &_write_fdset,
       NULL,
 				  (_sleep ? &sleep_time : &timeout))))
-	perror ("select"); // LCOV_EXCL_LINE
+	{
+	  if (EINTR != errno)
+	    perror ("select"); // LCOV_EXCL_LINE
+	  continue;
+	}
       prev = time_ptr;
       set_time_ptr ();
       for (i = 0; i <= sockets_maxfd && nready > 0; i++)
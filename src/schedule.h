@@ -32,5 +32,7 @@ void
 schedule_init ();
 void
 schedule_run ();
+void
+schedule_stop ();
 
 #endif
@@ -31,6 +31,7 @@ typedef struct sendbuf
 {
   size_t len;
   size_t skip;
+  size_t cap; // Room in data, not counting the NUL after it.
   char data[];
 } sendbuf_t;
 
@@ -59,12 +60,19 @@ sendbuf_append (sendbuf_h *b, const void *d, size_t s)
     }
   old_size = (*b)->len - (*b)->skip;
   new_size = old_size + s;
+  if (0 == (*b)->skip && (*b)->cap >= new_size)
+    {
+      memcpy (&(*b)->data[old_size], d, s);
+      (*b)->len = new_size;
+      (*b)->data[new_size] = 0;
+      return;
+    }
   sendbuf_h h = NULL;
   while (NULL == h) // TODO: Block allocations.
     h = malloc (sizeof(sendbuf_t) + new_size + 1);
   *h = (sendbuf_t
 	)
-	  { .len = new_size, .skip = 0, };
+	  { .len = new_size, .skip = 0, .cap = new_size, };
   memcpy (h->data, &(*b)->data[(*b)->skip], old_size);
   memcpy (&h->data[old_size], d, s);
   h->data[new_size] = 0;
@@ -72,6 +80,83 @@ sendbuf_append (sendbuf_h *b, const void *d, size_t s)
   *b = h;
 }
 
+/* Like sendbuf_append() for each slice, but with one allocation. */
+void
+sendbuf_appendv (sendbuf_h *b, const struct iovec *iov, size_t n)
+{
+  size_t old_size = 0, new_size, i;
+  char *p;
+  sendbuf_h h = NULL;
+  if (NULL != *b)
+    old_size = (*b)->len - (*b)->skip;
+  new_size = old_size;
+  for (i = 0; i < n; i++)
+    new_size += iov[i].iov_len;
+  if (new_size == old_size)
+    return;
+  if (NULL != *b && 0 == (*b)->skip && (*b)->cap >= new_size)
+    h = *b;
+  else
+    {
+      while (NULL == h)
+	h = malloc (sizeof(sendbuf_t) + new_size + 1);
+      *h = (sendbuf_t
+	    )
+	      { .len = new_size, .skip = 0, .cap = new_size, };
+      if (NULL != *b)
+	memcpy (h->data, &(*b)->data[(*b)->skip], old_size);
+    }
+  h->len = new_size;
+  p = &h->data[old_size];
+  for (i = 0; i < n; i++)
+    {
+      memcpy (p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+    }
+  h->data[new_size] = 0;
+  if (h != *b)
+    free (*b);
+  *b = h;
+}
+
+/* Moves b to room for cap bytes. */
+static void
+sendbuf_move (sendbuf_h *b, size_t cap)
+{
+  size_t len = get_sendbuf_size (*b);
+  sendbuf_h h = NULL;
+  while (NULL == h)
+    h = malloc (sizeof(sendbuf_t) + cap + 1);
+  *h = (sendbuf_t
+	)
+	  { .len = len, .skip = 0, .cap = cap, };
+  if (NULL != *b)
+    memcpy (h->data, &(*b)->data[(*b)->skip], len);
+  h->data[len] = 0;
+  free (*b);
+  *b = h;
+}
+
+/* Makes room for s more bytes, at least doubling, so a buffer filled a
+ * read at a time is only copied a logarithmic number of times. */
+void
+sendbuf_reserve (sendbuf_h *b, size_t s)
+{
+  size_t len = get_sendbuf_size (*b);
+  if (0 == s || (NULL != *b && 0 == (*b)->skip && (*b)->cap >= len + s))
+    return;
+  sendbuf_move (b, len + (len > s ? len : s));
+}
+
+/* Gives back the room sendbuf_reserve() left over, for a buffer that is
+ * kept. */
+void
+sendbuf_trim (sendbuf_h *b)
+{
+  if (NULL != *b && (0 != (*b)->skip || (*b)->cap > (*b)->len))
+    sendbuf_move (b, get_sendbuf_size (*b));
+}
+
 void
 sendbuf_send (void *closure, sendbuf_h *b, sendbuf_send_func_f f)
 {
@@ -25,12 +25,19 @@
  */
 
 #include <glob.h>
+#include <sys/uio.h>
 
 typedef struct sendbuf *sendbuf_h;
 sendbuf_h
 sendbuf_new (const void*, size_t);
 void
 sendbuf_append (sendbuf_h*, const void*, size_t);
+void
+sendbuf_appendv (sendbuf_h*, const struct iovec*, size_t);
+void
+sendbuf_reserve (sendbuf_h*, size_t);
+void
+sendbuf_trim (sendbuf_h*);
 typedef size_t
 (*sendbuf_send_func_f) (void*, const void*, size_t);
 void
@@ -0,0 +1,358 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file snapshot.c
+ * @brief Warm state kept across restarts
+ * @author Mike Mestnik
+ *
+ * What the gateway learned while running is written to CONF.snapshot every
+ * CONF.snapshot_interval seconds and once more on the way out, SIGTERM and
+ * SIGINT stop the event loop for that.  The file is a snapshot_header_t
+ * followed by one snapshot_section_t and its payload for each module that
+ * keeps something, and is replaced by rename so a crash leaves the last
+ * whole one behind.
+ *
+ * At startup the file is mapped, not read, and each module finds its own
+ * section in the mapping as it starts, the disk tier its index, the memory
+ * cache which responses it held and the heavy hitters their counters.
+ * Nothing in it is trusted further than it can be checked against what it
+ * describes.  The mapping is dropped once the first new snapshot is taken.
+ *
+ * The snapshot is put together on the event loop, which only takes walking
+ * the indexes, and written out on a worker thread.
+ */
+
+#include "snapshot.h"
+#include "disk.h"
+#include "cache.h"
+#include "hitters.h"
+#include "sendbuf.h"
+#include "schedule.h"
+#include "workqueue.h"
+#include "stats.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC 0x53573254 // "T2WS" on little endian.
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 8
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t len; // Of the whole file.
+  int64_t written;
+} snapshot_header_t;
+
+typedef struct
+{
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t len; // Of the payload, the next section starts aligned after it.
+} snapshot_section_t;
+
+typedef void
+(*snapshot_save_f) (sendbuf_h*);
+
+static const struct
+{
+  snapshot_type_t type;
+  snapshot_save_f save;
+} savers[] =
+  {
+    { SNAPSHOT_DISK, &disk_snapshot },
+    { SNAPSHOT_CACHE, &cache_snapshot },
+    { SNAPSHOT_HITTERS, &hitters_snapshot }, };
+
+typedef struct
+{
+  char *tmp;
+  sendbuf_h buf;
+  bool ok;
+} snapshot_write_t;
+
+static const unsigned char *loaded = NULL;
+static size_t loaded_len = 0;
+static workqueue_h writer = NULL;
+static bool writing = false;
+static int snapshot_instanceid;
+static pthread_t event_loop;
+
+static size_t
+snapshot_align (size_t len)
+{
+  return (len + SNAPSHOT_ALIGN - 1) & ~(size_t) (SNAPSHOT_ALIGN - 1);
+}
+
+/* The payload of the section of type in the snapshot found at startup,
+ * NULL when there is none. */
+const void *
+snapshot_section (snapshot_type_t type, size_t *len)
+{
+  size_t offset = sizeof(snapshot_header_t);
+  while (NULL != loaded && offset + sizeof(snapshot_section_t) <= loaded_len)
+    {
+      const snapshot_section_t *s = (const snapshot_section_t*) (loaded
+	  + offset);
+      offset += sizeof(*s);
+      if (loaded_len - offset < s->len)
+	break;
+      if (type == s->type)
+	{
+	  *len = s->len;
+	  return loaded + offset;
+	}
+      offset += snapshot_align (s->len);
+    }
+  return NULL;
+}
+
+static void
+snapshot_unload ()
+{
+  if (NULL == loaded)
+    return;
+  munmap ((void*) loaded, loaded_len);
+  loaded = NULL;
+}
+
+static sendbuf_h
+snapshot_build ()
+{
+  static const char pad[SNAPSHOT_ALIGN];
+  snapshot_header_t hdr =
+    { .magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .len = 0,
+	.written = time (NULL), };
+  sendbuf_h buf = NULL, file = NULL;
+  struct iovec iov[3];
+  size_t i;
+  for (i = 0; i < sizeof(savers) / sizeof(savers[0]); i++)
+    {
+      sendbuf_h payload = NULL;
+      snapshot_section_t s =
+	{ .type = savers[i].type, .reserved = 0, .len = 0, };
+      savers[i].save (&payload);
+      s.len = get_sendbuf_size (payload);
+      iov[0] = (struct iovec
+	    )
+	      { .iov_base = &s, .iov_len = sizeof(s), };
+      iov[1] = (struct iovec
+	    )
+	      { .iov_base = (void*) get_sendbuf_buf (payload), .iov_len = s.len, };
+      iov[2] = (struct iovec
+	    )
+	      { .iov_base = (void*) pad, .iov_len = snapshot_align (s.len)
+		  - s.len, };
+      sendbuf_appendv (&buf, iov, 3);
+      sendbuf_clear (&payload);
+    }
+  hdr.len = sizeof(hdr) + get_sendbuf_size (buf);
+  iov[0] = (struct iovec
+	)
+	  { .iov_base = &hdr, .iov_len = sizeof(hdr), };
+  iov[1] = (struct iovec
+	)
+	  { .iov_base = (void*) get_sendbuf_buf (buf), .iov_len =
+	      get_sendbuf_size (buf), };
+  sendbuf_appendv (&file, iov, 2);
+  sendbuf_clear (&buf);
+  return file;
+}
+
+/* Written next to CONF.snapshot under tmp, then moved over it. */
+static bool
+snapshot_save (const char *tmp, sendbuf_h buf)
+{
+  const char *b = get_sendbuf_buf (buf);
+  size_t done = 0, len = get_sendbuf_size (buf);
+  ssize_t ret;
+  int fd;
+  if (-1 == (fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)))
+    {
+      perror ("snapshot_save: open");
+      return false;
+    }
+  while (done < len)
+    {
+      ret = write (fd, b + done, len - done);
+      if (-1 == ret && EINTR == errno)
+	continue;
+      if (0 >= ret)
+	{
+	  perror ("snapshot_save: write");
+	  close (fd);
+	  unlink (tmp);
+	  return false;
+	}
+      done += ret;
+    }
+  // The rename must not reach the disk before what it points at.
+  if (0 != fsync (fd))
+    perror ("snapshot_save: fsync"); // LCOV_EXCL_LINE
+  close (fd);
+  if (0 != rename (tmp, CONF.snapshot))
+    {
+      perror ("snapshot_save: rename"); // LCOV_EXCL_LINE
+      return false; // LCOV_EXCL_LINE
+    }
+  return true;
+}
+
+static char *
+snapshot_tmp (const char *suffix)
+{
+  char *tmp = NULL;
+  while (NULL == tmp)
+    tmp = malloc (strlen (CONF.snapshot) + strlen (suffix) + 1);
+  sprintf (tmp, "%s%s", CONF.snapshot, suffix);
+  return tmp;
+}
+
+static void
+write_job (void *c)
+{
+  snapshot_write_t *w = c;
+  w->ok = snapshot_save (w->tmp, w->buf);
+}
+
+static void
+write_done (void *c)
+{
+  snapshot_write_t *w = c;
+  if (w->ok)
+    stats_inc (STATS_SNAPSHOT_WRITES);
+  writing = false;
+  sendbuf_clear (&w->buf);
+  free (w->tmp);
+  free (w);
+}
+
+static void
+schedule_event (void *c)
+{
+  snapshot_write_t *w = NULL;
+  schedule_timer (&schedule_event, NULL, &snapshot_instanceid,
+		  CONF.snapshot_interval);
+  // The last one is still being written, this one can wait its turn.
+  if (writing)
+    return;
+  snapshot_unload ();
+  while (NULL == w)
+    w = malloc (sizeof(snapshot_write_t));
+  *w = (snapshot_write_t
+	)
+	  { .tmp = snapshot_tmp (".tmp"), .buf = snapshot_build (), .ok =
+	  false, };
+  writing = true;
+  if (!workqueue_submit (writer, &write_job, &write_done, w))
+    {
+      write_job (w); // LCOV_EXCL_LINE
+      write_done (w); // LCOV_EXCL_LINE
+    }
+}
+
+static void
+snapshot_signal (int sig)
+{
+  // Only the event loop's thread being interrupted wakes its select().
+  if (!pthread_equal (pthread_self (), event_loop))
+    {
+      pthread_kill (event_loop, sig);
+      return;
+    }
+  schedule_stop ();
+}
+
+void
+snapshot_init ()
+{
+  const snapshot_header_t *hdr;
+  struct sigaction sa;
+  struct stat st;
+  void *map;
+  int fd;
+  if (NULL == CONF.snapshot)
+    return;
+  event_loop = pthread_self ();
+  memset (&sa, 0, sizeof(sa));
+  sa.sa_handler = &snapshot_signal;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGINT, &sa, NULL);
+  writer = workqueue_new (1, 1);
+  if (0 < CONF.snapshot_interval)
+    schedule_timer (&schedule_event, NULL, &snapshot_instanceid,
+		    CONF.snapshot_interval);
+  if (-1 == (fd = open (CONF.snapshot, O_RDONLY | O_CLOEXEC)))
+    {
+      if (ENOENT != errno)
+	perror ("snapshot_init: open");
+      return;
+    }
+  if (-1 == fstat (fd, &st) || sizeof(*hdr) > (size_t) st.st_size
+      || MAP_FAILED
+	  == (map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)))
+    {
+      close (fd);
+      return;
+    }
+  close (fd);
+  hdr = map;
+  if (SNAPSHOT_MAGIC != hdr->magic || SNAPSHOT_VERSION != hdr->version
+      || (uint64_t) st.st_size != hdr->len)
+    {
+      fprintf (stderr, "Ignoring snapshot %s\n", CONF.snapshot);
+      munmap (map, st.st_size);
+      return;
+    }
+  loaded = map;
+  loaded_len = st.st_size;
+}
+
+/* The event loop is done, what it learned is written before leaving. */
+void
+snapshot_exit ()
+{
+  sendbuf_h buf;
+  char *tmp;
+  if (NULL == CONF.snapshot)
+    return;
+  // A periodic one still being written would land on top of this one.
+  workqueue_drain (writer);
+  snapshot_unload ();
+  buf = snapshot_build ();
+  tmp = snapshot_tmp (".tmp");
+  if (snapshot_save (tmp, buf))
+    stats_inc (STATS_SNAPSHOT_WRITES);
+  sendbuf_clear (&buf);
+  free (tmp);
+}
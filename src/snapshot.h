@@ -0,0 +1,43 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_SNAPSHOT_H
+#define __TOR2WEB_SNAPSHOT_H
+
+/**
+ * @file snapshot.h
+ * @brief Warm state kept across restarts
+ * @author Mike Mestnik
+ */
+
+#include <stddef.h>
+
+typedef enum
+{
+  SNAPSHOT_DISK = 1,
+  SNAPSHOT_CACHE,
+  SNAPSHOT_HITTERS,
+} snapshot_type_t;
+
+void
+snapshot_init ();
+const void *
+snapshot_section (snapshot_type_t, size_t*);
+void
+snapshot_exit ();
+
+#endif
@@ -32,6 +32,10 @@
 #include <assert.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/un.h>
 
 int sockets_maxfd = 3;
 fd_set sockets_read_fdset;
@@ -150,6 +154,76 @@ sockets_connect_socks ()
   return &fd_closures[fd];
 }
 
+/* "/path" for a unix socket, otherwise "host:port" or "[v6]:port". */
+bool
+sockets_addr (const char *name, struct sockaddr_storage *addr, socklen_t *len)
+{
+  struct addrinfo hints =
+    { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, }, *res;
+  char *host = NULL, *port;
+  int ret;
+  memset (addr, 0, sizeof(*addr));
+  if ('/' == name[0])
+    {
+      struct sockaddr_un *un = (struct sockaddr_un*) addr;
+      if (sizeof(un->sun_path) <= strlen (name))
+	return false;
+      un->sun_family = AF_UNIX;
+      strcpy (un->sun_path, name);
+      *len = sizeof(*un);
+      return true;
+    }
+  while (NULL == host)
+    host = strdup (name);
+  if (NULL == (port = strrchr (host, ':')))
+    {
+      free (host);
+      return false;
+    }
+  *port++ = '\0';
+  if ('[' == host[0] && ']' == port[-2])
+    {
+      port[-2] = '\0';
+      memmove (host, host + 1, strlen (host));
+    }
+  if (0 != (ret = getaddrinfo (host, port, &hints, &res)))
+    {
+      fprintf (stderr, "%s: %s\n", name, gai_strerror (ret));
+      free (host);
+      return false;
+    }
+  memcpy (addr, res->ai_addr, res->ai_addrlen);
+  *len = res->ai_addrlen;
+  freeaddrinfo (res);
+  free (host);
+  return true;
+}
+
+/* Adds an fd some other module created, such as an eventfd. */
+fd_closure_h
+sockets_watch (int fd, fd_can_f can, void *closure)
+{
+  assert(FD_SETSIZE > fd);
+  init_new_fd (fd);
+  fd_closures[fd].can = can;
+  fd_closures[fd].closure = closure;
+  return &fd_closures[fd];
+}
+
+/* Stop select()ing on the fd while another thread owns it. */
+void
+sockets_pause (fd_closure_h h)
+{
+  FD_CLR(h->fd, &sockets_read_fdset);
+  FD_CLR(h->fd, &WRITE_FDSET);
+}
+
+void
+sockets_resume (fd_closure_h h)
+{
+  FD_SET(h->fd, &sockets_read_fdset);
+}
+
 void
 sockets_close (fd_closure_h h)
 {
@@ -52,6 +52,14 @@ void
 sockets_create_listener (const struct sockaddr*, socklen_t);
 fd_closure_h
 sockets_connect_socks ();
+bool
+sockets_addr (const char*, struct sockaddr_storage*, socklen_t*);
+fd_closure_h
+sockets_watch (int, fd_can_f, void *);
+void
+sockets_pause (fd_closure_h);
+void
+sockets_resume (fd_closure_h);
 void
 sockets_close (fd_closure_h);
 void
@@ -0,0 +1,118 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stats.c
+ * @brief Periodically write counters where operators can read them
+ * @author Mike Mestnik
+ */
+
+#include "stats.h"
+#include "conf.h"
+#include "schedule.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned long long stats_counters[STATS_MAX];
+
+static const char *stats_names[STATS_MAX] =
+  { "tls_handshakes", "tls_resumed", "tls_early_data",
+      "h2_sessions", "h2_streams", "compressed", "compress_variant_hits",
+      "cache_lookups", "cache_hits", "cache_stores", "cache_evictions",
+      "disk_hits", "disk_writes", "disk_drops", "coalesced", "cache_stale", "cache_stale_if_error",
+      "cache_refreshes", "cache_refreshed", "cache_shared",
+      "cache_shared_bytes", "peer_asks", "peer_hits", "peer_served",
+      "peer_stores", "snapshot_writes", "snapshot_restored",
+      "prewarm_opened", "prewarm_used", "control_fetches",
+      "control_received", "control_failed", };
+
+/* Rates are computed here so every consumer agrees on the definition. */
+static const struct
+{
+  const char *n;
+  stats_counter_t num;
+  stats_counter_t den;
+} stats_ratios[] =
+  {
+    { "tls_resumption_rate", STATS_TLS_RESUMED, STATS_TLS_HANDSHAKES },
+    { "tls_early_data_rate", STATS_TLS_EARLY_DATA, STATS_TLS_RESUMED },
+    { "h2_streams_per_session", STATS_H2_STREAMS, STATS_H2_SESSIONS },
+    { "compress_variant_hit_rate", STATS_COMPRESS_VARIANT_HITS,
+	STATS_COMPRESSED },
+    { "cache_hit_rate", STATS_CACHE_HITS, STATS_CACHE_LOOKUPS },
+    { "disk_hit_rate", STATS_DISK_HITS, STATS_CACHE_LOOKUPS },
+    { "coalesced_rate", STATS_COALESCED, STATS_CACHE_LOOKUPS },
+    { "cache_refresh_rate", STATS_CACHE_REFRESHED, STATS_CACHE_REFRESHES },
+    { "peer_hit_rate", STATS_PEER_HITS, STATS_PEER_ASKS },
+    { "prewarm_use_rate", STATS_PREWARM_USED, STATS_PREWARM_OPENED }, };
+
+static int stats_instanceid;
+
+void
+stats_dump ()
+{
+  FILE *f;
+  char *tmp = NULL;
+  size_t i;
+  if (NULL == CONF.statsfile)
+    return;
+  while (NULL == tmp)
+    tmp = malloc (strlen (CONF.statsfile) + 5);
+  sprintf (tmp, "%s.tmp", CONF.statsfile);
+  if (NULL == (f = fopen (tmp, "w")))
+    {
+      // LCOV_EXCL_START
+      perror ("stats_dump: fopen");
+      free (tmp);
+      return;
+      // LCOV_EXCL_STOP
+    }
+  for (i = 0; i < STATS_MAX; i++)
+    fprintf (f, "%s %llu\n", stats_names[i], stats_counters[i]);
+  for (i = 0; i < sizeof(stats_ratios) / sizeof(stats_ratios[0]); i++)
+    {
+      unsigned long long den = stats_counters[stats_ratios[i].den];
+      fprintf (f, "%s %.4f\n", stats_ratios[i].n,
+	       0 == den ?
+		   0.0 : (double) stats_counters[stats_ratios[i].num] / den);
+    }
+  fclose (f);
+  // Readers never see a half written file.
+  if (0 != rename (tmp, CONF.statsfile))
+    perror ("stats_dump: rename"); // LCOV_EXCL_LINE
+  free (tmp);
+}
+
+static void
+schedule_event (void *c)
+{
+  stats_dump ();
+  schedule_timer (&schedule_event, NULL, &stats_instanceid,
+		  CONF.stats_interval);
+}
+
+void
+stats_init ()
+{
+  memset (stats_counters, 0, sizeof(stats_counters));
+  if (NULL == CONF.statsfile || 0 >= CONF.stats_interval)
+    return;
+  schedule_timer (&schedule_event, NULL, &stats_instanceid,
+		  CONF.stats_interval);
+}
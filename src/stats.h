@@ -0,0 +1,83 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_STATS_H
+#define __TOR2WEB_STATS_H
+
+/**
+ * @file stats.h
+ * @brief Counters exported to operators
+ * @author Mike Mestnik
+ */
+
+typedef enum
+{
+  STATS_TLS_HANDSHAKES,
+  STATS_TLS_RESUMED,
+  STATS_TLS_EARLY_DATA,
+  STATS_H2_SESSIONS,
+  STATS_H2_STREAMS,
+  STATS_COMPRESSED,
+  STATS_COMPRESS_VARIANT_HITS,
+  STATS_CACHE_LOOKUPS,
+  STATS_CACHE_HITS,
+  STATS_CACHE_STORES,
+  STATS_CACHE_EVICTIONS,
+  STATS_DISK_HITS,
+  STATS_DISK_WRITES,
+  STATS_DISK_DROPS,
+  STATS_COALESCED,
+  STATS_CACHE_STALE,
+  STATS_CACHE_STALE_IF_ERROR,
+  STATS_CACHE_REFRESHES,
+  STATS_CACHE_REFRESHED,
+  STATS_CACHE_SHARED,
+  STATS_CACHE_SHARED_BYTES,
+  STATS_PEER_ASKS,
+  STATS_PEER_HITS,
+  STATS_PEER_SERVED,
+  STATS_PEER_STORES,
+  STATS_SNAPSHOT_WRITES,
+  STATS_SNAPSHOT_RESTORED,
+  STATS_PREWARM_OPENED,
+  STATS_PREWARM_USED,
+  STATS_CONTROL_FETCHES,
+  STATS_CONTROL_RECEIVED,
+  STATS_CONTROL_FAILED,
+  STATS_MAX
+} stats_counter_t;
+
+extern unsigned long long stats_counters[STATS_MAX];
+
+static inline void
+stats_inc (stats_counter_t c)
+{
+  ++stats_counters[c];
+}
+
+static inline void
+stats_add (stats_counter_t c, unsigned long long n)
+{
+  stats_counters[c] += n;
+}
+
+void
+stats_init ();
+void
+stats_dump ();
+
+#endif
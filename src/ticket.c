@@ -0,0 +1,128 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file ticket.c
+ * @brief Session ticket keys, shared with other processes by file
+ * @author Mike Mestnik
+ *
+ * Every process pointed at the same ssl_ticket_key file encrypts tickets
+ * with the same master key, so a visitor can resume against any of them
+ * and against a restarted binary.  GnuTLS derives the keys it encrypts with
+ * from the master key, a new one every ssl_ticket_rotate seconds, and still
+ * takes the one before, so no ticket stops working before it expires.  The
+ * master key itself stays, replacing it would cut off every ticket at once
+ * and send every returning visitor through a full handshake together.
+ */
+
+#include "ticket.h"
+#include "conf.h"
+#include "schedule.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+static gnutls_datum_t key =
+  { NULL, 0 };
+static int ticket_instanceid;
+
+/* Returns the age of the file in seconds, or -1 if it can't be used. */
+static time_t
+ticket_read (gnutls_datum_t *out)
+{
+  struct stat st;
+  ssize_t ret;
+  int fd;
+  if (-1 == (fd = open (CONF.ssl_ticket_key, O_RDONLY)))
+    return -1;
+  if (-1 == fstat (fd, &st) || st.st_size != out->size)
+    {
+      close (fd);
+      return -1;
+    }
+  ret = read (fd, out->data, out->size);
+  close (fd);
+  if (ret != out->size)
+    return -1;
+  return time (NULL) - st.st_mtime;
+}
+
+static void
+ticket_write ()
+{
+  char *tmp = NULL;
+  int fd;
+  while (NULL == tmp)
+    tmp = malloc (strlen (CONF.ssl_ticket_key) + 16);
+  sprintf (tmp, "%s.%d", CONF.ssl_ticket_key, (int) getpid ());
+  if (-1 == (fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)))
+    {
+      // LCOV_EXCL_START
+      perror ("ticket_write: open");
+      free (tmp);
+      return;
+      // LCOV_EXCL_STOP
+    }
+  if (key.size != write (fd, key.data, key.size))
+    perror ("ticket_write: write"); // LCOV_EXCL_LINE
+  close (fd);
+  // Processes that start together each write one, the last rename wins and
+  // the others adopt it on their next look.
+  if (0 != rename (tmp, CONF.ssl_ticket_key))
+    perror ("ticket_write: rename"); // LCOV_EXCL_LINE
+  free (tmp);
+}
+
+static void
+schedule_event (void *c)
+{
+  unsigned char buf[key.size];
+  gnutls_datum_t disk =
+    { buf, key.size };
+  if (0 > ticket_read (&disk))
+    ticket_write ();
+  // Another process got there first, or the file was replaced by hand.
+  else if (0 != memcmp (buf, key.data, key.size))
+    memcpy (key.data, buf, key.size);
+  gnutls_memset (buf, 0, sizeof(buf));
+  schedule_timer (&schedule_event, NULL, &ticket_instanceid, 60);
+}
+
+void
+ticket_init ()
+{
+  while (0 != gnutls_session_ticket_key_generate (&key))
+    ;
+  if (NULL == CONF.ssl_ticket_key)
+    return;
+  if (0 > ticket_read (&key))
+    ticket_write ();
+  schedule_timer (&schedule_event, NULL, &ticket_instanceid, 1);
+}
+
+/* Tickets for session, under keys that turn over every ssl_ticket_rotate
+ * seconds. */
+void
+ticket_session (gnutls_session_t session)
+{
+  gnutls_session_ticket_enable_server (session, &key);
+  if (0 < CONF.ssl_ticket_rotate)
+    gnutls_db_set_cache_expiration (session, CONF.ssl_ticket_rotate);
+}
@@ -28,6 +28,16 @@
 #include "sockets.h"
 #include "http.h"
 #include "schedule.h"
+#include "stats.h"
+#include "scan.h"
+#include "rewrite.h"
+#include "variant.h"
+#include "cache.h"
+#include "disk.h"
+#include "peer.h"
+#include "snapshot.h"
+#include "hitters.h"
+#include "control.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -60,16 +70,29 @@ main (int argc, char *argv[])
 {
   int ret;
   globals_init ();
+  scan_init ();
   http_init ();
   ret = conf_init (argc, argv);
   if (ret != 0)
     return ret;
+  rewrite_init ();
+  variant_init ();
+  cache_init ();
   write_pid ();
-  _gnutls_init ();
-  sockets_init ();
   schedule_init ();
+  stats_init ();
+  sockets_init ();
+  snapshot_init ();
+  disk_init ();
+  cache_restore ();
+  hitters_init ();
+  http_prewarm_init ();
+  control_init ();
+  peer_init ();
+  _gnutls_init ();
   sockets_create_listener ((void *) &CONF.listen_ipv4,
 			   sizeof(CONF.listen_ipv4));
   schedule_run ();
+  snapshot_exit ();
   return 0;
 }
@@ -0,0 +1,190 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file variant.c
+ * @brief Compressed bodies kept by validator
+ * @author Mike Mestnik
+ *
+ * The upstream is still asked every time, but when it answers with the
+ * ETag or Last-Modified of a body already compressed for that URL the
+ * stored copy goes out instead of compressing again.  Entries are found by
+ * a digest of onion, target and coding, and evicted least recently used
+ * once CONF.compress_cache_size bytes are held.
+ */
+
+#include "variant.h"
+#include "hextree.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#define VARIANT_KEY 32
+
+typedef struct variant
+{
+  hexnode_h node;
+  variant_h prev; // Towards the most recently used.
+  variant_h next;
+  char *validator;
+  sendbuf_h body;
+} variant_t;
+
+static hexnode_h hexnode;
+static variant_h head, tail;
+static size_t size;
+
+void
+variant_init ()
+{
+  hexnode = hexnode_new (0, NULL);
+}
+
+static bool
+variant_key (const char *hostname, const char *target, codec_type_t coding,
+	     unsigned char key[VARIANT_KEY])
+{
+  gnutls_hash_hd_t hd;
+  unsigned char c = coding;
+  if (0 > gnutls_hash_init (&hd, GNUTLS_DIG_SHA256))
+    return false; // LCOV_EXCL_LINE
+  // With the NULs, no two host and target pairs hash the same bytes.
+  gnutls_hash (hd, hostname, strlen (hostname) + 1);
+  gnutls_hash (hd, target, strlen (target) + 1);
+  gnutls_hash (hd, &c, 1);
+  gnutls_hash_deinit (hd, key);
+  return true;
+}
+
+static size_t
+variant_size (variant_h v)
+{
+  return sizeof(variant_t) + strlen (v->validator)
+      + get_sendbuf_size (v->body);
+}
+
+static void
+variant_unlink (variant_h v)
+{
+  if (NULL != v->prev)
+    v->prev->next = v->next;
+  else
+    head = v->next;
+  if (NULL != v->next)
+    v->next->prev = v->prev;
+  else
+    tail = v->prev;
+  v->prev = v->next = NULL;
+}
+
+static void
+variant_push (variant_h v)
+{
+  v->next = head;
+  if (NULL != head)
+    head->prev = v;
+  head = v;
+  if (NULL == tail)
+    tail = v;
+}
+
+static void
+variant_delete (variant_h v)
+{
+  variant_unlink (v);
+  size -= variant_size (v);
+  v->node->data = NULL;
+  hexnode_delete (hexnode, v->node->depth, v->node->node);
+  free (v->validator);
+  sendbuf_clear (&v->body);
+  free (v);
+}
+
+/* Only a copy with the same validator is any good. */
+variant_h
+variant_find (const char *hostname, const char *target, codec_type_t coding,
+	      const char *validator)
+{
+  unsigned char key[VARIANT_KEY];
+  hexnode_h node;
+  variant_h v;
+  if (0 >= CONF.compress_cache_size
+      || !variant_key (hostname, target, coding, key))
+    return NULL;
+  node = hexnode_lookup (hexnode, VARIANT_KEY, key, false);
+  if (NULL == node || NULL == (v = node->data))
+    return NULL;
+  if (0 != strcmp (v->validator, validator))
+    {
+      // The onion changed it, this copy will never be asked for again.
+      variant_delete (v);
+      return NULL;
+    }
+  variant_unlink (v);
+  variant_push (v);
+  return v;
+}
+
+const void *
+get_variant_buf (variant_h v)
+{
+  return get_sendbuf_buf (v->body);
+}
+
+size_t
+get_variant_size (variant_h v)
+{
+  return get_sendbuf_size (v->body);
+}
+
+/* Takes over *body. */
+void
+variant_store (const char *hostname, const char *target, codec_type_t coding,
+	       const char *validator, sendbuf_h *body)
+{
+  unsigned char key[VARIANT_KEY];
+  hexnode_h node;
+  variant_h v = NULL;
+  if (!variant_key (hostname, target, coding, key))
+    {
+      sendbuf_clear (body); // LCOV_EXCL_LINE
+      return; // LCOV_EXCL_LINE
+    }
+  node = hexnode_lookup (hexnode, VARIANT_KEY, key, true);
+  if (NULL != node->data)
+    variant_delete (node->data);
+  // The delete may have taken the node with it.
+  node = hexnode_lookup (hexnode, VARIANT_KEY, key, true);
+  while (NULL == v)
+    v = malloc (sizeof(variant_t));
+  *v = (variant_t
+	)
+	  { .node = node, .prev = NULL, .next = NULL, .validator = NULL,
+	      .body = *body, };
+  *body = NULL;
+  while (NULL == v->validator)
+    v->validator = strdup (validator);
+  node->data = v;
+  variant_push (v);
+  size += variant_size (v);
+  while ((size_t) CONF.compress_cache_size < size && NULL != tail)
+    variant_delete (tail);
+}
@@ -0,0 +1,44 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_VARIANT_H
+#define __TOR2WEB_VARIANT_H
+
+/**
+ * @file variant.h
+ * @brief Compressed bodies kept by validator
+ * @author Mike Mestnik
+ */
+
+#include "codec.h"
+#include "sendbuf.h"
+
+typedef struct variant *variant_h;
+
+void
+variant_init ();
+variant_h
+variant_find (const char*, const char*, codec_type_t, const char*);
+const void *
+get_variant_buf (variant_h);
+size_t
+get_variant_size (variant_h);
+void
+variant_store (const char*, const char*, codec_type_t, const char*,
+	       sendbuf_h*);
+
+#endif
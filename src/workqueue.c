@@ -0,0 +1,248 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file workqueue.c
+ * @brief Run jobs on worker threads, finish them on the event loop
+ * @author Mike Mestnik
+ *
+ * Jobs are handed to the workers and back through bounded lock-free rings.
+ * Only the event loop submits and only it drains finished jobs, woken by an
+ * eventfd that sits in the select set like any other socket.  At most
+ * depth jobs are out at once, so the ring of finished jobs never fills.
+ */
+
+#include "workqueue.h"
+#include "sockets.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+typedef struct
+{
+  workqueue_f job;
+  workqueue_f done;
+  void *closure;
+} workqueue_job_t;
+
+typedef struct
+{
+  atomic_size_t seq;
+  workqueue_job_t job;
+} cell_t;
+
+typedef struct
+{
+  cell_t *cells;
+  size_t mask;
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+} ring_t;
+
+typedef struct workqueue
+{
+  ring_t todo;
+  ring_t done;
+  sem_t sem;
+  int efd;
+  size_t depth;
+  size_t outstanding;
+} workqueue_t;
+
+static void
+ring_init (ring_t *r, size_t depth)
+{
+  size_t i;
+  r->cells = NULL;
+  while (NULL == r->cells)
+    r->cells = malloc (depth * sizeof(cell_t));
+  for (i = 0; i < depth; i++)
+    atomic_init(&r->cells[i].seq, i);
+  r->mask = depth - 1;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+}
+
+static bool
+ring_push (ring_t *r, const workqueue_job_t *job)
+{
+  cell_t *cell;
+  size_t pos = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  while (1)
+    {
+      intptr_t dif;
+      cell = &r->cells[pos & r->mask];
+      dif = (intptr_t) atomic_load_explicit (&cell->seq,
+					     memory_order_acquire)
+	  - (intptr_t) pos;
+      if (0 == dif)
+	{
+	  if (atomic_compare_exchange_weak_explicit (&r->tail, &pos, pos + 1,
+						     memory_order_relaxed,
+						     memory_order_relaxed))
+	    break;
+	}
+      else if (0 > dif)
+	return false;
+      else
+	pos = atomic_load_explicit (&r->tail, memory_order_relaxed);
+    }
+  cell->job = *job;
+  atomic_store_explicit (&cell->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+static bool
+ring_pop (ring_t *r, workqueue_job_t *job)
+{
+  cell_t *cell;
+  size_t pos = atomic_load_explicit (&r->head, memory_order_relaxed);
+  while (1)
+    {
+      intptr_t dif;
+      cell = &r->cells[pos & r->mask];
+      dif = (intptr_t) atomic_load_explicit (&cell->seq,
+					     memory_order_acquire)
+	  - (intptr_t) (pos + 1);
+      if (0 == dif)
+	{
+	  if (atomic_compare_exchange_weak_explicit (&r->head, &pos, pos + 1,
+						     memory_order_relaxed,
+						     memory_order_relaxed))
+	    break;
+	}
+      else if (0 > dif)
+	return false;
+      else
+	pos = atomic_load_explicit (&r->head, memory_order_relaxed);
+    }
+  *job = cell->job;
+  atomic_store_explicit (&cell->seq, pos + r->mask + 1, memory_order_release);
+  return true;
+}
+
+static void *
+worker (void *c)
+{
+  workqueue_h h = c;
+  while (1)
+    {
+      workqueue_job_t job;
+      uint64_t one = 1;
+      if (0 != sem_wait (&h->sem) || !ring_pop (&h->todo, &job))
+	continue;
+      job.job (job.closure);
+      while (!ring_push (&h->done, &job))
+	; // LCOV_EXCL_LINE
+      if (sizeof(one) != write (h->efd, &one, sizeof(one)))
+	perror ("workqueue write eventfd"); // LCOV_EXCL_LINE
+    }
+  return NULL;
+}
+
+static void
+workqueue_reap (workqueue_h h)
+{
+  workqueue_job_t job;
+  uint64_t count;
+  if (-1 == read (h->efd, &count, sizeof(count)))
+    return;
+  while (ring_pop (&h->done, &job))
+    {
+      h->outstanding--;
+      job.done (job.closure);
+    }
+}
+
+static void
+workqueue_can (fd_closure_h c, bool write)
+{
+  workqueue_reap (c->closure);
+}
+
+workqueue_h
+workqueue_new (unsigned threads, size_t depth)
+{
+  workqueue_h h = NULL;
+  size_t size = 2;
+  unsigned i;
+  while (size < depth)
+    size <<= 1;
+  while (NULL == h)
+    h = malloc (sizeof(workqueue_t));
+  ring_init (&h->todo, size);
+  ring_init (&h->done, size);
+  h->depth = size;
+  h->outstanding = 0;
+  sem_init (&h->sem, 0, 0);
+  if (-1 == (h->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)))
+    {
+      // LCOV_EXCL_START
+      perror ("workqueue eventfd");
+      return NULL;
+      // LCOV_EXCL_STOP
+    }
+  sockets_watch (h->efd, &workqueue_can, h);
+  for (i = 0; i < threads; i++)
+    {
+      pthread_t t;
+      if (0 != pthread_create (&t, NULL, &worker, h))
+	perror ("workqueue pthread_create"); // LCOV_EXCL_LINE
+      else
+	pthread_detach (t);
+    }
+  return h;
+}
+
+/* Returns false when the queue is full, the caller should do the job. */
+bool
+workqueue_submit (workqueue_h h, workqueue_f job, workqueue_f done, void *c)
+{
+  workqueue_job_t j =
+    { .job = job, .done = done, .closure = c, };
+  if (h->outstanding >= h->depth || !ring_push (&h->todo, &j))
+    return false;
+  h->outstanding++;
+  sem_post (&h->sem);
+  return true;
+}
+
+/* Waits out every job submitted and runs its done, for the way out once the
+ * event loop no longer does. */
+void
+workqueue_drain (workqueue_h h)
+{
+  struct pollfd p =
+    { .fd = h->efd, .events = POLLIN, .revents = 0, };
+  while (0 < h->outstanding)
+    {
+      if (-1 == poll (&p, 1, -1) && EINTR != errno)
+	{
+	  perror ("workqueue poll"); // LCOV_EXCL_LINE
+	  return; // LCOV_EXCL_LINE
+	}
+      workqueue_reap (h);
+    }
+}
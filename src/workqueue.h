@@ -0,0 +1,41 @@
+/*  tor2web
+ *  Copyright (C) 2017  Michael Mestnik <cheako+github_com@mikemestnik.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOR2WEB_WORKQUEUE_H
+#define __TOR2WEB_WORKQUEUE_H
+
+/**
+ * @file workqueue.h
+ * @brief Run jobs on worker threads, finish them on the event loop
+ * @author Mike Mestnik
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct workqueue *workqueue_h;
+typedef void
+(*workqueue_f) (void *);
+
+workqueue_h
+workqueue_new (unsigned, size_t);
+bool
+workqueue_submit (workqueue_h, workqueue_f, workqueue_f, void *);
+void
+workqueue_drain (workqueue_h);
+
+#endif